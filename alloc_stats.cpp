@@ -0,0 +1,119 @@
+/*
+This file contains the malloc/calloc/realloc wrappers and counters of the instrumented build. See alloc_stats.hpp.
+*/
+
+#include "alloc_stats.hpp"
+
+#ifdef GBS2MIDI_ALLOC_STATS
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <atomic>
+
+static const char* const ALLOC_STAGE_NAMES[ALLOC_STAGE_COUNT] = {"other", "spawn", "parse", "filter", "convert", "serialise", "write"};
+
+// plain integers, so that reading them from inside malloc never needs an allocation of its own
+static thread_local allocStage currentStage = ALLOC_STAGE_OTHER;
+static thread_local int currentAddress = -1; // -1 when no register is being handled
+
+static std::atomic<uint64_t> stageAllocations[ALLOC_STAGE_COUNT];
+static std::atomic<uint64_t> stageBytes[ALLOC_STAGE_COUNT];
+static std::atomic<uint64_t> registerAllocations[0x100];
+static std::atomic<uint64_t> registerBytes[0x100];
+
+static void countAllocation(size_t size){
+	stageAllocations[currentStage].fetch_add(1, std::memory_order_relaxed);
+	stageBytes[currentStage].fetch_add(size, std::memory_order_relaxed);
+	if (currentAddress >= 0) {
+		registerAllocations[currentAddress].fetch_add(1, std::memory_order_relaxed);
+		registerBytes[currentAddress].fetch_add(size, std::memory_order_relaxed);
+	}
+}
+
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size){
+	countAllocation(size);
+	return __real_malloc(size);
+}
+void* __wrap_calloc(size_t count, size_t size){
+	countAllocation(count * size);
+	return __real_calloc(count, size);
+}
+void* __wrap_realloc(void* ptr, size_t size){ // a realloc may move the block, so it is counted like a new allocation
+	countAllocation(size);
+	return __real_realloc(ptr, size);
+}
+}
+
+alloc_stage_scope::alloc_stage_scope(allocStage stage) : prevStage(currentStage) {
+	currentStage = stage;
+}
+alloc_stage_scope::~alloc_stage_scope(){
+	currentStage = prevStage;
+}
+alloc_register_scope::alloc_register_scope(uint8_t address) : prevAddress(currentAddress) {
+	currentAddress = address;
+}
+alloc_register_scope::~alloc_register_scope(){
+	currentAddress = prevAddress;
+}
+
+void allocStatsReset(){
+	for (int stage=0; stage < ALLOC_STAGE_COUNT; stage++) {
+		stageAllocations[stage] = 0;
+		stageBytes[stage] = 0;
+	}
+	for (int address=0; address < 0x100; address++) {
+		registerAllocations[address] = 0;
+		registerBytes[address] = 0;
+	}
+}
+alloc_counts allocStatsForStage(allocStage stage){
+	alloc_counts counts;
+	counts.allocations = stageAllocations[stage];
+	counts.bytes = stageBytes[stage];
+	return counts;
+}
+alloc_counts allocStatsForRegister(uint8_t address){
+	alloc_counts counts;
+	counts.allocations = registerAllocations[address];
+	counts.bytes = registerBytes[address];
+	return counts;
+}
+alloc_counts allocStatsTotal(){
+	alloc_counts total;
+	for (int stage=0; stage < ALLOC_STAGE_COUNT; stage++) {
+		total.allocations += stageAllocations[stage];
+		total.bytes += stageBytes[stage];
+	}
+	return total;
+}
+
+std::string allocStats2json(){
+	char buffer[128];
+	std::string json = "{\"stages\":{";
+	for (int stage=0; stage < ALLOC_STAGE_COUNT; stage++) {
+		alloc_counts counts = allocStatsForStage((allocStage)stage);
+		snprintf(buffer, sizeof(buffer), "%s\"%s\":{\"allocations\":%llu,\"bytes\":%llu}", stage ? "," : "", ALLOC_STAGE_NAMES[stage], (unsigned long long)counts.allocations, (unsigned long long)counts.bytes);
+		json += buffer;
+	}
+	json += "},\"registers\":{";
+	bool first = true;
+	for (int address=0; address < 0x100; address++) {
+		alloc_counts counts = allocStatsForRegister(address);
+		if (counts.allocations == 0) continue;
+		snprintf(buffer, sizeof(buffer), "%s\"ff%02x\":{\"allocations\":%llu,\"bytes\":%llu}", first ? "" : ",", address, (unsigned long long)counts.allocations, (unsigned long long)counts.bytes);
+		json += buffer;
+		first = false;
+	}
+	json += "}}";
+	return json;
+}
+
+#endif
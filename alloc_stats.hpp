@@ -0,0 +1,62 @@
+/*
+This file contains the allocation accounting used by the instrumented build (make bin/gbs2midi-allocstats or make bench-allocstats).
+The instrumented build is compiled with -DGBS2MIDI_ALLOC_STATS and linked with --wrap for malloc, calloc and realloc, so every heap allocation (including the ones made by operator new and by libsmfc) is counted.
+Allocations are attributed to the pipeline stage that is active on the calling thread, and during conversion also to the register address that is being handled.
+In a normal build the macros expand to nothing and none of this code is compiled.
+*/
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+enum allocStage
+{
+	ALLOC_STAGE_OTHER, // anything outside of the stages below, e.g. argument parsing
+	ALLOC_STAGE_SPAWN,
+	ALLOC_STAGE_PARSE,
+	ALLOC_STAGE_FILTER,
+	ALLOC_STAGE_CONVERT,
+	ALLOC_STAGE_SERIALISE,
+	ALLOC_STAGE_WRITE,
+	ALLOC_STAGE_COUNT
+};
+
+#ifdef GBS2MIDI_ALLOC_STATS
+
+struct alloc_counts {
+	uint64_t allocations = 0;
+	uint64_t bytes = 0;
+};
+
+// sets the stage of the calling thread until the end of the enclosing scope
+class alloc_stage_scope {
+public:
+	explicit alloc_stage_scope(allocStage stage);
+	~alloc_stage_scope();
+private:
+	allocStage prevStage;
+};
+// attributes allocations of the calling thread to a register address (minus 0xFF00) until the end of the enclosing scope
+class alloc_register_scope {
+public:
+	explicit alloc_register_scope(uint8_t address);
+	~alloc_register_scope();
+private:
+	int prevAddress;
+};
+
+void allocStatsReset();
+alloc_counts allocStatsForStage(allocStage stage);
+alloc_counts allocStatsForRegister(uint8_t address);
+alloc_counts allocStatsTotal();
+std::string allocStats2json(); // {"stages":{...},"registers":{...}}. Registers without allocations are left out.
+
+#define ALLOC_STATS_STAGE(stage) alloc_stage_scope allocStageScope(stage)
+#define ALLOC_STATS_REGISTER(address) alloc_register_scope allocRegisterScope(address)
+
+#else
+
+#define ALLOC_STATS_STAGE(stage) ((void)0)
+#define ALLOC_STATS_REGISTER(address) ((void)0)
+
+#endif
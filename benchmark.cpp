@@ -0,0 +1,236 @@
+/*
+This file contains a benchmark for each stage of the conversion: parsing iodumper text (on one thread and split across cores), converting songData to an Smf (sequentially and split into time shards), and serialising the Smf. The tick time kernel (gbTimes2midiTimes) that the conversion starts with is also timed on its own, and so is converting an --also variant (output_variant.hpp) at another PPQN.
+It runs on synthetic register streams (see synth_songdata.cpp), so no gbsplay executable or GBS file is needed.
+
+When built with allocation accounting (make bench-allocstats), it also reports the heap allocations of each stage and checks that converting redundant register writes allocates nothing. The exit code is nonzero if that check fails.
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <algorithm> // std::equal, std::max
+
+#include "gb_reg_write.h"
+#include "from_gbsplay.hpp"
+#include "to_midi.hpp"
+#include "synth_songdata.hpp"
+#include "output_variant.hpp"
+#include "libsmfc.h"
+#include "alloc_stats.hpp"
+
+const uint32_t MASTER_CLOCK = 0x400000;
+
+void displayHelp(){
+	printf("How to use: \n./gbs2midi-bench [--sizes=10,60,600] [--ppqn=32767] [--repeat=3] [--seed=1]\n");
+	printf("--sizes is a comma separated list of stream lengths in seconds. Every stage is run --repeat times for each size and the fastest run is reported.\n");
+}
+
+static double bestOfMilliseconds(int repeat, const std::function<void()>& setUp, const std::function<void()>& stage){
+	double best = 0;
+	for (int i=0; i<repeat; i++) {
+		setUp();
+		auto start = std::chrono::steady_clock::now();
+		stage();
+		auto stop = std::chrono::steady_clock::now();
+		double milliseconds = std::chrono::duration<double, std::milli>(stop - start).count();
+		if (i == 0 || milliseconds < best) best = milliseconds;
+	}
+	return best;
+}
+static size_t countSmfEvents(Smf* midiFile){
+	size_t eventCount = 0;
+	for (int trackIndex=0; trackIndex < midiFile->numTracks; trackIndex++) {
+		for (SmfEvent* event = midiFile->track[trackIndex]->firstEvent; event != nullptr; event = event->nextEvent) eventCount++;
+	}
+	return eventCount;
+}
+static size_t serialiseSmf(Smf* midiFile, SmfWriteBuffer& writeBuffer){ // the same work as smfWriteStream, minus the I/O
+	size_t totalSize = 0;
+	writeBuffer.size = 0;
+	smfWriteHeader(midiFile, &writeBuffer);
+	for (int trackIndex=0; trackIndex < midiFile->numTracks; trackIndex++) {
+		smfTrackSerialize(midiFile->track[trackIndex], &writeBuffer);
+		totalSize += writeBuffer.size;
+		writeBuffer.size = 0;
+	}
+	return totalSize;
+}
+#ifdef GBS2MIDI_ALLOC_STATS
+static uint64_t convertAllocations(std::vector<gb_reg_write>& songData, int PPQN, size_t& eventCount){
+	allocStatsReset();
+	Smf* midiFile = songData2smf(songData, MASTER_CLOCK, PPQN);
+	uint64_t allocations = allocStatsTotal().allocations;
+	eventCount = countSmfEvents(midiFile);
+	smfDelete(midiFile);
+	return allocations;
+}
+// Converts a stream with and without a tail of redundant writes. Every midi event costs exactly one allocation, so any other difference in allocations between the two runs was caused by handling the redundant writes.
+static bool checkSteadyStateAllocations(double seconds, uint32_t seed, int PPQN){
+	const size_t REDUNDANT_WRITES = 100000;
+	std::vector<gb_reg_write> songData;
+	generateSyntheticSongData(songData, seconds, seed);
+	size_t eventCount, tailEventCount;
+	uint64_t allocations = convertAllocations(songData, PPQN, eventCount);
+	appendRedundantWrites(songData, REDUNDANT_WRITES);
+	uint64_t tailAllocations = convertAllocations(songData, PPQN, tailEventCount);
+	int64_t extraAllocations = (int64_t)(tailAllocations - allocations) - (int64_t)(tailEventCount - eventCount);
+	printf("steady state: %zu redundant writes, %zu events, %lld allocations not caused by events\n", REDUNDANT_WRITES, tailEventCount - eventCount, (long long)extraAllocations);
+	if (extraAllocations != 0) {
+		fprintf(stderr, "Error: handling redundant register writes allocated memory. Allocations per register: %s\n", allocStats2json().c_str());
+		return false;
+	}
+	return true;
+}
+#endif
+
+int main(int argc, char *const argv[]){
+
+std::vector<double> sizesInSeconds = {10, 60, 600};
+int PPQN = 0x7fff;
+int repeat = 3;
+uint32_t seed = 1;
+for (int i=1; i<argc; i++) {
+	std::string arg = argv[i];
+	if (arg.rfind("--sizes=", 0) == 0) {
+		sizesInSeconds.clear();
+		const char* p = arg.c_str() + strlen("--sizes=");
+		while (*p) {
+			char* end;
+			double size = strtod(p, &end);
+			if (end == p) break;
+			if (size > 0) sizesInSeconds.push_back(size);
+			p = (*end == ',') ? end + 1 : end;
+		}
+	} else if (arg.rfind("--ppqn=", 0) == 0) {
+		PPQN = atoi(arg.c_str() + strlen("--ppqn="));
+	} else if (arg.rfind("--repeat=", 0) == 0) {
+		repeat = atoi(arg.c_str() + strlen("--repeat="));
+	} else if (arg.rfind("--seed=", 0) == 0) {
+		seed = strtoul(arg.c_str() + strlen("--seed="), nullptr, 10);
+	} else {
+		displayHelp();
+		return 1;
+	}
+}
+if (PPQN < 1 || PPQN > 0x7fff) PPQN = 0x7fff;
+if (repeat < 1) repeat = 1;
+
+printf("PPQN: %d, repeat: %d, seed: %u\n", PPQN, repeat, seed);
+printf("%-10s %12s | %12s %10s | %12s %10s %12s | %12s %10s %12s\n", "seconds", "writes", "parse ms", "MB/s", "convert ms", "Mwrites/s", "events", "serialise ms", "MB/s", "midi bytes");
+
+double totalMilliseconds = 0;
+for (double seconds : sizesInSeconds) {
+	std::vector<gb_reg_write> songData;
+	generateSyntheticSongData(songData, seconds, seed);
+	const std::string iodumperText = songData2iodumperText(songData);
+
+	std::vector<gb_reg_write> parsedSongData;
+	double parseMilliseconds = bestOfMilliseconds(repeat, [&]{ parsedSongData = std::vector<gb_reg_write>(); }, [&]{
+		uint64_t cyclesPassed = 0;
+		iodumperText2songData(iodumperText.data(), iodumperText.size(), parsedSongData, cyclesPassed);
+	});
+	if (parsedSongData.size() != songData.size()) {
+		fprintf(stderr, "Error: parsing the iodumper text gave %zu writes instead of %zu.\n", parsedSongData.size(), songData.size());
+		return 1;
+	}
+	// split into chunks at newlines and parsed on every core, as for .iodump files
+	std::vector<gb_reg_write> parallelParsedSongData;
+	double parallelParseMilliseconds = bestOfMilliseconds(repeat, [&]{ parallelParsedSongData = std::vector<gb_reg_write>(); }, [&]{
+		uint64_t cyclesPassed = 0;
+		iodumperText2songDataParallel(iodumperText.data(), iodumperText.size(), parallelParsedSongData, cyclesPassed);
+	});
+	if (parallelParsedSongData.size() != parsedSongData.size() || std::equal(parsedSongData.begin(), parsedSongData.end(), parallelParsedSongData.begin(), [](const gb_reg_write& a, const gb_reg_write& b){ return a.time == b.time && a.address == b.address && a.value == b.value; }) == false) {
+		fprintf(stderr, "Error: parsing the iodumper text in parallel gave different writes.\n");
+		return 1;
+	}
+
+	Smf* midiFile = nullptr;
+	double convertMilliseconds = bestOfMilliseconds(repeat, [&]{ smfDelete(midiFile); midiFile = nullptr; }, [&]{
+		midiFile = songData2smf(songData, MASTER_CLOCK, PPQN);
+	});
+	size_t eventCount = countSmfEvents(midiFile);
+	// split into time shards, each converted on its own thread from a checkpoint. At least 4, so that the shards are checked against the sequential result on any machine.
+	const unsigned int shardThreadCount = std::max(4u, std::thread::hardware_concurrency());
+	Smf* shardedMidiFile = nullptr;
+	double shardedConvertMilliseconds = bestOfMilliseconds(repeat, [&]{ smfDelete(shardedMidiFile); shardedMidiFile = nullptr; }, [&]{
+		shardedMidiFile = songData2smfParallel(songData, MASTER_CLOCK, PPQN, nullptr, shardThreadCount);
+	});
+	std::string midiBytes, shardedMidiBytes;
+	smf2midiBytes(midiFile, midiBytes);
+	smf2midiBytes(shardedMidiFile, shardedMidiBytes);
+	smfDelete(shardedMidiFile);
+	if (midiBytes != shardedMidiBytes) {
+		fprintf(stderr, "Error: converting in time shards gave a different midi file.\n");
+		return 1;
+	}
+
+	// the tick time kernel on its own, against converting one write at a time
+	const uint64_t midiTicksPerSecond = midiTicksPerSecondFromPPQN(PPQN);
+	std::vector<uint64_t> midiTimes;
+	double batchTickMilliseconds = bestOfMilliseconds(repeat, []{}, [&]{ gbTimes2midiTimes(songData, MASTER_CLOCK, midiTicksPerSecond, midiTimes); });
+	double perWriteTickMilliseconds = bestOfMilliseconds(repeat, []{}, [&]{
+		for (size_t i=0; i<songData.size(); i++) midiTimes[i] = gbTime2midiTime(songData[i].time, MASTER_CLOCK, midiTicksPerSecond);
+	});
+
+	SmfWriteBuffer writeBuffer;
+	smfWriteBufferInit(&writeBuffer);
+	size_t midiSize = 0;
+	double serialiseMilliseconds = bestOfMilliseconds(repeat, []{}, [&]{ midiSize = serialiseSmf(midiFile, writeBuffer); });
+	// the same bytes with each track serialised on its own thread, as the midi file is written
+	double parallelSerialiseMilliseconds = bestOfMilliseconds(repeat, []{}, [&]{ smf2midiBytes(midiFile, midiBytes); });
+	if (midiBytes.size() != midiSize) {
+		fprintf(stderr, "Error: serialising the tracks in parallel gave a different midi file size.\n");
+		return 1;
+	}
+	const unsigned int trackCount = midiFile->numTracks;
+	smfDelete(midiFile);
+
+	// an --also variant at another resolution, which is filtered and converted from the register writes again
+	output_variant variant;
+	variant.PPQN = 480;
+	double variantMilliseconds = bestOfMilliseconds(repeat, []{}, [&]{
+		Smf* variantMidiFile = songData2variantSmf(songData, MASTER_CLOCK, variant, PPQN);
+		serialiseSmf(variantMidiFile, writeBuffer);
+		smfDelete(variantMidiFile);
+	});
+	smfWriteBufferFree(&writeBuffer);
+
+	totalMilliseconds += parseMilliseconds + convertMilliseconds + serialiseMilliseconds;
+	printf("%-10g %12zu | %12.2f %10.1f | %12.2f %10.2f %12zu | %12.2f %10.1f %12zu\n", seconds, songData.size(),
+		parseMilliseconds, iodumperText.size() / 1e3 / parseMilliseconds,
+		convertMilliseconds, songData.size() / 1e3 / convertMilliseconds, eventCount,
+		serialiseMilliseconds, midiSize / 1e3 / serialiseMilliseconds, midiSize);
+	printf("%-10s tick times: batch %.3f ms (%.0f Mwrites/s), one write at a time %.3f ms (%.0f Mwrites/s)\n", "",
+		batchTickMilliseconds, songData.size() / 1e3 / batchTickMilliseconds, perWriteTickMilliseconds, songData.size() / 1e3 / perWriteTickMilliseconds);
+	printf("%-10s parallel parse: %.2f ms (%.1f MB/s) on up to %u threads\n", "", parallelParseMilliseconds, iodumperText.size() / 1e3 / parallelParseMilliseconds, std::max(1u, std::thread::hardware_concurrency()));
+	printf("%-10s sharded convert: %.2f ms (%.2f Mwrites/s) on %u threads\n", "", shardedConvertMilliseconds, songData.size() / 1e3 / shardedConvertMilliseconds, shardThreadCount);
+	printf("%-10s parallel serialise: %.2f ms (%.1f MB/s) on up to %u threads\n", "", parallelSerialiseMilliseconds, midiSize / 1e3 / parallelSerialiseMilliseconds, std::min(std::max(1u, std::thread::hardware_concurrency()), trackCount));
+	printf("%-10s variant: filter, convert at %d PPQN and serialise %.2f ms\n", "", variant.PPQN, variantMilliseconds);
+#ifdef GBS2MIDI_ALLOC_STATS
+	allocStatsReset();
+	{
+		std::vector<gb_reg_write> allocParsedSongData;
+		uint64_t cyclesPassed = 0;
+		iodumperText2songData(iodumperText.data(), iodumperText.size(), allocParsedSongData, cyclesPassed);
+	}
+	uint64_t parseAllocations = allocStatsForStage(ALLOC_STAGE_PARSE).allocations;
+	size_t allocEventCount;
+	uint64_t allocations = convertAllocations(songData, PPQN, allocEventCount);
+	printf("%-10s allocations: parse %llu, convert %llu (%.3f per write, %.3f per event)\n", "", (unsigned long long)parseAllocations,
+		(unsigned long long)allocations, (double)allocations / songData.size(), (double)allocations / allocEventCount);
+#endif
+	fflush(stdout);
+}
+printf("total: %.2f ms\n", totalMilliseconds); // parse + convert + serialise over all sizes
+#ifdef GBS2MIDI_ALLOC_STATS
+if (checkSteadyStateAllocations(sizesInSeconds.empty() ? 10 : sizesInSeconds[0], seed, PPQN) == false) return 1;
+#endif
+
+return 0;
+}
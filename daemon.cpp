@@ -0,0 +1,385 @@
+/*
+This file contains the conversion daemon. See daemon.hpp for the protocol.
+
+The main thread accepts connections and reads each request's header. It answers stats requests itself, so they are answered even when every worker is busy. Convert jobs are queued for the workers, which read the register stream (if any), convert, and reply.
+Unix domain sockets are only used on POSIX systems. On Windows, --daemon prints an error.
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "daemon.hpp"
+
+#ifdef WIN32
+
+int runDaemon(const daemon_options& options){
+	(void)options;
+	fprintf(stderr, "Error: --daemon needs Unix domain sockets, which this build doesn't support.\n");
+	return 1;
+}
+int connectToDaemon(const std::string& socketPath){ (void)socketPath; return -1; }
+bool sendAll(int fd, const char* data, size_t size){ (void)fd; (void)data; (void)size; return false; }
+bool receiveAll(int fd, char* data, size_t size){ (void)fd; (void)data; (void)size; return false; }
+bool receiveLine(int fd, std::string& line, size_t maxLength){ (void)fd; (void)line; (void)maxLength; return false; }
+
+#else
+
+#include <deque>
+#include <algorithm> // std::max
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "gb_reg_write.h"
+#include "from_gbsplay.hpp"
+#include "to_midi.hpp"
+#include "reg_write_filter.hpp"
+#include "ppqn_analysis.hpp"
+#include "run_metrics.hpp"
+
+static const uint32_t MASTER_CLOCK = 0x400000; // game boy cycles per second, as in main.cpp
+static const size_t MAX_IODUMP_SIZE = (size_t)1 << 30;
+static const int HEADER_TIMEOUT_SECONDS = 5; // the main thread reads headers, so a slow client can only hold it up this long
+static const int JOB_TIMEOUT_SECONDS = 60;
+
+int connectToDaemon(const std::string& socketPath){
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	if (socketPath.size() >= sizeof(address.sun_path)) return -1;
+	strcpy(address.sun_path, socketPath.c_str());
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+	if (connect(fd, (const sockaddr*)&address, sizeof(address)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+bool sendAll(int fd, const char* data, size_t size){
+	while (size > 0) {
+		ssize_t sent = write(fd, data, size);
+		if (sent < 0 && errno == EINTR) continue;
+		if (sent <= 0) return false;
+		data += sent;
+		size -= sent;
+	}
+	return true;
+}
+bool receiveAll(int fd, char* data, size_t size){
+	while (size > 0) {
+		ssize_t received = read(fd, data, size);
+		if (received < 0 && errno == EINTR) continue;
+		if (received <= 0) return false;
+		data += received;
+		size -= received;
+	}
+	return true;
+}
+bool receiveLine(int fd, std::string& line, size_t maxLength){ // one byte at a time, so that nothing after the line is consumed
+	line.clear();
+	char c;
+	while (line.size() <= maxLength) {
+		if (receiveAll(fd, &c, 1) == false) return false;
+		if (c == '\n') return true;
+		line += c;
+	}
+	return false;
+}
+static void setTimeout(int fd, int seconds){
+	timeval timeout{};
+	timeout.tv_sec = seconds;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+static bool sendOk(int fd, const std::string& payload){
+	std::string header = "ok " + std::to_string(payload.size()) + "\n";
+	return sendAll(fd, header.data(), header.size()) && sendAll(fd, payload.data(), payload.size());
+}
+static bool sendError(int fd, const std::string& message){
+	std::string reply = "error " + message + "\n";
+	return sendAll(fd, reply.data(), reply.size());
+}
+
+struct daemon_job {
+	int fd = -1;
+	std::string gbsFilename;
+	size_t iodumpSize = 0;
+	int subsongNumber = 1;
+	int timeInSeconds = 150;
+	int PPQN = 0x7fff;
+	bool autoPPQN = false; // ppqn auto: chosen by chooseMinimalPPQN
+	double maxTimingErrorMilliseconds = 0;
+	std::string outfilename; // empty: send the midi file back
+	bool filterRegWrites = true;
+};
+
+struct daemon_state {
+	unsigned int workerCount;
+	unsigned int maxJobsInFlight;
+	std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+	std::mutex queueMutex;
+	std::condition_variable queueCondition;
+	std::deque<daemon_job> queue;
+	bool stopping = false;
+
+	std::atomic<unsigned int> jobsInFlight{0}; // queued or running
+	std::atomic<uint64_t> jobsAccepted{0};
+	std::atomic<uint64_t> jobsCompleted{0};
+	std::atomic<uint64_t> jobsFailed{0};
+	std::atomic<uint64_t> jobsRejected{0};
+	std::atomic<uint64_t> regWritesProcessed{0};
+	std::atomic<uint64_t> midiBytes{0};
+	std::atomic<uint64_t> jobMicroseconds{0};
+};
+
+static std::string daemonStats2json(daemon_state& state){
+	size_t queued;
+	{
+		std::lock_guard<std::mutex> lock(state.queueMutex);
+		queued = state.queue.size();
+	}
+	double uptimeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - state.startTime).count();
+	char buffer[1024];
+	snprintf(buffer, sizeof(buffer), "{\"workers\":%u,\"max_jobs_in_flight\":%u,\"jobs_in_flight\":%u,\"jobs_queued\":%zu,\"jobs_accepted\":%llu,\"jobs_completed\":%llu,\"jobs_failed\":%llu,\"jobs_rejected\":%llu,\"register_writes\":%llu,\"midi_bytes\":%llu,\"job_ms_total\":%.3f,\"uptime_s\":%.3f,\"peak_memory_kb\":%ld}",
+		state.workerCount, state.maxJobsInFlight, state.jobsInFlight.load(), queued,
+		(unsigned long long)state.jobsAccepted.load(), (unsigned long long)state.jobsCompleted.load(), (unsigned long long)state.jobsFailed.load(), (unsigned long long)state.jobsRejected.load(),
+		(unsigned long long)state.regWritesProcessed.load(), (unsigned long long)state.midiBytes.load(), state.jobMicroseconds.load() / 1000.0, uptimeSeconds, getPeakMemoryKilobytes());
+	return buffer;
+}
+
+// reads the header of a request. Returns false and sets error if it isn't valid.
+static bool receiveRequest(int fd, std::string& command, daemon_job& job, std::string& error){
+	if (receiveLine(fd, command) == false) {
+		error = "no request";
+		return false;
+	}
+	std::string line;
+	while (true) {
+		if (receiveLine(fd, line) == false) {
+			error = "the request header must end with an empty line";
+			return false;
+		}
+		if (line.empty()) break;
+		size_t space = line.find(' ');
+		std::string key = line.substr(0, space);
+		std::string value = space == std::string::npos ? "" : line.substr(space + 1);
+		if (key == "gbs") {
+			job.gbsFilename = value;
+		} else if (key == "iodump") {
+			job.iodumpSize = strtoull(value.c_str(), nullptr, 10);
+			if (job.iodumpSize == 0 || job.iodumpSize > MAX_IODUMP_SIZE) {
+				error = "invalid iodump size " + value;
+				return false;
+			}
+		} else if (key == "subsong") {
+			job.subsongNumber = atoi(value.c_str());
+		} else if (key == "seconds") {
+			job.timeInSeconds = atoi(value.c_str());
+		} else if (key == "ppqn") {
+			job.autoPPQN = parseAutoPPQN(value, job.maxTimingErrorMilliseconds);
+			if (job.autoPPQN == false) job.PPQN = atoi(value.c_str());
+		} else if (key == "output") {
+			job.outfilename = value;
+		} else if (key == "no-filter") {
+			job.filterRegWrites = false;
+		} else {
+			error = "unknown key " + key;
+			return false;
+		}
+	}
+	// the same limits as the command line
+	if (job.subsongNumber < 1) job.subsongNumber = 1;
+	if (job.timeInSeconds < 1) job.timeInSeconds = 150;
+	if (job.PPQN < 1 || job.PPQN > 0x7fff) job.PPQN = 0x7fff;
+	if (command == "convert" && (job.gbsFilename.empty() == false) == (job.iodumpSize > 0)) {
+		error = "a convert request needs either gbs or iodump";
+		return false;
+	}
+	return true;
+}
+
+// runs one convert job. payload is the midi file, or the job's metrics if the daemon wrote the file.
+static bool runJob(const daemon_job& job, std::string& payload, std::string& error, run_metrics& metrics){
+	stage_timer totalTimer;
+	std::vector<gb_reg_write> songData;
+	metrics.subsongNumber = job.subsongNumber;
+	metrics.outfilename = job.outfilename;
+	if (job.iodumpSize > 0) {
+		metrics.inFilename = "iodump";
+		std::string iodumperText(job.iodumpSize, '\0');
+		if (receiveAll(job.fd, &iodumperText[0], iodumperText.size()) == false) {
+			error = "the register stream ended early";
+			return false;
+		}
+		stage_timer parseTimer;
+		uint64_t cyclesPassed = 0;
+		iodumperText2songData(iodumperText.data(), iodumperText.size(), songData, cyclesPassed);
+		metrics.parseMilliseconds = parseTimer.stop();
+	} else {
+		metrics.inFilename = job.gbsFilename;
+		if (access(job.gbsFilename.c_str(), F_OK) != 0) {
+			error = "input file not found: " + job.gbsFilename;
+			return false;
+		}
+		if (access("gbsplay", F_OK) != 0) {
+			error = "gbsplay executable does not exist in the daemon's directory";
+			return false;
+		}
+		if (gbsplayStdout2songData(songData, job.gbsFilename, job.subsongNumber, job.timeInSeconds, &metrics) == false) {
+			error = "gbsplay failed or its output was cut short";
+			return false;
+		}
+	}
+	const int PPQN = job.autoPPQN ? chooseMinimalPPQN(songData, MASTER_CLOCK, job.maxTimingErrorMilliseconds) : job.PPQN;
+	metrics.PPQN = PPQN;
+	if (job.filterRegWrites) filterRedundantRegWrites(songData, MASTER_CLOCK, PPQN, &metrics);
+
+	if (job.outfilename.empty() == false) {
+		if (songData2midi(songData, MASTER_CLOCK, job.outfilename, PPQN, &metrics) == false) {
+			error = "could not write the midi file " + job.outfilename;
+			return false;
+		}
+		metrics.totalMilliseconds = totalTimer.stop();
+		payload = runMetrics2json(metrics);
+		return true;
+	}
+	stage_timer convertTimer;
+	Smf* midiFile = songData2smf(songData, MASTER_CLOCK, PPQN, &metrics);
+	metrics.convertMilliseconds = convertTimer.stop();
+	bool serialised = smf2midiBytes(midiFile, payload, &metrics);
+	smfDelete(midiFile);
+	if (serialised == false) error = "could not serialise the midi file";
+	return serialised;
+}
+
+static void workerLoop(daemon_state& state){
+	while (true) {
+		daemon_job job;
+		{
+			std::unique_lock<std::mutex> lock(state.queueMutex);
+			state.queueCondition.wait(lock, [&]{ return state.stopping || state.queue.empty() == false; });
+			if (state.queue.empty()) return; // stopping, and every queued job is done
+			job = state.queue.front();
+			state.queue.pop_front();
+		}
+		stage_timer jobTimer;
+		run_metrics metrics;
+		std::string payload, error;
+		bool succeeded = runJob(job, payload, error, metrics);
+		succeeded = succeeded ? sendOk(job.fd, payload) : (sendError(job.fd, error), false);
+		close(job.fd);
+
+		state.jobMicroseconds += (uint64_t)(jobTimer.stop() * 1000);
+		if (succeeded) {
+			state.jobsCompleted++;
+			state.regWritesProcessed += metrics.regWritesProcessed;
+			state.midiBytes += metrics.midiBytes;
+		} else {
+			state.jobsFailed++;
+		}
+		state.jobsInFlight--;
+	}
+}
+
+static volatile sig_atomic_t stopRequested = 0;
+static void requestStop(int){
+	stopRequested = 1;
+}
+
+int runDaemon(const daemon_options& options){
+	daemon_state state;
+	state.workerCount = options.workerCount ? options.workerCount : std::max(1u, std::thread::hardware_concurrency());
+	state.maxJobsInFlight = options.maxJobsInFlight ? options.maxJobsInFlight : 4 * state.workerCount;
+
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	if (options.socketPath.empty() || options.socketPath.size() >= sizeof(address.sun_path)) {
+		fprintf(stderr, "Error: the socket path must be between 1 and %zu characters long.\n", sizeof(address.sun_path) - 1);
+		return 1;
+	}
+	strcpy(address.sun_path, options.socketPath.c_str());
+	int runningFd = connectToDaemon(options.socketPath);
+	if (runningFd >= 0) {
+		close(runningFd);
+		fprintf(stderr, "Error: a daemon is already listening on %s.\n", options.socketPath.c_str());
+		return 1;
+	}
+	unlink(options.socketPath.c_str()); // left behind by a daemon that didn't exit cleanly
+	int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenFd < 0 || bind(listenFd, (const sockaddr*)&address, sizeof(address)) != 0 || listen(listenFd, SOMAXCONN) != 0) {
+		fprintf(stderr, "Error: could not listen on %s: %s.\n", options.socketPath.c_str(), strerror(errno));
+		if (listenFd >= 0) close(listenFd);
+		return 1;
+	}
+
+	// no SA_RESTART, so that accept returns when a signal arrives
+	struct sigaction stopAction{};
+	stopAction.sa_handler = requestStop;
+	sigaction(SIGINT, &stopAction, nullptr);
+	sigaction(SIGTERM, &stopAction, nullptr);
+	signal(SIGPIPE, SIG_IGN); // a client that hangs up early must not end the daemon
+
+	std::vector<std::thread> workers;
+	for (unsigned int i=0; i < state.workerCount; i++) workers.emplace_back(workerLoop, std::ref(state));
+	if (verboseOutput) fprintf(stderr, "Listening on %s with %u workers, at most %u jobs in flight.\n", options.socketPath.c_str(), state.workerCount, state.maxJobsInFlight);
+
+	while (stopRequested == 0) {
+		int clientFd = accept(listenFd, nullptr, nullptr);
+		if (clientFd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			fprintf(stderr, "Error: accept failed: %s.\n", strerror(errno));
+			break;
+		}
+		setTimeout(clientFd, HEADER_TIMEOUT_SECONDS);
+		std::string command, error;
+		daemon_job job;
+		if (receiveRequest(clientFd, command, job, error) == false) {
+			sendError(clientFd, error);
+			close(clientFd);
+		} else if (command == "stats") {
+			sendOk(clientFd, daemonStats2json(state));
+			close(clientFd);
+		} else if (command != "convert") {
+			sendError(clientFd, "unknown command " + command);
+			close(clientFd);
+		} else if (state.jobsInFlight >= state.maxJobsInFlight) {
+			state.jobsRejected++;
+			sendError(clientFd, "busy: " + std::to_string(state.maxJobsInFlight) + " jobs in flight");
+			close(clientFd);
+		} else {
+			setTimeout(clientFd, JOB_TIMEOUT_SECONDS);
+			job.fd = clientFd;
+			state.jobsAccepted++;
+			state.jobsInFlight++;
+			std::lock_guard<std::mutex> lock(state.queueMutex);
+			state.queue.push_back(job);
+			state.queueCondition.notify_one();
+		}
+	}
+
+	close(listenFd);
+	unlink(options.socketPath.c_str());
+	{
+		std::lock_guard<std::mutex> lock(state.queueMutex);
+		state.stopping = true;
+	}
+	state.queueCondition.notify_all();
+	for (std::thread& worker : workers) worker.join();
+	if (verboseOutput) fprintf(stderr, "Stopped. %s\n", daemonStats2json(state).c_str());
+	return 0;
+}
+
+#endif
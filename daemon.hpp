@@ -0,0 +1,35 @@
+/*
+This file contains the conversion daemon (gbs2midi --daemon=socket) and the socket helpers it shares with its test client.
+
+The daemon listens on a Unix domain socket and handles one request per connection. A request is a command line, then "key value" lines, then an empty line:
+	convert
+	gbs <path>        a GBS file for gbsplay to play, relative to the daemon's working directory, or
+	iodump <size>     the size of a register stream in gbsplay's iodumper format, which is sent after the empty line
+	subsong <n>       default 1
+	seconds <n>       default 150
+	ppqn <n>          default 32767. auto or auto:<ms> as on the command line
+	output <path>     optional: the daemon writes the midi file there instead of sending it back
+	no-filter         optional: the same as --no-filter
+
+	stats             the daemon's health statistics as JSON
+The reply is either "ok <size>\n" followed by size bytes, or "error <message>\n". The bytes are the midi file, the job's --metrics record when output was given, or the statistics.
+Convert jobs run on a pool of worker threads. When --max-jobs jobs are already queued or running, new ones are refused with "error busy" instead of waiting.
+*/
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+struct daemon_options {
+	std::string socketPath;
+	unsigned int workerCount = 0; // 0 means one per hardware thread
+	unsigned int maxJobsInFlight = 0; // 0 means four per worker
+};
+
+int runDaemon(const daemon_options& options); // returns when SIGINT or SIGTERM is received. The return value is the process exit code.
+
+// shared with the client. Each returns false if the connection failed or was closed.
+int connectToDaemon(const std::string& socketPath); // -1 on failure
+bool sendAll(int fd, const char* data, size_t size);
+bool receiveAll(int fd, char* data, size_t size);
+bool receiveLine(int fd, std::string& line, size_t maxLength = 4096); // without the newline
@@ -0,0 +1,163 @@
+/*
+This file contains a small client for the conversion daemon (see daemon.hpp), used to try it out and to load it with many jobs at once.
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <unistd.h>
+
+#include "daemon.hpp"
+#include "synth_songdata.hpp"
+
+void displayHelp(){
+	printf("How to use: \n./gbs2midi-client socket stats\n./gbs2midi-client socket input subsongNumber outfile.mid [Midi_ticks_per_quarter_note] [timeInSeconds]\n");
+	printf("input is a .gbs file (gbsplay is run by the daemon, so the path is relative to the daemon's directory), a register stream saved with gbsplay -o iodumper (sent to the daemon), or synthetic:SECONDS for a generated register stream.\n");
+	printf("Options:\n");
+	printf("  --daemon-writes    let the daemon write outfile.mid (give an absolute path) and print the job's metrics instead.\n");
+	printf("  --no-filter        the same as gbs2midi --no-filter.\n");
+	printf("  --jobs=N           send the job N times and print how long they took. outfile.mid is written by the last one.\n");
+	printf("  --concurrency=N    how many of those jobs are sent at once (default 1).\n");
+}
+
+// sends one request and returns the reply's payload. Returns false and sets error if the daemon answered with an error or hung up.
+static bool sendRequest(const std::string& socketPath, const std::string& header, const std::string& body, std::string& payload, std::string& error){
+	int fd = connectToDaemon(socketPath);
+	if (fd < 0) {
+		error = "could not connect to " + socketPath;
+		return false;
+	}
+	bool result = sendAll(fd, header.data(), header.size()) && sendAll(fd, body.data(), body.size());
+	std::string replyLine;
+	if (receiveLine(fd, replyLine) == false) {
+		error = "the daemon hung up";
+		result = false;
+	} else if (replyLine.rfind("ok ", 0) == 0) {
+		payload.resize(strtoull(replyLine.c_str() + 3, nullptr, 10));
+		result = receiveAll(fd, &payload[0], payload.size());
+		if (result == false) error = "the reply ended early";
+	} else {
+		error = replyLine.rfind("error ", 0) == 0 ? replyLine.substr(6) : replyLine;
+		result = false;
+	}
+	close(fd);
+	return result;
+}
+
+int main(int argc, char *const argv[]){
+
+bool daemonWrites = false;
+bool filterRegWrites = true;
+int jobCount = 1;
+int concurrency = 1;
+std::vector<std::string> args;
+for (int i=1; i<argc; i++) {
+	std::string arg = argv[i];
+	if (arg == "--daemon-writes") {
+		daemonWrites = true;
+	} else if (arg == "--no-filter") {
+		filterRegWrites = false;
+	} else if (arg.rfind("--jobs=", 0) == 0) {
+		jobCount = atoi(arg.c_str() + strlen("--jobs="));
+	} else if (arg.rfind("--concurrency=", 0) == 0) {
+		concurrency = atoi(arg.c_str() + strlen("--concurrency="));
+	} else if (arg.rfind("--", 0) == 0) {
+		displayHelp();
+		return 1;
+	} else {
+		args.push_back(arg);
+	}
+}
+if (jobCount < 1) jobCount = 1;
+if (concurrency < 1) concurrency = 1;
+signal(SIGPIPE, SIG_IGN);
+
+std::string payload, error;
+if (args.size() == 2 && args[1] == "stats") {
+	if (sendRequest(args[0], "stats\n\n", "", payload, error) == false) {
+		fprintf(stderr, "Error: %s.\n", error.c_str());
+		return 1;
+	}
+	printf("%s\n", payload.c_str());
+	return 0;
+}
+if (args.size() < 4) {
+	displayHelp();
+	return 1;
+}
+const std::string& socketPath = args[0];
+const std::string& input = args[1];
+const std::string& outfilename = args[3];
+
+std::string header = "convert\nsubsong " + args[2] + "\n";
+if (args.size() >= 5) header += "ppqn " + args[4] + "\n";
+if (args.size() >= 6) header += "seconds " + args[5] + "\n";
+if (daemonWrites) header += "output " + outfilename + "\n";
+if (filterRegWrites == false) header += "no-filter\n";
+std::string body;
+if (input.rfind("synthetic:", 0) == 0) {
+	std::vector<gb_reg_write> songData;
+	generateSyntheticSongData(songData, atof(input.c_str() + strlen("synthetic:")));
+	body = songData2iodumperText(songData);
+} else if (input.size() >= 4 && (input.substr(input.size()-4) == ".gbs" || input.substr(input.size()-4) == ".GBS")) {
+	header += "gbs " + input + "\n";
+} else {
+	FILE* inFile = fopen(input.c_str(), "rb");
+	if (inFile == nullptr) {
+		fprintf(stderr, "Error: could not open %s.\n", input.c_str());
+		return 1;
+	}
+	char buffer[65536];
+	size_t bytesRead;
+	while ((bytesRead = fread(buffer, 1, sizeof(buffer), inFile)) > 0) body.append(buffer, bytesRead);
+	fclose(inFile);
+}
+if (body.empty() == false) header += "iodump " + std::to_string(body.size()) + "\n";
+header += "\n";
+
+// every thread takes the next job until all have been sent
+std::atomic<int> nextJob{0};
+std::atomic<int> failedJobs{0};
+std::string lastPayload;
+std::string lastError;
+auto sendJobs = [&]{
+	std::string threadPayload, threadError;
+	int job;
+	while ((job = nextJob++) < jobCount) {
+		if (sendRequest(socketPath, header, body, threadPayload, threadError) == false) {
+			if (failedJobs++ == 0) lastError = threadError;
+		} else if (job == jobCount - 1) {
+			lastPayload = threadPayload;
+		}
+	}
+};
+auto start = std::chrono::steady_clock::now();
+std::vector<std::thread> threads;
+for (int i=0; i < concurrency; i++) threads.emplace_back(sendJobs);
+for (std::thread& thread : threads) thread.join();
+double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+if (failedJobs > 0) fprintf(stderr, "Error: %d of %d jobs failed, the first with: %s.\n", failedJobs.load(), jobCount, lastError.c_str());
+if (jobCount > 1) fprintf(stderr, "%d jobs in %.1f ms (%.1f jobs/s) with %d at once.\n", jobCount, milliseconds, jobCount / (milliseconds / 1000), concurrency);
+if (lastPayload.empty() == false) {
+	if (daemonWrites) {
+		printf("%s\n", lastPayload.c_str());
+	} else {
+		FILE* outFile = (outfilename == "-") ? stdout : fopen(outfilename.c_str(), "wb");
+		bool writeSucceeded = outFile && fwrite(lastPayload.data(), 1, lastPayload.size(), outFile) == lastPayload.size();
+		if (outFile && outFile != stdout && fclose(outFile) != 0) writeSucceeded = false;
+		if (writeSucceeded == false) {
+			fprintf(stderr, "Error: could not write the midi file %s.\n", outfilename.c_str());
+			return 1;
+		}
+	}
+}
+return failedJobs > 0 ? 1 : 0;
+}
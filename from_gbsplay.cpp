@@ -1,63 +1,443 @@
 /*
 This file contains the code that converts gbsplay's output to gb_reg_write structs.
+
+gbsplay's iodumper output starts each subsong with a blank line and a "subsong N" line, followed by one line per register write:
+cccccccc aaaa=vv
+where cccccccc is the number of cycles since the previous write, aaaa is the register address and vv is the value written, all in hex.
 */
 
 #include <cstdint>
 #include <string>
 #include <cstdio>
+#include <cstring>
 #include <vector>
-#include <chrono> // for measuring performance
+#include <thread>
+#include <algorithm>
+#include <functional>
+#ifndef WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+extern char** environ;
+#endif
 
 #include "from_gbsplay.hpp"
+#include "run_metrics.hpp"
+#include "alloc_stats.hpp"
+
+static inline int hexDigitValue(char c){
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+static inline const char* parseHex(const char* p, const char* end, uint64_t& outVal){ // returns nullptr if there isn't at least one hex digit at p
+	const char* digitsStart = p;
+	uint64_t val = 0;
+	int digit;
+	while (p < end && (digit = hexDigitValue(*p)) >= 0) {
+		val = (val << 4) | digit;
+		p++;
+	}
+	outVal = val;
+	return p == digitsStart ? nullptr : p;
+}
+
+bool parseIodumperLine(const char* line, const char* lineEnd, uint64_t& cycleDiff, gb_reg_write& regWrite){
+	uint64_t registerIndex, registerValue;
+	const char* p = parseHex(line, lineEnd, cycleDiff);
+	if (p == nullptr || p >= lineEnd || *p != ' ') return false;
+	p = parseHex(p+1, lineEnd, registerIndex);
+	if (p == nullptr || p >= lineEnd || *p != '=') return false;
+	p = parseHex(p+1, lineEnd, registerValue);
+	if (p == nullptr) return false;
+	regWrite.address = registerIndex & 0xFF; // remove 0xFF00 from every registerIndex to save space. regWrite.address is relative to 0xFF00 in GB memory.
+	regWrite.value = registerValue;
+	return true;
+}
+
+void iodumperText2songData(const char* text, size_t textSize, std::vector<gb_reg_write>& songData, uint64_t& cyclesPassed){
+	ALLOC_STATS_STAGE(ALLOC_STAGE_PARSE);
+	const char* p = text;
+	const char* textEnd = text + textSize;
+	uint64_t cycleDiff;
+	gb_reg_write curRegWrite{};
+	while (p < textEnd) {
+		const char* lineEnd = (const char*)memchr(p, '\n', textEnd - p);
+		if (lineEnd == nullptr) lineEnd = textEnd;
+		if (parseIodumperLine(p, lineEnd, cycleDiff, curRegWrite)) { // lines that aren't register writes (the subsong header) are skipped
+			// add the value of cycleDiff to cyclesPassed on each line.
+			cyclesPassed += cycleDiff;
+			curRegWrite.time = cyclesPassed;
+			songData.push_back(curRegWrite);
+		}
+		p = lineEnd + 1;
+	}
+}
+
+void iodumperText2songDataParallel(const char* text, size_t textSize, std::vector<gb_reg_write>& songData, uint64_t& cyclesPassed, unsigned int threadCount){
+	ALLOC_STATS_STAGE(ALLOC_STAGE_PARSE);
+	const size_t MIN_CHUNK_SIZE = 1 << 20; // below this, starting a thread costs more than parsing the chunk
+	if (threadCount == 0) threadCount = std::max(1u, std::thread::hardware_concurrency());
+	const size_t chunkCount = std::min<size_t>(threadCount, textSize / MIN_CHUNK_SIZE + 1);
+	if (chunkCount == 1) {
+		iodumperText2songData(text, textSize, songData, cyclesPassed);
+		return;
+	}
+	// every chunk but the first starts just after a newline, so no line is split
+	std::vector<size_t> chunkStarts(chunkCount + 1, textSize);
+	chunkStarts[0] = 0;
+	for (size_t chunk=1; chunk < chunkCount; chunk++) {
+		size_t pos = std::max(textSize / chunkCount * chunk, chunkStarts[chunk-1]);
+		const char* newline = (const char*)memchr(text + pos, '\n', textSize - pos);
+		chunkStarts[chunk] = newline ? newline - text + 1 : textSize;
+	}
+	auto runOnChunks = [&](const std::function<void(size_t chunk)>& work){ // the first chunk on the calling thread, the others on their own
+		std::vector<std::thread> threads;
+		for (size_t chunk=1; chunk < chunkCount; chunk++) threads.emplace_back([&work, chunk]{
+			ALLOC_STATS_STAGE(ALLOC_STAGE_PARSE);
+			work(chunk);
+		});
+		work(0);
+		for (std::thread& thread : threads) thread.join();
+	};
+
+	// 1. each chunk is parsed with its times relative to the chunk's start, i.e. a prefix sum of its own cycle deltas
+	std::vector<std::vector<gb_reg_write>> chunkSongData(chunkCount);
+	std::vector<uint64_t> chunkCycles(chunkCount, 0);
+	runOnChunks([&](size_t chunk){
+		iodumperText2songData(text + chunkStarts[chunk], chunkStarts[chunk+1] - chunkStarts[chunk], chunkSongData[chunk], chunkCycles[chunk]);
+	});
+	// 2. an exclusive scan of the chunks' totals gives the time each chunk starts at, and where its writes go
+	std::vector<uint64_t> chunkStartTimes(chunkCount);
+	std::vector<size_t> chunkFirstWrites(chunkCount);
+	size_t writeCount = songData.size();
+	for (size_t chunk=0; chunk < chunkCount; chunk++) {
+		chunkStartTimes[chunk] = cyclesPassed;
+		chunkFirstWrites[chunk] = writeCount;
+		cyclesPassed += chunkCycles[chunk];
+		writeCount += chunkSongData[chunk].size();
+	}
+	// 3. every chunk adds its start time and copies its writes into place
+	songData.resize(writeCount);
+	runOnChunks([&](size_t chunk){
+		gb_reg_write* out = songData.data() + chunkFirstWrites[chunk];
+		for (const gb_reg_write& regWrite : chunkSongData[chunk]) {
+			*out = regWrite;
+			out->time += chunkStartTimes[chunk];
+			out++;
+		}
+		chunkSongData[chunk] = std::vector<gb_reg_write>();
+	});
+}
+
+bool iodumpFile2songData(const std::string& filename, std::vector<gb_reg_write>& songData, run_metrics* metrics){
+	stage_timer parseTimer;
+	uint64_t cyclesPassed = 0;
+#ifdef WIN32
+	FILE* inFile = fopen(filename.c_str(), "rb");
+	if (inFile == nullptr) {
+		fprintf(stderr, "Error: could not open %s.\n", filename.c_str());
+		return false;
+	}
+	std::string text;
+	char buffer[65536];
+	size_t bytesRead;
+	while ((bytesRead = fread(buffer, 1, sizeof(buffer), inFile)) > 0) text.append(buffer, bytesRead);
+	fclose(inFile);
+	iodumperText2songDataParallel(text.data(), text.size(), songData, cyclesPassed);
+#else
+	int fd = open(filename.c_str(), O_RDONLY);
+	struct stat fileStat;
+	if (fd < 0 || fstat(fd, &fileStat) != 0) {
+		fprintf(stderr, "Error: could not open %s.\n", filename.c_str());
+		if (fd >= 0) close(fd);
+		return false;
+	}
+	const size_t textSize = fileStat.st_size;
+	if (textSize > 0) { // mmap refuses empty files
+		void* text = mmap(nullptr, textSize, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (text == MAP_FAILED) {
+			fprintf(stderr, "Error: could not map %s into memory.\n", filename.c_str());
+			close(fd);
+			return false;
+		}
+		madvise(text, textSize, MADV_WILLNEED); // every chunk is read at once, so read ahead all of it rather than one sequential stream
+		iodumperText2songDataParallel((const char*)text, textSize, songData, cyclesPassed);
+		munmap(text, textSize);
+	}
+	close(fd);
+#endif
+	if (verboseOutput) fprintf(stderr, "iodumpFile2songData: %zu register writes in %.0f milliseconds.\n", songData.size(), parseTimer.stop());
+	if (metrics) metrics->parseMilliseconds = parseTimer.stop();
+	return true;
+}
 
-bool gbsplayStdout2songData(std::vector<gb_reg_write>& songData, std::string gbsFileName, int subsongNum, int timeInSeconds){
-auto start = std::chrono::high_resolution_clock::now();
+bool iodumperStream2songData(FILE* stream, std::vector<gb_reg_write>& songData){
+	char line[1024];
+	uint64_t cyclesPassed=0;
+	while (fgets(line, sizeof(line), stream)){ 
+		iodumperText2songData(line, strlen(line), songData, cyclesPassed);
+	}
+	return true;
+}
+
+// a running gbsplay, whose stdout is read through a pipe
+struct gbsplay_process {
+#ifdef WIN32
+	FILE* pipe = nullptr;
+#else
+	pid_t pid = -1;
+	int stdoutFd = -1;
+#endif
+};
+#ifndef WIN32
+static const int GBSPLAY_PIPE_SIZE = 1 << 20; // gbsplay writes far faster than real time, so a bigger pipe lets it run ahead instead of waiting for every 64 KiB to be read
+static const size_t GBSPLAY_READ_SIZE = 1 << 20;
+#endif
+
+static bool startGbsplay(const std::string& gbsFileName, int firstSubsongNum, int lastSubsongNum, int timeInSeconds, gbsplay_process& process){ // plays the subsongs from firstSubsongNum to lastSubsongNum, each for timeInSeconds
+#ifdef WIN32
+std::string gbsplayCmd = ".\\gbsplay.exe -t "+ std::to_string(timeInSeconds) +" -o iodumper -- \""+gbsFileName+"\" "+std::to_string(firstSubsongNum)+" "+std::to_string(lastSubsongNum);
+if (verboseOutput) fprintf(stderr, "DEBUG: going to call popen(%s)\n", gbsplayCmd.c_str());
+process.pipe = popen(gbsplayCmd.c_str(), "r"); // https://stackoverflow.com/questions/125828/capturing-stdout-from-a-system-command-optimally
+if (process.pipe == nullptr) {
+	fprintf(stderr, "Error: could not start gbsplay.\n");
+	return false;
+}
+return true;
+#else
+// gbsplay is started directly with an argument list rather than through a shell, so the file name can contain any character
+const std::string timeArg = std::to_string(timeInSeconds);
+const std::string firstSubsongArg = std::to_string(firstSubsongNum);
+const std::string lastSubsongArg = std::to_string(lastSubsongNum);
+const char* gbsplayArgs[] = {"./gbsplay", "-t", timeArg.c_str(), "-o", "iodumper", "--", gbsFileName.c_str(), firstSubsongArg.c_str(), lastSubsongArg.c_str(), nullptr};
+if (verboseOutput) fprintf(stderr, "DEBUG: going to spawn ./gbsplay -t %s -o iodumper -- %s %s %s\n", timeArg.c_str(), gbsFileName.c_str(), firstSubsongArg.c_str(), lastSubsongArg.c_str());
+int pipeFds[2];
+if (pipe2(pipeFds, O_CLOEXEC) != 0) { // close-on-exec, so that a gbsplay started by another daemon worker at the same time doesn't hold this pipe open
+	fprintf(stderr, "Error: could not create a pipe for gbsplay.\n");
+	return false;
+}
+#ifdef F_SETPIPE_SZ
+fcntl(pipeFds[0], F_SETPIPE_SZ, GBSPLAY_PIPE_SIZE); // may fail above /proc/sys/fs/pipe-max-size, which only costs speed
+#endif
+posix_spawn_file_actions_t fileActions;
+posix_spawn_file_actions_init(&fileActions);
+posix_spawn_file_actions_adddup2(&fileActions, pipeFds[1], STDOUT_FILENO);
+posix_spawnattr_t spawnAttributes; // gbs2midi ignores SIGPIPE, which gbsplay would inherit. It gets the default back, so that it ends if its pipe is closed.
+posix_spawnattr_init(&spawnAttributes);
+sigset_t defaultSignals;
+sigemptyset(&defaultSignals);
+sigaddset(&defaultSignals, SIGPIPE);
+posix_spawnattr_setsigdefault(&spawnAttributes, &defaultSignals);
+posix_spawnattr_setflags(&spawnAttributes, POSIX_SPAWN_SETSIGDEF);
+int spawnError = posix_spawn(&process.pid, gbsplayArgs[0], &fileActions, &spawnAttributes, (char* const*)gbsplayArgs, environ);
+posix_spawnattr_destroy(&spawnAttributes);
+posix_spawn_file_actions_destroy(&fileActions);
+close(pipeFds[1]);
+if (spawnError != 0) {
+	close(pipeFds[0]);
+	fprintf(stderr, "Error: could not start gbsplay: %s.\n", strerror(spawnError));
+	return false;
+}
+process.stdoutFd = pipeFds[0];
+return true;
+#endif
+}
 
+static void waitForGbsplayOutput(gbsplay_process& process){ // returns when gbsplay's first output arrives, so that start-up is measured separately from parsing
 #ifdef WIN32
-std::string progPrefix = ".\\";
-std::string progSuffix = ".exe";
+int firstChar = fgetc(process.pipe);
+if (firstChar != EOF) ungetc(firstChar, process.pipe);
 #else
-std::string progPrefix = "./";
-std::string progSuffix = "";
+pollfd gbsplayPollFd = {process.stdoutFd, POLLIN, 0};
+while (poll(&gbsplayPollFd, 1, -1) < 0 && errno == EINTR) {}
 #endif
-std::string gbsplayCmd = progPrefix+"gbsplay"+progSuffix+" -t "+ std::to_string(timeInSeconds) +" -o iodumper -- \""+gbsFileName+"\" "+std::to_string(subsongNum)+" "+std::to_string(subsongNum);
-printf("DEBUG: going to call popen(%s)\n", gbsplayCmd.c_str());
-FILE *gbsplayFile = popen(gbsplayCmd.c_str(), "r"); // https://stackoverflow.com/questions/125828/capturing-stdout-from-a-system-command-optimally
+}
+
+// calls onText with whole lines of gbsplay's output as they arrive, as many at a time as one read returns, until the output ends or onText returns false
+static void readGbsplayLines(gbsplay_process& process, const std::function<bool(const char* text, size_t textSize)>& onText){
+#ifdef WIN32
 char line[1024];
-uint64_t cyclesPassed=0;
-gb_reg_write curRegWrite;
-for (int i=0; i<2; i++){ // skip 2 lines
-	fgets(line, sizeof(line), gbsplayFile);
-}
-while (fgets(line, sizeof(line), gbsplayFile)){ 
-	// read cycleDiff, registerIndex, and registerValue from each line.
-	uint32_t cycleDiff = std::stoul(std::string(line).substr(0, 8), nullptr, 16); // https://stackoverflow.com/questions/1070497/c-convert-hex-string-to-signed-integer
-	uint16_t registerIndex = std::stoul(std::string(line).substr(9, 4), nullptr, 16);
-	uint8_t registerValue = std::stoul(std::string(line).substr(14, 2), nullptr, 16);
-	
-	curRegWrite.address = registerIndex & 0xFF; // remove 0xFF00 from every registerIndex to save space. curRegWrite.address is relative to 0xFF00 in GB memory.
-	curRegWrite.value = registerValue;
-	
-	// add the value of cycleDiff to cyclesPassed on each line.
-	cyclesPassed += cycleDiff;
-	
-	curRegWrite.time = cyclesPassed;
-	//curRegWrite.time = cycleDiff;
-
-	songData.push_back(curRegWrite);
-	curRegWrite = gb_reg_write{};
-	
-	//printf("cycleDiff: 0x%08x, registerIndex: 0x%04x, registerValue: 0x%02x\n", cycleDiff, registerIndex, registerValue);
+while (fgets(line, sizeof(line), process.pipe) && onText(line, strlen(line))) {}
+#else
+std::vector<char> buffer(GBSPLAY_READ_SIZE);
+size_t bufferUsed = 0; // the start of a line whose end hasn't been read yet
+while (true) {
+	if (bufferUsed == buffer.size()) buffer.resize(buffer.size() * 2);
+	ssize_t bytesRead = read(process.stdoutFd, buffer.data() + bufferUsed, buffer.size() - bufferUsed);
+	if (bytesRead < 0 && errno == EINTR) continue;
+	if (bytesRead <= 0) break;
+	const size_t bufferEnd = bufferUsed + bytesRead;
+	const char* lastNewline = (const char*)memrchr(buffer.data() + bufferUsed, '\n', bytesRead);
+	bufferUsed = bufferEnd;
+	if (lastNewline == nullptr) continue;
+	const size_t linesSize = lastNewline + 1 - buffer.data();
+	if (onText(buffer.data(), linesSize) == false) return;
+	bufferUsed = bufferEnd - linesSize;
+	memmove(buffer.data(), buffer.data() + linesSize, bufferUsed);
+}
+if (bufferUsed > 0) onText(buffer.data(), bufferUsed); // the last line may have no newline
+#endif
 }
 
+static bool finishGbsplay(gbsplay_process& process){ // waits for gbsplay to exit. Returns false if it failed, in which case its output may have been cut short.
+#ifdef WIN32
+int status = pclose(process.pipe);
+if (status != 0) {
+	fprintf(stderr, "Error: gbsplay exited with status %d. Its output may be incomplete.\n", status);
+	return false;
+}
+return true;
+#else
+close(process.stdoutFd);
+int status;
+while (waitpid(process.pid, &status, 0) < 0) {
+	if (errno != EINTR) {
+		fprintf(stderr, "Error: could not wait for gbsplay to exit.\n");
+		return false;
+	}
+}
+if (WIFEXITED(status) && WEXITSTATUS(status) == 0) return true;
+if (WIFSIGNALED(status)) fprintf(stderr, "Error: gbsplay was killed by signal %d. Its output may be incomplete.\n", WTERMSIG(status));
+else fprintf(stderr, "Error: gbsplay exited with status %d. Its output may be incomplete.\n", WEXITSTATUS(status));
+return false;
+#endif
+}
+
+static void stopGbsplay(gbsplay_process& process){ // ends gbsplay before it has finished, without reporting it as a failure
+#ifdef WIN32
+pclose(process.pipe); // gbsplay's next write fails once the pipe is closed
+#else
+close(process.stdoutFd);
+kill(process.pid, SIGTERM);
+while (waitpid(process.pid, nullptr, 0) < 0 && errno == EINTR) {}
+#endif
+}
+
+bool gbsplayStdout2songData(std::vector<gb_reg_write>& songData, std::string gbsFileName, int subsongNum, int timeInSeconds, run_metrics* metrics){
+stage_timer spawnTimer;
+ALLOC_STATS_STAGE(ALLOC_STAGE_SPAWN);
+
+gbsplay_process gbsplay;
+if (startGbsplay(gbsFileName, subsongNum, subsongNum, timeInSeconds, gbsplay) == false) {
+	return false;
+}
+waitForGbsplayOutput(gbsplay);
+double spawnMilliseconds = spawnTimer.stop();
+
+stage_timer parseTimer;
+uint64_t cyclesPassed = 0;
+readGbsplayLines(gbsplay, [&](const char* text, size_t textSize){
+	iodumperText2songData(text, textSize, songData, cyclesPassed);
+	return true;
+});
+bool gbsplaySucceeded = finishGbsplay(gbsplay);
+double parseMilliseconds = parseTimer.stop();
+
 /*
 for (gb_reg_write i: songData){
 	printf("time: 0x%016lx, address: 0x%02x, value: 0x%02x\n", i.time, i.address, i.value); // when stdout is being printed to the commmand line, not all of these will display. Redirect this command's output to a text file to see everything.
 }
 */
 
-auto stop = std::chrono::high_resolution_clock::now();
-auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start);
-printf("gbsplayStdout2songData: %ld milliseconds.\n", duration.count());
-return true;
+if (verboseOutput) fprintf(stderr, "gbsplayStdout2songData: %.0f milliseconds.\n", spawnMilliseconds + parseMilliseconds);
+if (metrics) {
+	metrics->spawnMilliseconds = spawnMilliseconds;
+	metrics->parseMilliseconds = parseMilliseconds;
+}
+return gbsplaySucceeded;
+}
+
+bool gbsplayStdout2regWriteSink(std::string gbsFileName, int subsongNum, int timeInSeconds, const std::function<bool(const gb_reg_write&)>& regWriteSink){
+gbsplay_process gbsplay;
+if (startGbsplay(gbsFileName, subsongNum, subsongNum, timeInSeconds, gbsplay) == false) {
+	return false;
+}
+uint64_t cyclesPassed = 0;
+uint64_t cycleDiff;
+gb_reg_write curRegWrite{};
+bool sinkStopped = false;
+readGbsplayLines(gbsplay, [&](const char* text, size_t textSize){
+	const char* textEnd = text + textSize;
+	for (const char* line = text; line < textEnd; ) {
+		const char* lineEnd = (const char*)memchr(line, '\n', textEnd - line);
+		if (lineEnd == nullptr) lineEnd = textEnd;
+		if (parseIodumperLine(line, lineEnd, cycleDiff, curRegWrite)) {
+			cyclesPassed += cycleDiff;
+			curRegWrite.time = cyclesPassed;
+			if (regWriteSink(curRegWrite) == false) {
+				sinkStopped = true;
+				return false;
+			}
+		}
+		line = lineEnd + 1;
+	}
+	return true;
+});
+if (sinkStopped) {
+	stopGbsplay(gbsplay);
+	return true;
+}
+return finishGbsplay(gbsplay);
+}
+
+bool gbsplayStdout2subsongs(std::string gbsFileName, int firstSubsongNum, int lastSubsongNum, int timeInSeconds, const std::function<void(int subsongNum, std::vector<gb_reg_write>& songData, const run_metrics& metrics)>& subsongSink){
+stage_timer spawnTimer;
+ALLOC_STATS_STAGE(ALLOC_STAGE_SPAWN);
+gbsplay_process gbsplay;
+if (startGbsplay(gbsFileName, firstSubsongNum, lastSubsongNum, timeInSeconds, gbsplay) == false) {
+	return false;
+}
+waitForGbsplayOutput(gbsplay);
+double spawnMilliseconds = spawnTimer.stop();
+
+// gbsplay plays the subsongs in order, and each starts with a "subsong" line. The number on that line isn't used, so that it doesn't matter whether gbsplay counts from 0 or 1.
+int subsongNum = firstSubsongNum;
+bool subsongStarted = false; // a header or a write of subsongNum has been read
+std::vector<gb_reg_write> songData;
+uint64_t cyclesPassed = 0;
+stage_timer parseTimer;
+auto finishSubsong = [&]{
+	if (subsongStarted == false || subsongNum > lastSubsongNum) return;
+	run_metrics metrics;
+	metrics.subsongNumber = subsongNum;
+	metrics.spawnMilliseconds = subsongNum == firstSubsongNum ? spawnMilliseconds : 0;
+	metrics.parseMilliseconds = parseTimer.stop();
+	if (verboseOutput) fprintf(stderr, "gbsplayStdout2subsongs: subsong %d has %zu register writes.\n", subsongNum, songData.size());
+	subsongSink(subsongNum, songData, metrics);
+	songData = std::vector<gb_reg_write>(); // the sink may have moved it
+};
+readGbsplayLines(gbsplay, [&](const char* text, size_t textSize){
+	const char* textEnd = text + textSize;
+	while (text < textEnd) {
+		static const char subsongHeader[] = "subsong";
+		const char* header = std::search(text, textEnd, subsongHeader, subsongHeader + strlen(subsongHeader)); // memmem isn't in mingw
+		if (header == textEnd) header = nullptr;
+		const char* writesEnd = header ? header : textEnd;
+		size_t prevSize = songData.size();
+		iodumperText2songData(text, writesEnd - text, songData, cyclesPassed);
+		if (songData.size() > prevSize) subsongStarted = true;
+		if (header == nullptr) break;
+		if (subsongStarted) {
+			finishSubsong();
+			subsongNum++;
+		}
+		subsongStarted = true;
+		cyclesPassed = 0; // every subsong starts at time 0
+		parseTimer = stage_timer();
+		const char* headerEnd = (const char*)memchr(header, '\n', textEnd - header);
+		text = headerEnd ? headerEnd + 1 : textEnd;
+	}
+	return true;
+});
+bool gbsplaySucceeded = finishGbsplay(gbsplay);
+finishSubsong();
+return gbsplaySucceeded;
 }
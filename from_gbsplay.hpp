@@ -1,8 +1,22 @@
 #pragma once
 
+#include <cstdint>
+#include <cstdio>
 #include <string>
 #include <vector>
+#include <functional>
 
 #include "gb_reg_write.h"
+#include "run_metrics.hpp"
 
-bool gbsplayStdout2songData(std::vector<gb_reg_write>& songData, std::string gbsFileName, int subsongNum, int timeInSeconds = 150);
\ No newline at end of file
+bool parseIodumperLine(const char* line, const char* lineEnd, uint64_t& cycleDiff, gb_reg_write& regWrite);
+void iodumperText2songData(const char* text, size_t textSize, std::vector<gb_reg_write>& songData, uint64_t& cyclesPassed); // cyclesPassed carries the running timestamp between calls
+// the same as iodumperText2songData, but the text is split at newlines into one chunk per thread (one per hardware thread if threadCount is 0). Small texts are parsed on the calling thread.
+void iodumperText2songDataParallel(const char* text, size_t textSize, std::vector<gb_reg_write>& songData, uint64_t& cyclesPassed, unsigned int threadCount = 0);
+// reads a register stream saved with gbsplay -o iodumper. The file is memory-mapped and parsed with iodumperText2songDataParallel.
+bool iodumpFile2songData(const std::string& filename, std::vector<gb_reg_write>& songData, run_metrics* metrics = nullptr);
+bool iodumperStream2songData(FILE* stream, std::vector<gb_reg_write>& songData);
+bool gbsplayStdout2songData(std::vector<gb_reg_write>& songData, std::string gbsFileName, int subsongNum, int timeInSeconds = 150, run_metrics* metrics = nullptr);
+bool gbsplayStdout2regWriteSink(std::string gbsFileName, int subsongNum, int timeInSeconds, const std::function<bool(const gb_reg_write&)>& regWriteSink); // hands each write to regWriteSink as soon as gbsplay prints it. If regWriteSink returns false, gbsplay is stopped and no more writes are handed over.
+// Plays the subsongs from firstSubsongNum to lastSubsongNum in one gbsplay run, and hands each one's writes to subsongSink as soon as gbsplay has finished it. metrics has the subsong number and its spawn and parse times. The sink may move songData.
+bool gbsplayStdout2subsongs(std::string gbsFileName, int firstSubsongNum, int lastSubsongNum, int timeInSeconds, const std::function<void(int subsongNum, std::vector<gb_reg_write>& songData, const run_metrics& metrics)>& subsongSink);
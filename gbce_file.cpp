@@ -0,0 +1,121 @@
+/*
+This file contains the code that saves and loads a song's register writes as .gbce files.
+
+.gbce layout. All integers are little endian, varlen is 7 bits per byte with the high bit set on every byte but the last (least significant group first):
+	"GBCE"
+	uint32 version (2)
+	uint32 gbTimeUnitsPerSecond
+	uint64 register write count
+	for each register write: varlen time minus the previous write's time, uint8 address, uint8 value
+Version 1 held the channel events of a conversion at 32767 PPQN. Re-timing them to a lower PPQN put notes that the converter keeps apart on the same tick, so it can't be read anymore.
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <algorithm> // std::equal
+
+#include "gbce_file.hpp"
+
+static const char GBCE_MAGIC[4] = {'G', 'B', 'C', 'E'};
+static const uint32_t GBCE_VERSION = 2;
+
+static void appendUint(std::vector<uint8_t>& bytes, uint64_t value, int byteCount){
+	for (int i=0; i<byteCount; i++) bytes.push_back((value >> (8*i)) & 0xFF);
+}
+static void appendVarLength(std::vector<uint8_t>& bytes, uint64_t value){
+	while (value >= 0x80) {
+		bytes.push_back((value & 0x7F) | 0x80);
+		value >>= 7;
+	}
+	bytes.push_back(value);
+}
+bool saveGbceFile(const std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, const std::string& filename){
+	std::vector<uint8_t> bytes(GBCE_MAGIC, GBCE_MAGIC + sizeof(GBCE_MAGIC));
+	bytes.reserve(bytes.size() + 16 + songData.size() * 4); // most writes are less than 128 units apart from the previous one
+	appendUint(bytes, GBCE_VERSION, 4);
+	appendUint(bytes, gbTimeUnitsPerSecond, 4);
+	appendUint(bytes, songData.size(), 8);
+	uint64_t prevTime = 0;
+	for (const gb_reg_write& regWrite : songData) {
+		appendVarLength(bytes, regWrite.time - prevTime);
+		bytes.push_back(regWrite.address);
+		bytes.push_back(regWrite.value);
+		prevTime = regWrite.time;
+	}
+	FILE* outFile = fopen(filename.c_str(), "wb");
+	bool writeSucceeded = outFile && fwrite(bytes.data(), 1, bytes.size(), outFile) == bytes.size();
+	if (outFile && fclose(outFile) != 0)
+		writeSucceeded = false;
+	if (writeSucceeded == false)
+		fprintf(stderr, "Error: could not write the register writes file %s.\n", filename.c_str());
+	return writeSucceeded;
+}
+
+// reads the fields of a .gbce file. Every read fails once the end of the file has been passed.
+struct gbce_reader {
+	const std::vector<uint8_t>& bytes;
+	size_t pos = 0;
+	bool ok = true;
+	uint64_t readUint(int byteCount){
+		if (bytes.size() - pos < (size_t)byteCount) {
+			ok = false;
+			return 0;
+		}
+		uint64_t value = 0;
+		for (int i=0; i<byteCount; i++) value |= (uint64_t)bytes[pos++] << (8*i);
+		return value;
+	}
+	uint64_t readVarLength(){
+		uint64_t value = 0;
+		for (int shift=0; shift < 64; shift += 7) {
+			if (pos >= bytes.size()) break;
+			uint8_t byte = bytes[pos++];
+			value |= (uint64_t)(byte & 0x7F) << shift;
+			if ((byte & 0x80) == 0) return value;
+		}
+		ok = false;
+		return 0;
+	}
+};
+bool loadGbceFile(std::vector<gb_reg_write>& songData, unsigned int& gbTimeUnitsPerSecond, const std::string& filename){
+	std::vector<uint8_t> bytes;
+	FILE* inFile = fopen(filename.c_str(), "rb");
+	if (inFile == nullptr) {
+		fprintf(stderr, "Error: could not open %s.\n", filename.c_str());
+		return false;
+	}
+	uint8_t buffer[65536];
+	size_t bytesRead;
+	while ((bytesRead = fread(buffer, 1, sizeof(buffer), inFile)) > 0) bytes.insert(bytes.end(), buffer, buffer + bytesRead);
+	fclose(inFile);
+
+	if (bytes.size() < sizeof(GBCE_MAGIC) || std::equal(GBCE_MAGIC, GBCE_MAGIC + sizeof(GBCE_MAGIC), bytes.begin()) == false) {
+		fprintf(stderr, "Error: %s is not a .gbce file.\n", filename.c_str());
+		return false;
+	}
+	gbce_reader reader{bytes, sizeof(GBCE_MAGIC)};
+	uint32_t version = reader.readUint(4);
+	if (reader.ok && version != GBCE_VERSION) {
+		fprintf(stderr, "Error: %s has version %u, but only version %u can be read.%s\n", filename.c_str(), version, GBCE_VERSION, version < GBCE_VERSION ? " Save it again from the .gbs file with --save-events." : "");
+		return false;
+	}
+	gbTimeUnitsPerSecond = reader.readUint(4);
+	uint64_t regWriteCount = reader.readUint(8);
+	if (reader.ok && (gbTimeUnitsPerSecond == 0 || regWriteCount > (bytes.size() - reader.pos) / 3)) reader.ok = false; // every write takes at least 3 bytes
+	songData.clear();
+	if (reader.ok) songData.reserve(regWriteCount);
+	uint64_t time = 0;
+	for (uint64_t i=0; reader.ok && i < regWriteCount; i++) {
+		time += reader.readVarLength();
+		uint8_t address = reader.readUint(1);
+		uint8_t value = reader.readUint(1);
+		if (reader.ok) songData.push_back({time, address, value});
+	}
+	if (reader.ok == false) {
+		fprintf(stderr, "Error: %s is truncated or corrupt.\n", filename.c_str());
+		return false;
+	}
+	return true;
+}
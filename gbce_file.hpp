@@ -0,0 +1,14 @@
+/*
+This file declares the functions that save a song's register writes to .gbce files and load them again, so a song can be converted at another PPQN or BPM without emulating it again (see gbce_file.cpp for the layout).
+*/
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "gb_reg_write.h"
+
+// .gbce files hold the register writes rather than the converted events. Which writes start a note, and on which tick, depends on the time base, so the writes are converted again at the PPQN and BPM that the midi file is made at.
+bool saveGbceFile(const std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, const std::string& filename);
+bool loadGbceFile(std::vector<gb_reg_write>& songData, unsigned int& gbTimeUnitsPerSecond, const std::string& filename); // prints the reason to stderr and returns false if the file isn't a valid .gbce file
@@ -0,0 +1,655 @@
+/*
+This file contains a differential harness that compares the converter's output with stored reference midi files.
+
+Run "record" on a known-good tree to store reference outputs for every register stream in a directory, then run "check" after changing the converter or libsmfc.
+The comparison is semantic: both files are parsed and compared per track as (time, event) lists, so a change in how the bytes are encoded (running status, delta time splitting) is not reported, but a change in which events are emitted or when is.
+Events are grouped by tick, and every tick whose events differ is printed with the reference events prefixed by - and the new events prefixed by + (events that both sides start or end the tick with are left out).
+
+If the directory has no .iodump files, "record" first fills it with a generated corpus (see synth_songdata.cpp). Register streams captured from gbsplay (./gbsplay -o iodumper ... > name.iodump) can be added to the directory as well.
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <tuple>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+
+#include "gb_reg_write.h"
+#include "from_gbsplay.hpp"
+#include "to_midi.hpp"
+#include "reg_write_filter.hpp"
+#include "gbce_file.hpp"
+#include "output_variant.hpp"
+#include "ump_clip.hpp"
+#include "synth_songdata.hpp"
+#include "libsmfc.h"
+
+const uint32_t MASTER_CLOCK = 0x400000;
+static const std::vector<int> GOLDEN_PPQNS = {0x7fff, 480, 96, 24}; // the low PPQNs exercise the same-tick note selection in insertNoteIntoMidi
+static const int TIMING_REPEAT = 3;
+
+struct smf_event_record {
+	int64_t time; // absolute, in ticks
+	std::vector<uint8_t> data; // status byte included, even when the file used running status
+};
+typedef std::vector<smf_event_record> smf_track_record;
+
+void displayHelp(){
+	printf("How to use: \n./gbs2midi-golden record directory\n./gbs2midi-golden check directory [--max-diffs=20]\n");
+	printf("record converts every .iodump file in directory at PPQN 32767, 480, 96 and 24, and stores the results as name.ppqnN.mid along with the conversion times in throughput.txt.\n");
+	printf("check converts them again, with and without filterRedundantRegWrites, after a round trip through a .gbce file, at twice the PPQN and half the BPM (the same ticks per second, with the tempo event taken out), as --also variants (in full, and the wave channel without pitch bends), and as a MIDI 2.0 Clip File that is read back to compare the pitch each channel plays. It also converts a --start window a third of the way in and compares the controllers its first tick sets on every track with the reference's at that tick. It reports every difference from the stored midi files and the throughput compared with the recording. The exit code is nonzero if any output differs.\n");
+}
+
+static bool readWholeFile(const std::string& filename, std::string& contents){
+	FILE* file = fopen(filename.c_str(), "rb");
+	if (file == nullptr) return false;
+	contents.clear();
+	char buffer[1 << 16];
+	size_t readSize;
+	while ((readSize = fread(buffer, 1, sizeof(buffer), file)) > 0) contents.append(buffer, readSize);
+	bool result = ferror(file) == 0;
+	fclose(file);
+	return result;
+}
+static bool writeWholeFile(const std::string& filename, const void* data, size_t size){
+	FILE* file = fopen(filename.c_str(), "wb");
+	if (file == nullptr) return false;
+	bool result = fwrite(data, 1, size, file) == size;
+	return fclose(file) == 0 && result;
+}
+
+static bool readVariableLength(const uint8_t*& p, const uint8_t* end, uint64_t& value){
+	value = 0;
+	for (int i=0; i<4; i++) {
+		if (p >= end) return false;
+		uint8_t c = *p++;
+		value = (value << 7) | (c & 0x7F);
+		if ((c & 0x80) == 0) return true;
+	}
+	return false;
+}
+static uint32_t readBigEndian(const uint8_t* p, int size){
+	uint32_t value = 0;
+	for (int i=0; i<size; i++) value = (value << 8) | p[i];
+	return value;
+}
+static bool parseSmf(const uint8_t* data, size_t size, int& timebase, std::vector<smf_track_record>& tracks, std::string& error){
+	const uint8_t* p = data;
+	const uint8_t* end = data + size;
+	if (size < 14 || memcmp(p, "MThd", 4) != 0) { error = "no MThd chunk"; return false; }
+	uint16_t numTracks = readBigEndian(p + 10, 2);
+	timebase = readBigEndian(p + 12, 2);
+	p += 8 + readBigEndian(p + 4, 4);
+	tracks.assign(numTracks, smf_track_record());
+	for (int trackIndex=0; trackIndex < numTracks; trackIndex++) {
+		if (end - p < 8 || memcmp(p, "MTrk", 4) != 0) { error = "missing MTrk chunk " + std::to_string(trackIndex); return false; }
+		const uint8_t* trackEnd = p + 8 + readBigEndian(p + 4, 4);
+		if (trackEnd > end) { error = "track " + std::to_string(trackIndex) + " is truncated"; return false; }
+		p += 8;
+		int64_t time = 0;
+		uint8_t runningStatus = 0;
+		while (p < trackEnd) {
+			uint64_t deltaTime, length;
+			if (readVariableLength(p, trackEnd, deltaTime) == false || p >= trackEnd) { error = "bad delta time in track " + std::to_string(trackIndex); return false; }
+			time += deltaTime;
+			smf_event_record event{time, {}};
+			uint8_t status = *p;
+			if (status == 0xFF) { // meta: FF type length data
+				if (trackEnd - p < 2) { error = "truncated meta event"; return false; }
+				const uint8_t* metaStart = p;
+				p += 2;
+				if (readVariableLength(p, trackEnd, length) == false || (uint64_t)(trackEnd - p) < length) { error = "truncated meta event"; return false; }
+				p += length;
+				if (metaStart[1] == 0x01 && length == 0) continue; // an empty text event is the filler libsmfc uses to split long delta times
+				event.data.assign(metaStart, metaStart + 2);
+				event.data.insert(event.data.end(), p - length, p);
+				runningStatus = 0;
+			} else if (status == 0xF0 || status == 0xF7) { // sysex: F0 length data
+				p++;
+				if (readVariableLength(p, trackEnd, length) == false || (uint64_t)(trackEnd - p) < length) { error = "truncated sysex event"; return false; }
+				event.data.push_back(status);
+				event.data.insert(event.data.end(), p, p + length);
+				p += length;
+				runningStatus = 0;
+			} else {
+				if (status & 0x80) {
+					runningStatus = status;
+					p++;
+				} else if (runningStatus == 0) {
+					error = "data byte without a status in track " + std::to_string(trackIndex);
+					return false;
+				}
+				int dataBytes = ((runningStatus & 0xF0) == 0xC0 || (runningStatus & 0xF0) == 0xD0) ? 1 : 2;
+				if (trackEnd - p < dataBytes) { error = "truncated channel event"; return false; }
+				event.data.push_back(runningStatus);
+				event.data.insert(event.data.end(), p, p + dataBytes);
+				p += dataBytes;
+			}
+			tracks[trackIndex].push_back(event);
+		}
+		p = trackEnd;
+	}
+	return true;
+}
+
+static std::string describeEvent(const smf_event_record& event){
+	char buffer[128];
+	const std::vector<uint8_t>& d = event.data;
+	int channel = d[0] & 0x0F;
+	switch (d[0] & 0xF0) {
+		case 0x80: snprintf(buffer, sizeof(buffer), "note_off ch%d note=%d vel=%d", channel, d[1], d[2]); break;
+		case 0x90: snprintf(buffer, sizeof(buffer), "note_on ch%d note=%d vel=%d", channel, d[1], d[2]); break;
+		case 0xB0: snprintf(buffer, sizeof(buffer), "control ch%d cc%d=%d", channel, d[1], d[2]); break;
+		case 0xE0: snprintf(buffer, sizeof(buffer), "pitch_bend ch%d %d", channel, ((d[2] << 7) | d[1]) - 0x2000); break;
+		default:
+			if (d[0] == 0xFF) snprintf(buffer, sizeof(buffer), "meta type=%02x, %zu bytes", d[1], d.size() - 2);
+			else if (d[0] == 0xF0 || d[0] == 0xF7) snprintf(buffer, sizeof(buffer), "sysex %zu bytes", d.size() - 1);
+			else snprintf(buffer, sizeof(buffer), "status %02x", d[0]);
+			break;
+	}
+	return "t=" + std::to_string(event.time) + " " + buffer;
+}
+static bool sameEvent(const smf_event_record& a, const smf_event_record& b){
+	return a.time == b.time && a.data == b.data;
+}
+// describes the ticks at which the two tracks differ in details and returns how many there were
+static size_t diffTrack(const smf_track_record& reference, const smf_track_record& current, int trackIndex, size_t maxDiffsToPrint, std::string& details){
+	size_t diffCount = 0;
+	size_t r = 0, c = 0;
+	while (r < reference.size() || c < current.size()) {
+		int64_t time = INT64_MAX;
+		if (r < reference.size()) time = reference[r].time;
+		if (c < current.size()) time = std::min(time, current[c].time);
+		size_t rEnd = r, cEnd = c;
+		while (rEnd < reference.size() && reference[rEnd].time == time) rEnd++;
+		while (cEnd < current.size() && current[cEnd].time == time) cEnd++;
+		bool same = rEnd - r == cEnd - c && std::equal(reference.begin() + r, reference.begin() + rEnd, current.begin() + c, sameEvent);
+		if (same == false) {
+			if (diffCount < maxDiffsToPrint) { // leave out the events that both sides start and end the tick with
+				size_t rFrom = r, cFrom = c, rTo = rEnd, cTo = cEnd;
+				while (rFrom < rTo && cFrom < cTo && sameEvent(reference[rFrom], current[cFrom])) { rFrom++; cFrom++; }
+				while (rTo > rFrom && cTo > cFrom && sameEvent(reference[rTo-1], current[cTo-1])) { rTo--; cTo--; }
+				details += "  track " + std::to_string(trackIndex) + ", tick " + std::to_string(time) + ":\n";
+				for (size_t i=rFrom; i<rTo; i++) details += "    - " + describeEvent(reference[i]) + "\n";
+				for (size_t i=cFrom; i<cTo; i++) details += "    + " + describeEvent(current[i]) + "\n";
+			}
+			diffCount++;
+		}
+		r = rEnd;
+		c = cEnd;
+	}
+	return diffCount;
+}
+
+static std::string serialiseSmf(Smf* midiFile){
+	SmfWriteBuffer writeBuffer;
+	smfWriteBufferInit(&writeBuffer);
+	smfWriteHeader(midiFile, &writeBuffer);
+	for (int trackIndex=0; trackIndex < midiFile->numTracks; trackIndex++) smfTrackSerialize(midiFile->track[trackIndex], &writeBuffer);
+	std::string bytes((const char*)writeBuffer.data, writeBuffer.size);
+	smfWriteBufferFree(&writeBuffer);
+	return bytes;
+}
+// compares the parsed tracks of a conversion result with the reference. Returns "ok" or "DIFF", and describes the differences in details.
+static std::string compareTracksWithReference(const std::vector<smf_track_record>& referenceTracks, int referenceTimebase, const std::vector<smf_track_record>& tracks, int timebase, size_t maxDiffsToPrint, std::string& details){
+	if (timebase != referenceTimebase || tracks.size() != referenceTracks.size()) {
+		details += "  timebase or track count differs: " + std::to_string(referenceTimebase) + "/" + std::to_string(referenceTracks.size()) + " -> " + std::to_string(timebase) + "/" + std::to_string(tracks.size()) + "\n";
+		return "DIFF";
+	}
+	size_t diffCount = 0;
+	for (size_t trackIndex=0; trackIndex < tracks.size(); trackIndex++) {
+		if (referenceTracks[trackIndex].size() != tracks[trackIndex].size() || std::equal(tracks[trackIndex].begin(), tracks[trackIndex].end(), referenceTracks[trackIndex].begin(), sameEvent) == false) {
+			diffCount += diffTrack(referenceTracks[trackIndex], tracks[trackIndex], trackIndex, diffCount < maxDiffsToPrint ? maxDiffsToPrint - diffCount : 0, details);
+		}
+	}
+	if (diffCount > maxDiffsToPrint) details += "  ... " + std::to_string(diffCount) + " ticks differ in total\n";
+	return diffCount ? "DIFF" : "ok";
+}
+// the same for the bytes of a midi file. Returns "INVALID" if they can't be parsed.
+static std::string compareWithReference(const std::vector<smf_track_record>& referenceTracks, int referenceTimebase, const std::string& bytes, size_t maxDiffsToPrint, std::string& details){
+	int timebase = 0;
+	std::vector<smf_track_record> tracks;
+	std::string error;
+	if (parseSmf((const uint8_t*)bytes.data(), bytes.size(), timebase, tracks, error) == false) {
+		details += "  the new output could not be parsed: " + error + "\n";
+		return "INVALID";
+	}
+	return compareTracksWithReference(referenceTracks, referenceTimebase, tracks, timebase, maxDiffsToPrint, details);
+}
+// converts songData at twice the reference's PPQN and half its BPM, which has the same ticks per second, and compares the result with the reference once the tempo event is taken out. Returns "-" if twice the PPQN is too high for a midi file.
+static std::string compareAtHalfTempo(const std::vector<smf_track_record>& referenceTracks, int referenceTimebase, const std::vector<gb_reg_write>& songData, size_t maxDiffsToPrint, std::string& details){
+	if (referenceTimebase * 2 > 0x7fff) return "-";
+	std::vector<gb_reg_write> filteredSongData = songData; // filtered at the same time base, which must not change the output either
+	filterRedundantRegWrites(filteredSongData, MASTER_CLOCK, referenceTimebase * 2, nullptr, 0xF, DEFAULT_MIDI_BPM / 2);
+	Smf* midiFile = songData2smf(filteredSongData, MASTER_CLOCK, referenceTimebase * 2, nullptr, DEFAULT_MIDI_BPM / 2);
+	const std::string bytes = serialiseSmf(midiFile);
+	smfDelete(midiFile);
+	int timebase = 0;
+	std::vector<smf_track_record> tracks;
+	std::string error;
+	if (parseSmf((const uint8_t*)bytes.data(), bytes.size(), timebase, tracks, error) == false) {
+		details += "  the output at half the tempo could not be parsed: " + error + "\n";
+		return "INVALID";
+	}
+	const size_t eventCount = tracks.empty() ? 0 : tracks[0].size();
+	if (tracks.empty() == false) tracks[0].erase(std::remove_if(tracks[0].begin(), tracks[0].end(), [](const smf_event_record& event){ return event.data.size() >= 2 && event.data[0] == 0xFF && event.data[1] == 0x51; }), tracks[0].end());
+	if (tracks.empty() || tracks[0].size() != eventCount - 1) {
+		details += "  the output at half the tempo doesn't have exactly one tempo event\n";
+		return "DIFF";
+	}
+	return compareTracksWithReference(referenceTracks, referenceTimebase, tracks, timebase / 2, maxDiffsToPrint, details);
+}
+
+// converts two --also variants at the reference's PPQN, from a main output at another one: one with every event, which has to be the same as the reference, and a wave channel stem without pitch bends, which has to be the reference's wave track without its pitch bends
+static std::string compareVariants(const std::vector<smf_track_record>& referenceTracks, int referenceTimebase, const std::vector<gb_reg_write>& songData, size_t maxDiffsToPrint, std::string& details){
+	const int MAIN_PPQN = referenceTimebase == 0x7fff ? 480 : 0x7fff;
+	output_variant fullVariant;
+	fullVariant.PPQN = referenceTimebase;
+	Smf* midiFile = songData2variantSmf(songData, MASTER_CLOCK, fullVariant, MAIN_PPQN);
+	std::string result = compareWithReference(referenceTracks, referenceTimebase, serialiseSmf(midiFile), maxDiffsToPrint, details);
+	smfDelete(midiFile);
+
+	const int WAVE_TRACK = 2;
+	if (referenceTracks.size() <= WAVE_TRACK) return result;
+	output_variant stemVariant;
+	stemVariant.PPQN = referenceTimebase;
+	stemVariant.pitchBends = false;
+	stemVariant.trackMask = 1 << WAVE_TRACK;
+	smf_track_record stemReferenceTrack = referenceTracks[WAVE_TRACK];
+	stemReferenceTrack.erase(std::remove_if(stemReferenceTrack.begin(), stemReferenceTrack.end(), [](const smf_event_record& event){ return (event.data[0] & 0xF0) == 0xE0; }), stemReferenceTrack.end());
+	midiFile = songData2variantSmf(songData, MASTER_CLOCK, stemVariant, MAIN_PPQN);
+	std::string stemDetails;
+	std::string stemResult = compareWithReference({stemReferenceTrack}, referenceTimebase, serialiseSmf(midiFile), maxDiffsToPrint, stemDetails);
+	smfDelete(midiFile);
+	if (stemDetails.empty() == false) details += "  wave stem without pitch bends:\n" + stemDetails;
+	return result != "ok" ? result : stemResult;
+}
+
+// the value of each controller on each track after the events up to and including lastTime, as tick 0 of a window must set it
+typedef std::vector<std::map<int, int>> controller_state;
+static controller_state controllerState(const std::vector<smf_track_record>& tracks, int64_t lastTime){
+	controller_state state(tracks.size());
+	for (size_t trackIndex=0; trackIndex < tracks.size(); trackIndex++) {
+		for (const smf_event_record& event : tracks[trackIndex]) {
+			if (event.time > lastTime) break;
+			if ((event.data[0] & 0xF0) == 0xB0) state[trackIndex][event.data[1]] = event.data[2];
+		}
+		auto legato = state[trackIndex].find(68);
+		if (legato != state[trackIndex].end() && legato->second == 0) state[trackIndex].erase(legato); // legato off is where a player starts
+		auto panMute = state[trackIndex].find(9);
+		if (panMute != state[trackIndex].end() && panMute->second == 0x7F) state[trackIndex].erase(10); // cc10, the panning. A muted channel has no panning to restore
+	}
+	return state;
+}
+// converts a --start window a third of the way into the song, and compares the controllers its first tick sets on every track with their values at that tick in the reference
+static std::string compareWindowState(const std::vector<smf_track_record>& referenceTracks, int referenceTimebase, const std::vector<gb_reg_write>& songData, std::string& details){
+	if (songData.empty()) return "-";
+	const uint64_t startGbTime = songData[songData.size() / 3].time;
+	std::vector<gb_reg_write> windowSongData = songData;
+	Smf* midiFile = songData2smfWindow(windowSongData, MASTER_CLOCK, referenceTimebase, startGbTime, startGbTime + 1);
+	const std::string bytes = serialiseSmf(midiFile);
+	smfDelete(midiFile);
+	int timebase = 0;
+	std::vector<smf_track_record> tracks;
+	std::string error;
+	if (parseSmf((const uint8_t*)bytes.data(), bytes.size(), timebase, tracks, error) == false) {
+		details += "  the window could not be parsed: " + error + "\n";
+		return "INVALID";
+	}
+	if (tracks.size() != referenceTracks.size()) {
+		details += "  the window has " + std::to_string(tracks.size()) + " tracks instead of " + std::to_string(referenceTracks.size()) + "\n";
+		return "DIFF";
+	}
+	const int64_t startTime = gbTime2midiTime(startGbTime, MASTER_CLOCK, midiTicksPerSecondFromPPQN(referenceTimebase));
+	const controller_state referenceState = controllerState(referenceTracks, startTime);
+	const controller_state windowState = controllerState(tracks, 0);
+	std::string result = "ok";
+	for (size_t trackIndex=0; trackIndex < tracks.size(); trackIndex++) {
+		std::map<int, std::pair<int, int>> controllers; // number -> (reference, window), -1 if unset
+		for (const std::pair<const int, int>& controller : referenceState[trackIndex]) controllers[controller.first] = {controller.second, -1};
+		for (const std::pair<const int, int>& controller : windowState[trackIndex]) {
+			auto it = controllers.find(controller.first);
+			if (it == controllers.end()) controllers[controller.first] = {-1, controller.second};
+			else it->second.second = controller.second;
+		}
+		for (const std::pair<const int, std::pair<int, int>>& controller : controllers) {
+			if (controller.second.first == controller.second.second) continue;
+			details += "  track " + std::to_string(trackIndex) + ", cc" + std::to_string(controller.first) + " at tick " + std::to_string(startTime) + ": " + std::to_string(controller.second.first) + " in the reference, " + std::to_string(controller.second.second) + " at the start of the window\n";
+			result = "DIFF";
+		}
+	}
+	return result;
+}
+
+// the pitch each midi channel plays after each tick where it changes, in Pitch 7.25 (the note number in the top 7 bits), or -1 while it's silent
+typedef std::map<int, std::vector<std::pair<int64_t, int64_t>>> pitch_timeline;
+typedef std::set<std::tuple<int, int64_t, int64_t>> note_starts; // channel, tick, the pitch a note on starts at
+static void addPitchChange(pitch_timeline& timeline, int channel, int64_t time, int64_t pitch){
+	std::vector<std::pair<int64_t, int64_t>>& changes = timeline[channel];
+	if (changes.empty() == false && changes.back().first == time) changes.pop_back(); // only the pitch at the end of a tick counts
+	if (changes.empty() ? pitch != -1 : changes.back().second != pitch) changes.push_back({time, pitch});
+}
+static pitch_timeline smfPitchTimeline(const std::vector<smf_track_record>& tracks, note_starts& noteStarts){ // the converter's pitch bends are 4096 per semitone
+	pitch_timeline timeline;
+	for (const smf_track_record& track : tracks) {
+		std::map<int, std::pair<int, int>> channels; // channel -> playing note (-1 for none), pitch bend
+		for (const smf_event_record& event : track) {
+			const int type = event.data[0] & 0xF0;
+			const int channel = event.data[0] & 0x0F;
+			if (type != 0x80 && type != 0x90 && type != 0xE0) continue;
+			auto& [note, pitchBend] = channels.try_emplace(channel, -1, 0).first->second;
+			if (type == 0x90 && event.data[2] != 0) note = event.data[1];
+			else if (type == 0x80 || type == 0x90) { if (note == event.data[1]) note = -1; }
+			else pitchBend = ((event.data[2] << 7) | event.data[1]) - 8192;
+			const int64_t pitch = note == -1 ? -1 : std::clamp<int64_t>(((int64_t)note << 25) + ((int64_t)pitchBend << 13), 0, UINT32_MAX);
+			addPitchChange(timeline, channel, event.time, pitch);
+			if (type == 0x90 && event.data[2] != 0) noteStarts.insert({channel, event.time, pitch});
+		}
+	}
+	return timeline;
+}
+// the same for a MIDI 2.0 Clip File, as a receiver plays it: a note plays at the last Per-Note Pitch sent for its note number on its channel, or at the note number's own pitch if none was.
+// The timeline only has the pitch at the end of each tick, so the pitch each note on starts at is also put in noteStarts, to catch a stale Per-Note Pitch that is only corrected after the note on. Returns false if the clip can't be parsed.
+static bool clipPitchTimeline(const std::string& bytes, pitch_timeline& timeline, note_starts& noteStarts, std::string& error){
+	if (bytes.size() < 8 || memcmp(bytes.data(), "SMF2CLIP", 8) != 0 || (bytes.size() - 8) % 4 != 0) { error = "no SMF2CLIP header"; return false; }
+	std::vector<uint32_t> words;
+	for (size_t i=8; i < bytes.size(); i += 4) words.push_back(readBigEndian((const uint8_t*)bytes.data() + i, 4));
+	std::map<int, std::pair<int, std::map<int, int64_t>>> channels; // channel -> playing note (-1 for none), the Per-Note Pitch of each note number
+	int64_t time = 0;
+	bool clipEnded = false;
+	for (size_t i=0; i < words.size(); ) {
+		const uint32_t word = words[i];
+		const int type = word >> 28;
+		const size_t wordCount = type <= 0x2 ? 1 : (type <= 0x4 ? 2 : (type <= 0xA ? 2 : 4)) + (type == 0x5 ? 2 : 0);
+		if (words.size() - i < wordCount) { error = "truncated message"; return false; }
+		if (type == 0x0 && ((word >> 20) & 0xF) == 0x4) time += word & 0xFFFFF; // Delta Clockstamp
+		if (type == 0xF && ((word >> 16) & 0x3FF) == 0x21) clipEnded = true;
+		if (type == 0x4) {
+			const int status = (word >> 20) & 0xF;
+			const int channel = (word >> 16) & 0xF;
+			const int note = (word >> 8) & 0x7F;
+			auto& [playingNote, perNotePitch] = channels.try_emplace(channel, -1, std::map<int, int64_t>()).first->second;
+			if (status == 0x9) playingNote = note;
+			else if (status == 0x8 && playingNote == note) playingNote = -1;
+			else if (status == 0x0 && (word & 0xFF) == 3) perNotePitch[note] = words[i+1]; // Registered Per-Note Controller 3, Pitch 7.25
+			if (status == 0x9 || status == 0x8 || status == 0x0) {
+				auto pitch = perNotePitch.find(playingNote);
+				const int64_t curPitch = playingNote == -1 ? -1 : (pitch != perNotePitch.end() ? pitch->second : (int64_t)playingNote << 25);
+				addPitchChange(timeline, channel, time, curPitch);
+				if (status == 0x9) noteStarts.insert({channel, time, curPitch});
+			}
+		}
+		i += wordCount;
+	}
+	if (clipEnded == false) { error = "no End of Clip"; return false; }
+	return true;
+}
+// writes the conversion of songData at the reference's PPQN as a MIDI 2.0 Clip File, reads it back, and compares the pitch each channel plays over time with the reference's notes and pitch bends
+static std::string compareClipWithReference(const std::vector<smf_track_record>& referenceTracks, int referenceTimebase, std::vector<gb_reg_write>& songData, const std::string& clipFilename, size_t maxDiffsToPrint, std::string& details){
+	Smf* midiFile = songData2smf(songData, MASTER_CLOCK, referenceTimebase);
+	const bool written = smf2umpClipFile(midiFile, clipFilename);
+	smfDelete(midiFile);
+	std::string bytes;
+	const bool read = written && readWholeFile(clipFilename, bytes);
+	std::filesystem::remove(clipFilename);
+	pitch_timeline timeline;
+	note_starts noteStarts;
+	std::string error;
+	if (read == false || clipPitchTimeline(bytes, timeline, noteStarts, error) == false) {
+		details += "  the clip file could not be " + std::string(read ? "parsed: " + error : "written") + "\n";
+		return "INVALID";
+	}
+	note_starts referenceNoteStarts;
+	const pitch_timeline referenceTimeline = smfPitchTimeline(referenceTracks, referenceNoteStarts);
+	size_t diffCount = 0;
+	for (const auto& [channel, referenceChanges] : referenceTimeline) {
+		const std::vector<std::pair<int64_t, int64_t>>& changes = timeline[channel];
+		for (size_t i=0; i < std::max(referenceChanges.size(), changes.size()); i++) {
+			if (i < referenceChanges.size() && i < changes.size() && referenceChanges[i] == changes[i]) continue;
+			if (diffCount < maxDiffsToPrint) {
+				auto describe = [](const std::vector<std::pair<int64_t, int64_t>>& list, size_t index){
+					if (index >= list.size()) return std::string("nothing");
+					return "t=" + std::to_string(list[index].first) + (list[index].second == -1 ? std::string(" silent") : " pitch " + std::to_string(list[index].second >> 25) + "+" + std::to_string(list[index].second & 0x1FFFFFF) + "/2^25");
+				};
+				details += "  channel " + std::to_string(channel) + ", pitch change " + std::to_string(i) + ": - " + describe(referenceChanges, i) + ", + " + describe(changes, i) + "\n";
+			}
+			diffCount++;
+			break; // the rest of the channel is off by one change
+		}
+	}
+	// a note on in the clip is a trigger, so it must start at the pitch of a note on in the reference. (The reference has more: the legato ones are pitch changes in the clip.)
+	for (const auto& [channel, noteOnTime, startPitch] : noteStarts) {
+		if (referenceNoteStarts.count({channel, noteOnTime, startPitch})) continue;
+		if (diffCount < maxDiffsToPrint) details += "  channel " + std::to_string(channel) + ", t=" + std::to_string(noteOnTime) + ": a note starts at a pitch that no note on of the reference starts at on that tick\n";
+		diffCount++;
+	}
+	return diffCount ? "DIFF" : "ok";
+}
+
+// converts songData the same way songData2midi does, minus the file, and returns the fastest time of a few runs
+static std::string convertAndTime(std::vector<gb_reg_write>& songData, int PPQN, double& bestMilliseconds){
+	std::string bytes;
+	for (int i=0; i<TIMING_REPEAT; i++) {
+		auto start = std::chrono::steady_clock::now();
+		Smf* midiFile = songData2smf(songData, MASTER_CLOCK, PPQN);
+		bytes = serialiseSmf(midiFile);
+		smfDelete(midiFile);
+		double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		if (i == 0 || milliseconds < bestMilliseconds) bestMilliseconds = milliseconds;
+	}
+	return bytes;
+}
+
+static std::vector<std::string> listRegisterStreams(const std::string& directory){ // stems of the .iodump files, sorted
+	std::vector<std::string> stems;
+	std::error_code errorCode;
+	for (const auto& entry : std::filesystem::directory_iterator(directory, errorCode)) {
+		if (entry.path().extension() == ".iodump") stems.push_back(entry.path().stem().string());
+	}
+	std::sort(stems.begin(), stems.end());
+	return stems;
+}
+static bool loadRegisterStream(const std::string& directory, const std::string& stem, std::vector<gb_reg_write>& songData){
+	std::string text;
+	if (readWholeFile(directory + "/" + stem + ".iodump", text) == false) return false;
+	uint64_t cyclesPassed = 0;
+	iodumperText2songData(text.data(), text.size(), songData, cyclesPassed);
+	return true;
+}
+static std::string referenceFilename(const std::string& directory, const std::string& stem, int PPQN){
+	return directory + "/" + stem + ".ppqn" + std::to_string(PPQN) + ".mid";
+}
+
+static bool generateCorpus(const std::string& directory){
+	struct corpus_entry { const char* name; bool random; double seconds; uint32_t seed; };
+	const corpus_entry CORPUS[] = {
+		{"synthetic-30s-seed1", false, 30, 1}, // melodic, PCM swapping and NR32 toggling sections
+		{"synthetic-12s-seed7", false, 12, 7},
+		{"random-20s-seed3", true, 20, 3},
+		{"random-5s-seed11", true, 5, 11},
+	};
+	for (const corpus_entry& entry : CORPUS) {
+		std::vector<gb_reg_write> songData;
+		if (entry.random) generateRandomSongData(songData, entry.seconds, entry.seed);
+		else generateSyntheticSongData(songData, entry.seconds, entry.seed);
+		std::string text = songData2iodumperText(songData);
+		std::string filename = directory + "/" + entry.name + ".iodump";
+		if (writeWholeFile(filename, text.data(), text.size()) == false) {
+			fprintf(stderr, "Error: could not write %s.\n", filename.c_str());
+			return false;
+		}
+		printf("generated %s (%zu writes)\n", filename.c_str(), songData.size());
+	}
+	return true;
+}
+
+static int record(const std::string& directory){
+	std::error_code errorCode;
+	std::filesystem::create_directories(directory, errorCode);
+	std::vector<std::string> stems = listRegisterStreams(directory);
+	if (stems.empty()) {
+		if (generateCorpus(directory) == false) return 1;
+		stems = listRegisterStreams(directory);
+	}
+	FILE* throughputFile = fopen((directory + "/throughput.txt").c_str(), "w");
+	if (throughputFile == nullptr) {
+		fprintf(stderr, "Error: could not write %s/throughput.txt.\n", directory.c_str());
+		return 1;
+	}
+	for (const std::string& stem : stems) {
+		std::vector<gb_reg_write> songData;
+		if (loadRegisterStream(directory, stem, songData) == false) {
+			fprintf(stderr, "Error: could not read %s/%s.iodump.\n", directory.c_str(), stem.c_str());
+			fclose(throughputFile);
+			return 1;
+		}
+		for (int PPQN : GOLDEN_PPQNS) {
+			double milliseconds = 0;
+			std::string bytes = convertAndTime(songData, PPQN, milliseconds);
+			std::string filename = referenceFilename(directory, stem, PPQN);
+			if (writeWholeFile(filename, bytes.data(), bytes.size()) == false) {
+				fprintf(stderr, "Error: could not write %s.\n", filename.c_str());
+				fclose(throughputFile);
+				return 1;
+			}
+			fprintf(throughputFile, "%s %d %.3f\n", stem.c_str(), PPQN, milliseconds);
+			printf("recorded %s (%zu writes, %.2f ms)\n", filename.c_str(), songData.size(), milliseconds);
+		}
+	}
+	fclose(throughputFile);
+	return 0;
+}
+
+static int check(const std::string& directory, size_t maxDiffsToPrint){
+	std::map<std::string, double> recordedMilliseconds; // "stem ppqn" -> ms
+	std::string throughputText;
+	if (readWholeFile(directory + "/throughput.txt", throughputText)) {
+		char stem[512];
+		int PPQN;
+		double milliseconds;
+		for (const char* line = throughputText.c_str(); *line; ) {
+			if (sscanf(line, "%511s %d %lf", stem, &PPQN, &milliseconds) == 3) recordedMilliseconds[std::string(stem) + " " + std::to_string(PPQN)] = milliseconds;
+			const char* nextLine = strchr(line, '\n');
+			if (nextLine == nullptr) break;
+			line = nextLine + 1;
+		}
+	}
+
+	std::vector<std::string> stems = listRegisterStreams(directory);
+	size_t casesChecked = 0, casesDiffering = 0;
+	double totalRecordedMilliseconds = 0, totalMilliseconds = 0, totalFilteredMilliseconds = 0;
+	printf("%-40s %6s %8s %8s %8s %8s %8s %8s %8s %8s | %10s %10s %8s %10s\n", "register stream", "ppqn", "result", "filtered", "gbce", "bpm", "variants", "clip", "window", "removed", "ref ms", "now ms", "speedup", "filtered");
+	for (const std::string& stem : stems) {
+		std::vector<gb_reg_write> songData;
+		if (loadRegisterStream(directory, stem, songData) == false) {
+			fprintf(stderr, "Error: could not read %s/%s.iodump.\n", directory.c_str(), stem.c_str());
+			return 1;
+		}
+		// the register writes as they come back from a .gbce file, which are converted the same way
+		const std::string gbceFilename = (std::filesystem::temp_directory_path() / ("gbs2midi-golden-" + stem + ".gbce")).string();
+		std::vector<gb_reg_write> gbceSongData;
+		unsigned int gbceTimeUnitsPerSecond = 0;
+		bool gbceLoaded = saveGbceFile(songData, MASTER_CLOCK, gbceFilename) && loadGbceFile(gbceSongData, gbceTimeUnitsPerSecond, gbceFilename);
+		std::filesystem::remove(gbceFilename);
+		const std::string clipFilename = (std::filesystem::temp_directory_path() / ("gbs2midi-golden-" + stem + ".midi2")).string();
+		if (gbceLoaded == false || gbceTimeUnitsPerSecond != MASTER_CLOCK) {
+			fprintf(stderr, "Error: the register writes of %s don't survive a .gbce file.\n", stem.c_str());
+			return 1;
+		}
+		for (int PPQN : GOLDEN_PPQNS) {
+			std::string referenceBytes;
+			if (readWholeFile(referenceFilename(directory, stem, PPQN), referenceBytes) == false) continue; // not recorded
+			int referenceTimebase = 0;
+			std::vector<smf_track_record> referenceTracks;
+			std::string error;
+			if (parseSmf((const uint8_t*)referenceBytes.data(), referenceBytes.size(), referenceTimebase, referenceTracks, error) == false) {
+				fprintf(stderr, "Error: %s is not a valid midi file: %s.\n", referenceFilename(directory, stem, PPQN).c_str(), error.c_str());
+				return 1;
+			}
+
+			double milliseconds = 0;
+			std::string details;
+			std::string result = compareWithReference(referenceTracks, referenceTimebase, convertAndTime(songData, PPQN, milliseconds), maxDiffsToPrint, details);
+			// the same, after filterRedundantRegWrites. Removing writes must never change the output.
+			std::vector<gb_reg_write> filteredSongData = songData;
+			size_t removedCount = filterRedundantRegWrites(filteredSongData, MASTER_CLOCK, PPQN);
+			double filteredMilliseconds = 0;
+			std::string filteredDetails;
+			std::string filteredResult = compareWithReference(referenceTracks, referenceTimebase, convertAndTime(filteredSongData, PPQN, filteredMilliseconds), maxDiffsToPrint, filteredDetails);
+			// the same from the .gbce file, and at another BPM
+			std::vector<gb_reg_write> filteredGbceSongData = gbceSongData;
+			filterRedundantRegWrites(filteredGbceSongData, gbceTimeUnitsPerSecond, PPQN);
+			double gbceMilliseconds = 0;
+			std::string gbceDetails;
+			std::string gbceResult = compareWithReference(referenceTracks, referenceTimebase, convertAndTime(filteredGbceSongData, PPQN, gbceMilliseconds), maxDiffsToPrint, gbceDetails);
+			std::string tempoDetails;
+			std::string tempoResult = compareAtHalfTempo(referenceTracks, referenceTimebase, songData, maxDiffsToPrint, tempoDetails);
+			std::string variantDetails;
+			std::string variantResult = compareVariants(referenceTracks, referenceTimebase, songData, maxDiffsToPrint, variantDetails);
+			std::string clipDetails;
+			std::string clipResult = compareClipWithReference(referenceTracks, referenceTimebase, songData, clipFilename, maxDiffsToPrint, clipDetails);
+			std::string windowDetails;
+			std::string windowResult = compareWindowState(referenceTracks, referenceTimebase, songData, windowDetails);
+
+			auto recorded = recordedMilliseconds.find(stem + " " + std::to_string(PPQN));
+			if (recorded != recordedMilliseconds.end()) {
+				printf("%-40s %6d %8s %8s %8s %8s %8s %8s %8s %7.1f%% | %10.2f %10.2f %7.2fx %10.2f\n", stem.c_str(), PPQN, result.c_str(), filteredResult.c_str(), gbceResult.c_str(), tempoResult.c_str(), variantResult.c_str(), clipResult.c_str(), windowResult.c_str(), 100.0 * removedCount / songData.size(), recorded->second, milliseconds, recorded->second / milliseconds, filteredMilliseconds);
+				totalRecordedMilliseconds += recorded->second;
+				totalMilliseconds += milliseconds;
+			} else {
+				printf("%-40s %6d %8s %8s %8s %8s %8s %8s %8s %7.1f%% | %10s %10.2f %8s %10.2f\n", stem.c_str(), PPQN, result.c_str(), filteredResult.c_str(), gbceResult.c_str(), tempoResult.c_str(), variantResult.c_str(), clipResult.c_str(), windowResult.c_str(), 100.0 * removedCount / songData.size(), "-", milliseconds, "-", filteredMilliseconds);
+			}
+			totalFilteredMilliseconds += filteredMilliseconds;
+			printf("%s", details.c_str());
+			if (filteredDetails.empty() == false) printf("  after filtering:\n%s", filteredDetails.c_str());
+			if (gbceDetails.empty() == false) printf("  from the .gbce file:\n%s", gbceDetails.c_str());
+			if (tempoDetails.empty() == false) printf("  at %d PPQN and %.0f BPM:\n%s", PPQN * 2, DEFAULT_MIDI_BPM / 2, tempoDetails.c_str());
+			if (variantDetails.empty() == false) printf("  --also variants:\n%s", variantDetails.c_str());
+			if (clipDetails.empty() == false) printf("  as a MIDI 2.0 Clip File:\n%s", clipDetails.c_str());
+			if (windowDetails.empty() == false) printf("  at the start of a --start window:\n%s", windowDetails.c_str());
+			if (result != "ok" || filteredResult != "ok" || gbceResult != "ok" || (tempoResult != "ok" && tempoResult != "-") || variantResult != "ok" || clipResult != "ok" || (windowResult != "ok" && windowResult != "-")) casesDiffering++;
+			casesChecked++;
+			fflush(stdout);
+		}
+	}
+	if (casesChecked == 0) {
+		fprintf(stderr, "Error: no reference outputs found in %s. Run \"record\" first.\n", directory.c_str());
+		return 1;
+	}
+	printf("%zu of %zu outputs match the reference.", casesChecked - casesDiffering, casesChecked);
+	if (totalMilliseconds > 0) printf(" Total conversion time: %.2f ms -> %.2f ms (%.2fx), %.2f ms after filtering.", totalRecordedMilliseconds, totalMilliseconds, totalRecordedMilliseconds / totalMilliseconds, totalFilteredMilliseconds);
+	printf("\n");
+	return casesDiffering ? 1 : 0;
+}
+
+int main(int argc, char *const argv[]){
+
+if (argc < 3) {
+	displayHelp();
+	return 1;
+}
+std::string mode = argv[1];
+std::string directory = argv[2];
+size_t maxDiffsToPrint = 20;
+for (int i=3; i<argc; i++) {
+	std::string arg = argv[i];
+	if (arg.rfind("--max-diffs=", 0) == 0) {
+		maxDiffsToPrint = strtoul(arg.c_str() + strlen("--max-diffs="), nullptr, 10);
+	} else {
+		displayHelp();
+		return 1;
+	}
+}
+
+if (mode == "record") return record(directory);
+if (mode == "check") return check(directory, maxDiffsToPrint);
+displayHelp();
+return 1;
+}
@@ -10,6 +10,7 @@
 #include "libsmfc.h"
 
 #define SMF_VARLEN_MAX          4
+#define SMF_DELTATIME_MAX       0x0fffffff
 #define SMF_TIMEBASE_MAX        0x7fff
 #define SMF_CHANNEL_MAX         0x0f
 #define SMF_PORT_MAX            0xff
@@ -32,6 +33,12 @@
 #define SMF_MTHD_SIZE           14
 #define SMF_MTRK_SIZE           8
 
+#define SMF_WRITEBUFFER_MIN     0x10000
+
+/* a delta time of SMF_DELTATIME_MAX followed by an empty text event. Used to split gaps that do not fit in a 4-byte variable length quantity */
+static const byte smfDeltaTimeFillerData[] = { 0xff, 0xff, 0xff, 0x7f, 0xff, 0x01, 0x00 };
+#define SMF_DELTATIME_FILLER_SIZE   sizeof(smfDeltaTimeFillerData)
+
 unsigned int smfReadVarLength(byte* buffer, size_t bufferSize)
 {
   unsigned int value;
@@ -107,30 +114,24 @@ size_t smfWriteVarLength(unsigned int value, byte* buffer, size_t bufferSize)
 
 
 bool smfEventIsNoteOff(SmfEvent* event);
+size_t smfEventGetStatusSkipSize(SmfEvent* event, byte* runningStatus);
 
-SmfEvent* smfEventCreate(int time, int port, const byte* data, size_t dataSize)
+SmfEvent* smfEventCreate(SmfTime time, int port, const byte* data, size_t dataSize)
 {
   SmfEvent* newEvent = NULL;
 
   if(data && dataSize && (time >= 0) && (port >= 0) 
       && (port < SMF_PORT_MAX))
   {
-    newEvent = (SmfEvent*) calloc(1, sizeof(SmfEvent));
+    /* the data is stored right after the event, so every event is a single allocation */
+    newEvent = (SmfEvent*) calloc(1, sizeof(SmfEvent) + dataSize);
     if(newEvent)
     {
-      newEvent->data = (byte*) malloc(dataSize);
-      if(newEvent->data)
-      {
-        memcpy(newEvent->data, data, dataSize);
-        newEvent->size = dataSize;
-        newEvent->time = time;
-        newEvent->port = port;
-      }
-      else
-      {
-        free(newEvent);
-        newEvent = NULL;
-      }
+      newEvent->data = (byte*) (newEvent + 1);
+      memcpy(newEvent->data, data, dataSize);
+      newEvent->size = dataSize;
+      newEvent->time = time;
+      newEvent->port = port;
     }
   }
   return newEvent;
@@ -138,11 +139,7 @@ SmfEvent* smfEventCreate(int time, int port, const byte* data, size_t dataSize)
 
 void smfEventDelete(SmfEvent* event)
 {
-  if(event)
-  {
-    free(event->data);
-    free(event);
-  }
+  free(event);
 }
 
 SmfEvent* smfEventCopy(SmfEvent* event)
@@ -183,8 +180,11 @@ int smfEventCompare(SmfEvent* event, SmfEvent* targetEvent)
 
   if(event && targetEvent)
   {
-    result = event->time - targetEvent->time;
-    if(result == 0)
+    if(event->time != targetEvent->time)
+    {
+      result = (event->time > targetEvent->time) ? 1 : -1;
+    }
+    else
     {
       bool eventIsNoteOff = smfEventIsNoteOff(event);
       bool targetEventIsNoteOff = smfEventIsNoteOff(targetEvent);
@@ -236,26 +236,58 @@ bool smfEventIsNoteOff(SmfEvent* event)
   return eventIsNoteOff;
 }
 
+/* running status: a channel message whose status byte repeats the previous one is written without it. Sysex and meta events cancel running status. */
+size_t smfEventGetStatusSkipSize(SmfEvent* event, byte* runningStatus)
+{
+  size_t skipSize = 0;
+  byte status = event->data[0];
+
+  if((status & 0x80) && (status < SMF_EVENT_SYSEX))
+  {
+    if(status == *runningStatus)
+    {
+      skipSize = 1;
+    }
+    *runningStatus = status;
+  }
+  else
+  {
+    *runningStatus = 0;
+  }
+  return skipSize;
+}
+
 
 typedef bool (SmfTrackEnumEventsProc)(SmfEvent*, void*);
 bool smfTrackEnumEvents(SmfTrack* track, SmfTrackEnumEventsProc* eventProc, void* customData);
+size_t smfGetDeltaTimeFillerCount(SmfTime deltaTime);
 
 typedef struct TagSmfTrackGetSizeProcInfo
 {
-  int prevEventTime;
+  SmfTime prevEventTime;
+  byte runningStatus;
   size_t trackSize;
 } SmfTrackGetSizeProcInfo;
 bool smfTrackGetSizeProc(SmfEvent* event, void* customData);
 
 typedef struct TagSmfTrackWriteProcInfo
 {
-  int prevEventTime;
+  SmfTime prevEventTime;
+  byte runningStatus;
   byte* buffer;
   size_t bufferSize;
   size_t transferedSize;
 } SmfTrackWriteProcInfo;
 bool smfTrackWriteProc(SmfEvent* event, void* customData);
 
+typedef struct TagSmfTrackSerializeProcInfo
+{
+  SmfTime prevEventTime;
+  byte runningStatus;
+  SmfWriteBuffer* writeBuffer;
+} SmfTrackSerializeProcInfo;
+bool smfTrackSerializeProc(SmfEvent* event, void* customData);
+
 SmfTrack* smfTrackCreate(void)
 {
   SmfTrack* newTrack;
@@ -293,6 +325,7 @@ void smfTrackDelete(SmfTrack* track)
       smfEventDelete(event);
       event = nextEvent;
     }
+    free(track);
   }
 }
 
@@ -318,7 +351,7 @@ SmfTrack* smfTrackCopy(SmfTrack* track)
   return newTrack;
 }
 
-bool smfTrackInsertEvent(SmfTrack* track, int time, int port, const byte* data, size_t dataSize)
+bool smfTrackInsertEvent(SmfTrack* track, SmfTime time, int port, const byte* data, size_t dataSize)
 {
   SmfEvent* newEvent = smfEventCreate(time, port, data, dataSize);
 
@@ -361,6 +394,79 @@ bool smfTrackInsertEvent(SmfTrack* track, int time, int port, const byte* data,
   return (bool) (newEvent != NULL);
 }
 
+/* Appends an event after the last one, before the end of track, without
+   reordering events that share a time. time must not be earlier than the
+   last event's. */
+bool smfTrackAppendEvent(SmfTrack* track, SmfTime time, int port, const byte* data, size_t dataSize)
+{
+  SmfEvent* newEvent = smfEventCreate(time, port, data, dataSize);
+
+  if(newEvent)
+  {
+    SmfEvent* endOfTrack = track->lastEvent;
+    SmfEvent* prevEvent = endOfTrack->prevEvent;
+
+    if(newEvent->time > endOfTrack->time)
+    {
+      endOfTrack->time = newEvent->time;
+    }
+
+    newEvent->prevEvent = prevEvent;
+    newEvent->nextEvent = endOfTrack;
+    endOfTrack->prevEvent = newEvent;
+    if(prevEvent)
+    {
+      prevEvent->nextEvent = newEvent;
+    }
+    else
+    {
+      track->firstEvent = newEvent;
+    }
+  }
+  return (bool) (newEvent != NULL);
+}
+
+/* Moves every event of sourceTrack but its end of track to the end of
+   track, without copying them, and leaves sourceTrack empty. The moved
+   events must not be earlier than track's last event. */
+bool smfTrackMoveEvents(SmfTrack* track, SmfTrack* sourceTrack)
+{
+  bool result = false;
+
+  if(track && sourceTrack)
+  {
+    SmfEvent* sourceEndOfTrack = sourceTrack->lastEvent;
+
+    if(sourceTrack->firstEvent != sourceEndOfTrack)
+    {
+      SmfEvent* endOfTrack = track->lastEvent;
+      SmfEvent* firstMoved = sourceTrack->firstEvent;
+      SmfEvent* lastMoved = sourceEndOfTrack->prevEvent;
+
+      firstMoved->prevEvent = endOfTrack->prevEvent;
+      if(endOfTrack->prevEvent)
+      {
+        endOfTrack->prevEvent->nextEvent = firstMoved;
+      }
+      else
+      {
+        track->firstEvent = firstMoved;
+      }
+      lastMoved->nextEvent = endOfTrack;
+      endOfTrack->prevEvent = lastMoved;
+      if(lastMoved->time > endOfTrack->time)
+      {
+        endOfTrack->time = lastMoved->time;
+      }
+
+      sourceTrack->firstEvent = sourceEndOfTrack;
+      sourceEndOfTrack->prevEvent = NULL;
+    }
+    result = true;
+  }
+  return result;
+}
+
 size_t smfTrackGetSize(SmfTrack* track)
 {
   size_t trackSize = 0;
@@ -370,6 +476,7 @@ size_t smfTrackGetSize(SmfTrack* track)
     SmfTrackGetSizeProcInfo info;
 
     info.prevEventTime = 0;
+    info.runningStatus = 0;
     info.trackSize = SMF_MTRK_SIZE;
     smfTrackEnumEvents(track, smfTrackGetSizeProc, &info);
     trackSize = info.trackSize;
@@ -380,11 +487,22 @@ size_t smfTrackGetSize(SmfTrack* track)
 bool smfTrackGetSizeProc(SmfEvent* event, void* customData)
 {
   SmfTrackGetSizeProcInfo* info = (SmfTrackGetSizeProcInfo*) customData;
-  int deltaTime = event->time - info->prevEventTime;
-  size_t deltaTimeSize = smfGetVarLengthSize(deltaTime);
+  SmfTime deltaTime = event->time - info->prevEventTime;
+  size_t fillerCount = smfGetDeltaTimeFillerCount(deltaTime);
+  size_t deltaTimeSize;
+  size_t statusSkipSize;
+
+  if(fillerCount)
+  {
+    deltaTime -= (SmfTime) fillerCount * SMF_DELTATIME_MAX;
+    info->trackSize += fillerCount * SMF_DELTATIME_FILLER_SIZE;
+    info->runningStatus = 0;
+  }
+  deltaTimeSize = smfGetVarLengthSize((unsigned int) deltaTime);
+  statusSkipSize = smfEventGetStatusSkipSize(event, &info->runningStatus);
 
   info->trackSize += deltaTimeSize;
-  info->trackSize += event->size;
+  info->trackSize += event->size - statusSkipSize;
   info->prevEventTime = event->time;
   return true;
 }
@@ -407,6 +525,7 @@ size_t smfTrackWrite(SmfTrack* track, byte* buffer, size_t bufferSize)
       transferedSize += SMF_MTRK_SIZE;
 
       info.prevEventTime = 0;
+      info.runningStatus = 0;
       info.buffer = buffer;
       info.bufferSize = bufferSize;
       info.transferedSize = transferedSize;
@@ -429,29 +548,50 @@ bool smfTrackWriteProc(SmfEvent* event, void* customData)
   byte* buffer = info->buffer;
   size_t bufferSize = info->bufferSize;
   size_t transferedSize = info->transferedSize;
-  int deltaTime = event->time - info->prevEventTime;
-  size_t deltaTimeSize = smfGetVarLengthSize(deltaTime);
+  SmfTime deltaTime = event->time - info->prevEventTime;
+  size_t fillerCount = smfGetDeltaTimeFillerCount(deltaTime);
+  size_t deltaTimeSize;
+  size_t statusSkipSize;
+  size_t eventDataSize;
+
+  if(fillerCount)
+  {
+    deltaTime -= (SmfTime) fillerCount * SMF_DELTATIME_MAX;
+    info->runningStatus = 0;
+  }
+  while(fillerCount && (transferedSize < bufferSize))
+  {
+    size_t sizeToTransfer = (bufferSize - transferedSize < SMF_DELTATIME_FILLER_SIZE) 
+      ? bufferSize - transferedSize : SMF_DELTATIME_FILLER_SIZE;
+
+    memcpy(&buffer[transferedSize], smfDeltaTimeFillerData, sizeToTransfer);
+    transferedSize += sizeToTransfer;
+    fillerCount--;
+  }
+  deltaTimeSize = smfGetVarLengthSize((unsigned int) deltaTime);
+  statusSkipSize = smfEventGetStatusSkipSize(event, &info->runningStatus);
+  eventDataSize = event->size - statusSkipSize;
 
   if(bufferSize >= (transferedSize + deltaTimeSize))
   {
-    smfWriteVarLength(deltaTime, &buffer[transferedSize], deltaTimeSize);
+    smfWriteVarLength((unsigned int) deltaTime, &buffer[transferedSize], deltaTimeSize);
     transferedSize += deltaTimeSize;
 
-    if(bufferSize >= (transferedSize + event->size))
+    if(bufferSize >= (transferedSize + eventDataSize))
     {
-      memcpy(&buffer[transferedSize], event->data, event->size);
-      transferedSize += event->size;
+      memcpy(&buffer[transferedSize], &event->data[statusSkipSize], eventDataSize);
+      transferedSize += eventDataSize;
       result = true;
     }
     else
     {
-      memcpy(&buffer[transferedSize], event->data, bufferSize - transferedSize);
+      memcpy(&buffer[transferedSize], &event->data[statusSkipSize], bufferSize - transferedSize);
       transferedSize = bufferSize;
     }
   }
   else
   {
-    smfWriteVarLength(deltaTime, &buffer[transferedSize], bufferSize - transferedSize);
+    smfWriteVarLength((unsigned int) deltaTime, &buffer[transferedSize], bufferSize - transferedSize);
     transferedSize = bufferSize;
   }
 
@@ -505,9 +645,15 @@ bool smfTrackEnumEvents(SmfTrack* track, SmfTrackEnumEventsProc* eventProc, void
   return result;
 }
 
-int smfTrackGetEndTiming(SmfTrack* track)
+size_t smfGetDeltaTimeFillerCount(SmfTime deltaTime)
+{
+  return (deltaTime > SMF_DELTATIME_MAX) 
+    ? (size_t) ((deltaTime - 1) / SMF_DELTATIME_MAX) : 0;
+}
+
+SmfTime smfTrackGetEndTiming(SmfTrack* track)
 {
-  int endTiming = 0;
+  SmfTime endTiming = 0;
 
   if(track)
   {
@@ -518,14 +664,14 @@ int smfTrackGetEndTiming(SmfTrack* track)
   return endTiming;
 }
 
-int smfTrackSetEndTiming(SmfTrack* track, int newEndTiming)
+SmfTime smfTrackSetEndTiming(SmfTrack* track, SmfTime newEndTiming)
 {
-  int oldEndTiming = 0;
+  SmfTime oldEndTiming = 0;
 
   if(track)
   {
     SmfEvent* endOfTrack = track->lastEvent;
-    int lastEventTiming = endOfTrack->prevEvent 
+    SmfTime lastEventTiming = endOfTrack->prevEvent 
       ? endOfTrack->prevEvent->time : 0;
 
     if(newEndTiming >= lastEventTiming)
@@ -580,6 +726,7 @@ void smfDelete(Smf* seq)
     {
       smfTrackDelete(seq->track[trackIndex]);
     }
+    free(seq->track);
     free(seq);
   }
 }
@@ -618,7 +765,7 @@ Smf* smfCopy(Smf* seq)
   return newSeq;
 }
 
-bool smfInsertEvent(Smf* seq, int time, int port, int track, const byte* data, size_t dataSize)
+bool smfInsertEvent(Smf* seq, SmfTime time, int port, int track, const byte* data, size_t dataSize)
 {
   bool result = false;
 
@@ -638,6 +785,46 @@ bool smfInsertEvent(Smf* seq, int time, int port, int track, const byte* data, s
   return result;
 }
 
+bool smfAppendEvent(Smf* seq, SmfTime time, int port, int track, const byte* data, size_t dataSize)
+{
+  bool result = false;
+
+  if(seq)
+  {
+    bool allocResult = true;
+
+    if(track >= seq->numTracks)
+    {
+      allocResult = smfReallocTrack(seq, track + 1);
+    }
+    if(allocResult)
+    {
+      result = smfTrackAppendEvent(seq->track[track], time, port, data, dataSize);
+    }
+  }
+  return result;
+}
+
+bool smfMoveTrackEvents(Smf* seq, int track, SmfTrack* sourceTrack)
+{
+  bool result = false;
+
+  if(seq)
+  {
+    bool allocResult = true;
+
+    if(track >= seq->numTracks)
+    {
+      allocResult = smfReallocTrack(seq, track + 1);
+    }
+    if(allocResult)
+    {
+      result = smfTrackMoveEvents(seq->track[track], sourceTrack);
+    }
+  }
+  return result;
+}
+
 size_t smfGetSize(Smf* seq)
 {
   size_t seqSize = 0;
@@ -703,9 +890,9 @@ int smfSetTimebase(Smf* seq, int newTimebase)
   return oldTimebase;
 }
 
-int smfSetEndTimingOfTrack(Smf* seq, int track, int newEndTiming)
+SmfTime smfSetEndTimingOfTrack(Smf* seq, int track, SmfTime newEndTiming)
 {
-  int oldEndTiming = 0;
+  SmfTime oldEndTiming = 0;
 
   if(seq)
   {
@@ -763,3 +950,141 @@ bool smfReallocTrack(Smf* seq, int newNumTracks)
   }
   return result;
 }
+
+
+void smfWriteBufferInit(SmfWriteBuffer* writeBuffer)
+{
+  if(writeBuffer)
+  {
+    writeBuffer->data = NULL;
+    writeBuffer->size = 0;
+    writeBuffer->capacity = 0;
+  }
+}
+
+void smfWriteBufferFree(SmfWriteBuffer* writeBuffer)
+{
+  if(writeBuffer)
+  {
+    free(writeBuffer->data);
+    smfWriteBufferInit(writeBuffer);
+  }
+}
+
+bool smfWriteBufferReserve(SmfWriteBuffer* writeBuffer, size_t sizeToAppend)
+{
+  bool result = false;
+
+  if(writeBuffer)
+  {
+    size_t requiredSize = writeBuffer->size + sizeToAppend;
+
+    result = true;
+    if(requiredSize > writeBuffer->capacity)
+    {
+      size_t newCapacity = (writeBuffer->capacity > 0) 
+        ? writeBuffer->capacity : SMF_WRITEBUFFER_MIN;
+      byte* newData;
+
+      while(newCapacity < requiredSize)
+      {
+        newCapacity *= 2;
+      }
+      newData = (byte*) realloc(writeBuffer->data, newCapacity);
+      if(newData)
+      {
+        writeBuffer->data = newData;
+        writeBuffer->capacity = newCapacity;
+      }
+      else
+      {
+        result = false;
+      }
+    }
+  }
+  return result;
+}
+
+bool smfWriteHeader(Smf* seq, SmfWriteBuffer* writeBuffer)
+{
+  bool result = false;
+
+  if(seq && smfWriteBufferReserve(writeBuffer, SMF_MTHD_SIZE))
+  {
+    byte* MThdData = &writeBuffer->data[writeBuffer->size];
+    const byte MThdTemplate[SMF_MTHD_SIZE] = { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 1, 0, 0, 0, 0 };
+
+    memcpy(MThdData, MThdTemplate, SMF_MTHD_SIZE);
+    smfWriteByte(2, seq->numTracks, &MThdData[10], 2);
+    smfWriteByte(2, seq->timebase, &MThdData[12], 2);
+    writeBuffer->size += SMF_MTHD_SIZE;
+    result = true;
+  }
+  return result;
+}
+
+/* appends a complete MTrk chunk in a single walk over the events; the chunk length is backpatched afterwards */
+bool smfTrackSerialize(SmfTrack* track, SmfWriteBuffer* writeBuffer)
+{
+  bool result = false;
+
+  if(track && smfWriteBufferReserve(writeBuffer, SMF_MTRK_SIZE))
+  {
+    const byte MTrkData[SMF_MTRK_SIZE] = { 'M', 'T', 'r', 'k', 0, 0, 0, 0 };
+    size_t MTrkOffset = writeBuffer->size;
+    SmfTrackSerializeProcInfo info;
+
+    memcpy(&writeBuffer->data[MTrkOffset], MTrkData, SMF_MTRK_SIZE);
+    writeBuffer->size += SMF_MTRK_SIZE;
+
+    info.prevEventTime = 0;
+    info.runningStatus = 0;
+    info.writeBuffer = writeBuffer;
+    result = smfTrackEnumEvents(track, smfTrackSerializeProc, &info);
+    if(result)
+    {
+      size_t trackSize = writeBuffer->size - MTrkOffset - SMF_MTRK_SIZE;
+
+      smfWriteByte(4, (unsigned int) trackSize, &writeBuffer->data[MTrkOffset + 4], 4);
+    }
+  }
+  return result;
+}
+
+bool smfTrackSerializeProc(SmfEvent* event, void* customData)
+{
+  bool result = false;
+  SmfTrackSerializeProcInfo* info = (SmfTrackSerializeProcInfo*) customData;
+  SmfWriteBuffer* writeBuffer = info->writeBuffer;
+  SmfTime deltaTime = event->time - info->prevEventTime;
+  size_t fillerCount = smfGetDeltaTimeFillerCount(deltaTime);
+  size_t deltaTimeSize;
+  size_t statusSkipSize;
+  size_t eventDataSize;
+
+  if(fillerCount)
+  {
+    deltaTime -= (SmfTime) fillerCount * SMF_DELTATIME_MAX;
+    info->runningStatus = 0;
+  }
+  deltaTimeSize = smfGetVarLengthSize((unsigned int) deltaTime);
+  statusSkipSize = smfEventGetStatusSkipSize(event, &info->runningStatus);
+  eventDataSize = event->size - statusSkipSize;
+
+  if(smfWriteBufferReserve(writeBuffer, fillerCount * SMF_DELTATIME_FILLER_SIZE + deltaTimeSize + eventDataSize))
+  {
+    for(; fillerCount > 0; fillerCount--)
+    {
+      memcpy(&writeBuffer->data[writeBuffer->size], smfDeltaTimeFillerData, SMF_DELTATIME_FILLER_SIZE);
+      writeBuffer->size += SMF_DELTATIME_FILLER_SIZE;
+    }
+    smfWriteVarLength((unsigned int) deltaTime, &writeBuffer->data[writeBuffer->size], deltaTimeSize);
+    writeBuffer->size += deltaTimeSize;
+    memcpy(&writeBuffer->data[writeBuffer->size], &event->data[statusSkipSize], eventDataSize);
+    writeBuffer->size += eventDataSize;
+    result = true;
+  }
+
+  info->prevEventTime = event->time;
+  return result;
+}
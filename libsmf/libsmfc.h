@@ -7,15 +7,16 @@
 #define LIBSMFC_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 	extern "C" {
 #endif
 
 #if !defined(bool) && !defined(__cplusplus)
-  typedef int bool;
-  #define true    1
-  #define false   0
+  /* C99 bool has the same size and ABI as C++ bool, which matters once
+     the C and C++ objects are link-time optimised together */
+  #include <stdbool.h>
 #endif /* !bool */
 
 #ifndef byte
@@ -25,6 +26,9 @@
   typedef signed char sbyte;
 #endif /* !sbyte */
 
+/* absolute event time in ticks. 64-bit so that long captures at a high timebase cannot overflow */
+typedef int64_t SmfTime;
+
 unsigned int smfReadVarLength(byte* buffer, size_t bufferSize);
 size_t smfWriteByte(size_t sizeToTransfer, unsigned int value, byte* buffer, size_t bufferSize);
 size_t smfGetVarLengthSize(unsigned int value);
@@ -36,13 +40,13 @@ struct TagSmfEvent
 {
   byte*       data;
   size_t      size;
-  int         time;
+  SmfTime     time;
   int         port;
   SmfEvent*   prevEvent;
   SmfEvent*   nextEvent;
 };
 
-SmfEvent* smfEventCreate(int time, int port, const byte* data, size_t dataSize);
+SmfEvent* smfEventCreate(SmfTime time, int port, const byte* data, size_t dataSize);
 void smfEventDelete(SmfEvent* event);
 SmfEvent* smfEventCopy(SmfEvent* event);
 size_t smfEventGetSize(SmfEvent* event);
@@ -59,11 +63,13 @@ typedef struct TagSmfTrack
 SmfTrack* smfTrackCreate(void);
 void smfTrackDelete(SmfTrack* track);
 SmfTrack* smfTrackCopy(SmfTrack* track);
-bool smfTrackInsertEvent(SmfTrack* track, int time, int port, const byte* data, size_t dataSize);
+bool smfTrackInsertEvent(SmfTrack* track, SmfTime time, int port, const byte* data, size_t dataSize);
+bool smfTrackAppendEvent(SmfTrack* track, SmfTime time, int port, const byte* data, size_t dataSize);
+bool smfTrackMoveEvents(SmfTrack* track, SmfTrack* sourceTrack);
 size_t smfTrackGetSize(SmfTrack* track);
 size_t smfTrackWrite(SmfTrack* track, byte* buffer, size_t bufferSize);
-int smfTrackGetEndTiming(SmfTrack* track);
-int smfTrackSetEndTiming(SmfTrack* track, int newEndTiming);
+SmfTime smfTrackGetEndTiming(SmfTrack* track);
+SmfTime smfTrackSetEndTiming(SmfTrack* track, SmfTime newEndTiming);
 
 
 typedef struct TagSmf
@@ -76,11 +82,27 @@ typedef struct TagSmf
 Smf* smfCreate(void);
 void smfDelete(Smf* seq);
 Smf* smfCopy(Smf* seq);
-bool smfInsertEvent(Smf* seq, int time, int port, int track, const byte* data, size_t dataSize);
+bool smfInsertEvent(Smf* seq, SmfTime time, int port, int track, const byte* data, size_t dataSize);
+bool smfAppendEvent(Smf* seq, SmfTime time, int port, int track, const byte* data, size_t dataSize);
+bool smfMoveTrackEvents(Smf* seq, int track, SmfTrack* sourceTrack);
 size_t smfGetSize(Smf* seq);
 size_t smfWrite(Smf* seq, byte* buffer, size_t bufferSize);
 int smfSetTimebase(Smf* seq, int newTimebase);
-int smfSetEndTimingOfTrack(Smf* seq, int track, int newEndTiming);
+SmfTime smfSetEndTimingOfTrack(Smf* seq, int track, SmfTime newEndTiming);
+
+
+typedef struct TagSmfWriteBuffer
+{
+  byte*       data;
+  size_t      size;
+  size_t      capacity;
+} SmfWriteBuffer;
+
+void smfWriteBufferInit(SmfWriteBuffer* writeBuffer);
+void smfWriteBufferFree(SmfWriteBuffer* writeBuffer);
+bool smfWriteBufferReserve(SmfWriteBuffer* writeBuffer, size_t sizeToAppend);
+bool smfWriteHeader(Smf* seq, SmfWriteBuffer* writeBuffer);
+bool smfTrackSerialize(SmfTrack* track, SmfWriteBuffer* writeBuffer);
 
 #ifdef __cplusplus
 	}
@@ -25,25 +25,44 @@
 bool smfWriteFile(Smf* seq, const char* filename)
 {
   bool result = false;
-  size_t seqSize = smfGetSize(seq);
   FILE* fileWriter = fopen(filename, "wb");
 
   if(fileWriter)
   {
-    byte* buffer = (byte*) malloc(seqSize);
+    result = smfWriteStream(seq, fileWriter);
+    if(fclose(fileWriter) != 0)
+    {
+      result = false;
+    }
+  }
+  return result;
+}
+
+/* serialises one track at a time into a reused buffer, so the stream can be a pipe or stdout and the whole file is never held in memory */
+bool smfWriteStream(Smf* seq, FILE* stream)
+{
+  bool result = false;
+
+  if(seq && stream)
+  {
+    SmfWriteBuffer writeBuffer;
+    int trackIndex;
 
-    if(buffer)
+    smfWriteBufferInit(&writeBuffer);
+    result = smfWriteHeader(seq, &writeBuffer);
+    for(trackIndex = 0; result && (trackIndex < seq->numTracks); trackIndex++)
     {
-      smfWrite(seq, buffer, seqSize);
-      result = (bool) fwrite(buffer, seqSize, 1, fileWriter);
-      free(buffer);
+      result = smfTrackSerialize(seq->track[trackIndex], &writeBuffer) 
+        && (fwrite(writeBuffer.data, 1, writeBuffer.size, stream) == writeBuffer.size);
+      writeBuffer.size = 0;
     }
-    fclose(fileWriter);
+    smfWriteBufferFree(&writeBuffer);
+    result = result && (fflush(stream) == 0);
   }
   return result;
 }
 
-bool smfInsertNoteOff(Smf* seq, int time, int channel, int track, int key, int velocity)
+bool smfInsertNoteOff(Smf* seq, SmfTime time, int channel, int track, int key, int velocity)
 {
   bool result = false;
 
@@ -59,7 +78,7 @@ bool smfInsertNoteOff(Smf* seq, int time, int channel, int track, int key, int v
   return result;
 }
 
-bool smfInsertNoteOn(Smf* seq, int time, int channel, int track, int key, int velocity)
+bool smfInsertNoteOn(Smf* seq, SmfTime time, int channel, int track, int key, int velocity)
 {
   bool result = false;
 
@@ -75,7 +94,7 @@ bool smfInsertNoteOn(Smf* seq, int time, int channel, int track, int key, int ve
   return result;
 }
 
-bool smfInsertNote(Smf* seq, int time, int channel, int track, int key, int velocity, int duration)
+bool smfInsertNote(Smf* seq, SmfTime time, int channel, int track, int key, int velocity, int duration)
 {
   bool result = false;
 
@@ -87,7 +106,7 @@ bool smfInsertNote(Smf* seq, int time, int channel, int track, int key, int velo
   return result;
 }
 
-bool smfInsertKeyPress(Smf* seq, int time, int channel, int track, int key, int amount)
+bool smfInsertKeyPress(Smf* seq, SmfTime time, int channel, int track, int key, int amount)
 {
   bool result = false;
 
@@ -103,7 +122,7 @@ bool smfInsertKeyPress(Smf* seq, int time, int channel, int track, int key, int
   return result;
 }
 
-bool smfInsertControl(Smf* seq, int time, int channel, int track, int controlNumber, int value)
+bool smfInsertControl(Smf* seq, SmfTime time, int channel, int track, int controlNumber, int value)
 {
   bool result = false;
 
@@ -119,7 +138,7 @@ bool smfInsertControl(Smf* seq, int time, int channel, int track, int controlNum
   return result;
 }
 
-bool smfInsertProgram(Smf* seq, int time, int channel, int track, int programNumber)
+bool smfInsertProgram(Smf* seq, SmfTime time, int channel, int track, int programNumber)
 {
   bool result = false;
 
@@ -134,7 +153,7 @@ bool smfInsertProgram(Smf* seq, int time, int channel, int track, int programNum
   return result;
 }
 
-bool smfInsertChanPress(Smf* seq, int time, int channel, int track, int key, int amount)
+bool smfInsertChanPress(Smf* seq, SmfTime time, int channel, int track, int key, int amount)
 {
   bool result = false;
 
@@ -150,7 +169,7 @@ bool smfInsertChanPress(Smf* seq, int time, int channel, int track, int key, int
   return result;
 }
 
-bool smfInsertPitchBend(Smf* seq, int time, int channel, int track, int value)
+bool smfInsertPitchBend(Smf* seq, SmfTime time, int channel, int track, int value)
 {
   bool result = false;
 
@@ -167,7 +186,7 @@ bool smfInsertPitchBend(Smf* seq, int time, int channel, int track, int value)
   return result;
 }
 
-bool smfInsertSysex(Smf* seq, int time, int port, int track, const byte* data, size_t dataSize)
+bool smfInsertSysex(Smf* seq, SmfTime time, int port, int track, const byte* data, size_t dataSize)
 {
   bool result = false;
 
@@ -190,7 +209,7 @@ bool smfInsertSysex(Smf* seq, int time, int port, int track, const byte* data, s
   return result;
 }
 
-bool smfInsertMetaEvent(Smf* seq, int time, int track, int metaType, const byte* data, size_t dataSize)
+bool smfInsertMetaEvent(Smf* seq, SmfTime time, int track, int metaType, const byte* data, size_t dataSize)
 {
   bool result = false;
 
@@ -214,7 +233,7 @@ bool smfInsertMetaEvent(Smf* seq, int time, int track, int metaType, const byte*
   return result;
 }
 
-bool smfInsertMetaText(Smf* seq, int time, int track, int metaType, const char* text)
+bool smfInsertMetaText(Smf* seq, SmfTime time, int track, int metaType, const char* text)
 {
   bool result = false;
 
@@ -225,7 +244,7 @@ bool smfInsertMetaText(Smf* seq, int time, int track, int metaType, const char*
   return result;
 }
 
-bool smfInsertGM1SystemOn(Smf* seq, int time, int port, int track)
+bool smfInsertGM1SystemOn(Smf* seq, SmfTime time, int port, int track)
 {
   byte sysexGM1SystemOn[] = { 0xF0, 0x7E, 0x7F, 0x09, 0x01, 0xF7 };
 
@@ -233,7 +252,7 @@ bool smfInsertGM1SystemOn(Smf* seq, int time, int port, int track)
     sysexGM1SystemOn, sizeof(sysexGM1SystemOn));
 }
 
-bool smfInsertMasterVolume(Smf* seq, int time, int port, int track, int volume)
+bool smfInsertMasterVolume(Smf* seq, SmfTime time, int port, int track, int volume)
 {
   bool result = false;
 
@@ -246,7 +265,7 @@ bool smfInsertMasterVolume(Smf* seq, int time, int port, int track, int volume)
   return result;
 }
 
-bool smfInsertTempo(Smf* seq, int time, int track, int microSeconds)
+bool smfInsertTempo(Smf* seq, SmfTime time, int track, int microSeconds)
 {
   bool result = false;
 
@@ -260,7 +279,7 @@ bool smfInsertTempo(Smf* seq, int time, int track, int microSeconds)
   return result;
 }
 
-bool smfInsertTempoBPM(Smf* seq, int time, int track, double bpm)
+bool smfInsertTempoBPM(Smf* seq, SmfTime time, int track, double bpm)
 {
   double microSeconds = 60000000 / bpm;
 
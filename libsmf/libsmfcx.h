@@ -6,6 +6,7 @@
 #ifndef LIBSMFCX_H
 #define LIBSMFCX_H
 
+#include <stdio.h>
 #include "libsmfc.h"
 
 #define SMF_CONTROL_BANKSELM        0
@@ -47,22 +48,23 @@
 #endif
 
 bool smfWriteFile(Smf* seq, const char* filename);
-bool smfInsertNoteOff(Smf* seq, int time, int channel, int track, int key, int velocity);
-bool smfInsertNoteOn(Smf* seq, int time, int channel, int track, int key, int velocity);
-bool smfInsertNote(Smf* seq, int time, int channel, int track, int key, int velocity, int duration);
-bool smfInsertKeyPress(Smf* seq, int time, int channel, int track, int key, int amount);
-bool smfInsertControl(Smf* seq, int time, int channel, int track, int controlNumber, int value);
-bool smfInsertProgram(Smf* seq, int time, int channel, int track, int programNumber);
-bool smfInsertChanPress(Smf* seq, int time, int channel, int track, int key, int amount);
-bool smfInsertPitchBend(Smf* seq, int time, int channel, int track, int value);
-bool smfInsertSysex(Smf* seq, int time, int port, int track, const byte* data, size_t dataSize);
-bool smfInsertMetaEvent(Smf* seq, int time, int track, int metaType, const byte* data, size_t dataSize);
-bool smfInsertMetaText(Smf* seq, int time, int track, int metaType, const char* text);
+bool smfWriteStream(Smf* seq, FILE* stream);
+bool smfInsertNoteOff(Smf* seq, SmfTime time, int channel, int track, int key, int velocity);
+bool smfInsertNoteOn(Smf* seq, SmfTime time, int channel, int track, int key, int velocity);
+bool smfInsertNote(Smf* seq, SmfTime time, int channel, int track, int key, int velocity, int duration);
+bool smfInsertKeyPress(Smf* seq, SmfTime time, int channel, int track, int key, int amount);
+bool smfInsertControl(Smf* seq, SmfTime time, int channel, int track, int controlNumber, int value);
+bool smfInsertProgram(Smf* seq, SmfTime time, int channel, int track, int programNumber);
+bool smfInsertChanPress(Smf* seq, SmfTime time, int channel, int track, int key, int amount);
+bool smfInsertPitchBend(Smf* seq, SmfTime time, int channel, int track, int value);
+bool smfInsertSysex(Smf* seq, SmfTime time, int port, int track, const byte* data, size_t dataSize);
+bool smfInsertMetaEvent(Smf* seq, SmfTime time, int track, int metaType, const byte* data, size_t dataSize);
+bool smfInsertMetaText(Smf* seq, SmfTime time, int track, int metaType, const char* text);
 
-bool smfInsertGM1SystemOn(Smf* seq, int time, int port, int track);
-bool smfInsertMasterVolume(Smf* seq, int time, int port, int track, int volume);
-bool smfInsertTempo(Smf* seq, int time, int track, int microSeconds);
-bool smfInsertTempoBPM(Smf* seq, int time, int track, double bpm);
+bool smfInsertGM1SystemOn(Smf* seq, SmfTime time, int port, int track);
+bool smfInsertMasterVolume(Smf* seq, SmfTime time, int port, int track, int volume);
+bool smfInsertTempo(Smf* seq, SmfTime time, int track, int microSeconds);
+bool smfInsertTempoBPM(Smf* seq, SmfTime time, int track, double bpm);
 
 #ifdef __cplusplus
 	}
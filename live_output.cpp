@@ -0,0 +1,73 @@
+/*
+This file contains live mode. See live_output.hpp.
+
+In realtime pacing, the first event is written as soon as it is converted, and every later one when its time has come relative to the first. gbsplay runs faster than real time, so the writer waits and gbsplay blocks on the full pipe. If the conversion falls behind, late events are written at once rather than skipped.
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cerrno>
+#include <string>
+#include <thread>
+#include <chrono>
+
+#include "live_output.hpp"
+#include "from_gbsplay.hpp"
+#include "to_midi.hpp"
+
+const uint32_t MASTER_CLOCK = 0x400000; // game boy cycles per second, as in main.cpp
+
+bool live_midi_writer::write(uint64_t midiTime, const uint8_t* data, size_t dataSize){
+	const std::chrono::duration<double> eventSeconds((double)midiTime / midiTicksPerSecond);
+	if (pacing == LIVE_PACING_FAST) {
+		int written = fprintf(outFile, "%.6f", eventSeconds.count());
+		for (size_t i=0; written > 0 && i < dataSize; i++) written = fprintf(outFile, " %02X", data[i]);
+		if (written <= 0 || fputc('\n', outFile) == EOF) {
+			error = errno;
+			return false;
+		}
+		totalBytes += dataSize;
+		return true;
+	}
+	if (started == false) {
+		startTime = std::chrono::steady_clock::now() - std::chrono::duration_cast<std::chrono::steady_clock::duration>(eventSeconds);
+		started = true;
+	}
+	std::this_thread::sleep_until(startTime + std::chrono::duration_cast<std::chrono::steady_clock::duration>(eventSeconds));
+	if (fwrite(data, 1, dataSize, outFile) != dataSize || fflush(outFile) != 0) {
+		error = errno;
+		return false;
+	}
+	totalBytes += dataSize;
+	return true;
+}
+
+bool gbs2liveMidi(const std::string& gbsFileName, int subsongNum, int timeInSeconds, int PPQN, const std::string& outfilename, livePacing pacing, run_metrics* metrics){
+	stage_timer convertTimer;
+	FILE* outFile = (outfilename == "-") ? stdout : fopen(outfilename.c_str(), "wb"); // opening a FIFO waits for its reader
+	if (outFile == nullptr) {
+		fprintf(stderr, "Error: could not open %s.\n", outfilename.c_str());
+		return false;
+	}
+	live_midi_writer writer(outFile, pacing, midiTicksPerSecondFromPPQN(PPQN));
+	bool writeSucceeded = true;
+	live_conversion conversion(MASTER_CLOCK, PPQN, [&](uint64_t midiTime, const uint8_t* data, size_t dataSize){
+		if (writeSucceeded) writeSucceeded = writer.write(midiTime, data, dataSize);
+	});
+	bool played = gbsplayStdout2regWriteSink(gbsFileName, subsongNum, timeInSeconds, [&](const gb_reg_write& regWrite){
+		conversion.addRegWrite(regWrite);
+		return writeSucceeded; // nothing more can be written, so gbsplay doesn't need to play on
+	});
+	if (writeSucceeded) conversion.finish();
+	if (writeSucceeded && fflush(outFile) != 0) writeSucceeded = false;
+	if (outFile != stdout && fclose(outFile) != 0) writeSucceeded = false;
+	if (writer.writeError() == EPIPE) fprintf(stderr, "Error: the reader of %s has gone, so the rest of the song wasn't streamed.\n", outfilename == "-" ? "stdout" : outfilename.c_str());
+	else if (writeSucceeded == false) fprintf(stderr, "Error: could not write to %s.\n", outfilename.c_str());
+
+	if (metrics) {
+		metrics->convertMilliseconds = convertTimer.stop(); // everything happens at once, so this includes gbsplay and the pacing
+		metrics->regWritesProcessed = conversion.regWritesProcessed();
+		metrics->midiBytes = writer.bytesWritten();
+	}
+	return played && writeSucceeded;
+}
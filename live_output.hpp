@@ -0,0 +1,37 @@
+/*
+This file contains live mode (--live), which streams the midi events of a subsong while gbsplay is still playing it, instead of writing a midi file at the end.
+*/
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <chrono>
+
+#include "run_metrics.hpp"
+
+enum livePacing
+{
+	LIVE_PACING_REALTIME, // raw midi bytes, each written when it is due, for a synth reading a FIFO or stdout
+	LIVE_PACING_FAST // one line per event, as fast as possible: the time in seconds, then the event's bytes in hex
+};
+
+// writes the events that live_conversion makes to a stream
+class live_midi_writer {
+public:
+	live_midi_writer(FILE* inOutFile, livePacing inPacing, uint64_t inMidiTicksPerSecond) : outFile(inOutFile), pacing(inPacing), midiTicksPerSecond(inMidiTicksPerSecond) {}
+	bool write(uint64_t midiTime, const uint8_t* data, size_t dataSize); // returns false once the stream can't be written to, e.g. when the reader of a FIFO has gone
+	size_t bytesWritten() const { return totalBytes; }
+	int writeError() const { return error; } // the errno of the failed write, e.g. EPIPE when the reader has gone. 0 if none failed.
+private:
+	FILE* outFile;
+	livePacing pacing;
+	uint64_t midiTicksPerSecond;
+	bool started = false;
+	std::chrono::steady_clock::time_point startTime; // when midi time 0 was (or would have been) played
+	size_t totalBytes = 0;
+	int error = 0;
+};
+
+// Plays a subsong with gbsplay and streams its events to outfilename ("-" for stdout, or a FIFO) as they are converted. If the stream can't be written to anymore, e.g. because its reader has gone, gbsplay is stopped and false is returned. SIGPIPE has to be ignored for that, or the first write after the reader has gone ends the process.
+bool gbs2liveMidi(const std::string& gbsFileName, int subsongNum, int timeInSeconds, int PPQN, const std::string& outfilename, livePacing pacing, run_metrics* metrics = nullptr);
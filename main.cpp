@@ -1,11 +1,28 @@
 #include <cstdint>
 #include <string>
 #include <cstdio>
+#include <cstring>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 #include <unistd.h> // access
+#include <csignal>
 
 #include "from_gbsplay.hpp"
 #include "to_midi.hpp"
 #include "gb_reg_write.h"
+#include "run_metrics.hpp"
+#include "reg_write_filter.hpp"
+#include "gbce_file.hpp"
+#include "output_variant.hpp"
+#include "daemon.hpp"
+#include "live_output.hpp"
+#include "ppqn_analysis.hpp"
+#include "ump_clip.hpp"
 
 const uint32_t MASTER_CLOCK = 0x400000; // game boy cycles per second. 4194304
 
@@ -16,11 +33,148 @@ enum errorCode
 	INPUT_NOT_FOUND,
 	INVALID_OUTPUT_TYPE,
 	INVALID_INPUT_TYPE,
-	NO_GBSPLAY
+	NO_GBSPLAY,
+	OUTPUT_WRITE_FAILED,
+	GBSPLAY_FAILED // gbsplay couldn't be started, or didn't exit normally
 };
 
 void displayHelp(){
 	printf("How to use: \n./gbs2midi file.gbs subsongNumber outfile.mid [Midi_ticks_per_quarter_note] [timeInSeconds] \n");
+	printf("subsongNumber can be a range such as 1-12. gbsplay then plays them all in one run, each for timeInSeconds, and they are written to outfile-1.mid to outfile-12.mid, each converted while the next one plays.\n");
+	printf("file.gbs can also be a register stream saved with gbsplay -o iodumper, named .iodump. subsongNumber is then ignored.\n");
+	printf("file.gbs can also be a .gbce file saved with --save-events. Its register writes are converted again without running gbsplay; subsongNumber and timeInSeconds are ignored.\n");
+	printf("Midi_ticks_per_quarter_note can be auto, to use the smallest one that keeps the notes of a .gbs file in order (smaller files that load faster), or auto:MS to also keep every event within MS milliseconds of its real time.\n");
+	printf("outfile.mid can also be outfile.midi2 to write a MIDI 2.0 Clip File instead. It has the same notes, but each note's pitch is sent as a per-note pitch, so slides and vibrato need far fewer events.\n");
+	printf("Use - as outfile.mid to write the midi file to stdout (e.g. to pipe it into another program). Status messages are always printed to stderr.\n");
+	printf("Options (can be placed anywhere):\n");
+	printf("  --verbose          print progress and timing messages.\n");
+	printf("  --metrics          print a JSON record with per-stage timings and event counts to stderr when done.\n");
+	printf("  --metrics=file     append the JSON record as one line to file instead.\n");
+	printf("  --no-filter        convert every register write, including the ones that can't change the midi file (e.g. rewrites of the same envelope every frame).\n");
+	printf("  --save-events=file.gbce  also save the song's register writes, so it can be converted again at another PPQN or BPM without running gbsplay.\n");
+	printf("  --daemon=socket    instead of converting one file, listen for conversion jobs on a Unix domain socket until interrupted. See daemon.hpp for the protocol and gbs2midi-client for a client.\n");
+	printf("  --workers=N        the number of jobs the daemon converts at once (default: one per hardware thread).\n");
+	printf("  --max-jobs=N       the number of jobs the daemon queues or converts before it refuses new ones as busy (default: 4 per worker).\n");
+	printf("  --bpm=N            write the midi file at N BPM instead of 120. A tempo event is added, so the song still plays at the same speed, but notes line up with a different beat grid.\n");
+	printf("  --threads=N        convert long songs on N threads (0: one per hardware thread), each from a checkpoint of the converter's state. The midi file is the same as with 1, the default. With a subsong range, N subsongs are converted at once instead (0 or 1: one per hardware thread).\n");
+	printf("  --also=FILE.mid[:PPQN][:bpm=N][:no-pitch-bend][:channels=DIGITS]  also write another version of the song from the same gbsplay run, converted at its own settings, e.g. at another PPQN, without pitch bends, or with only some channels (1 to 4, e.g. channels=3 for the wave channel). Can be given more than once. FILE.midi2 writes a MIDI 2.0 Clip File.\n");
+	printf("  --channels=DIGITS  only convert these channels (1 and 2 are the squares, 3 the wave, 4 the noise), e.g. --channels=3. The others' register writes are skipped and their tracks are left out.\n");
+	printf("  --start=SECONDS    only convert the song from SECONDS on. The state of the channels at that point (CCs, panning, wave table, playing notes) is written at the start of the midi file.\n");
+	printf("  --end=SECONDS      only convert the song up to SECONDS. gbsplay then only plays that far, unless timeInSeconds is given.\n");
+	printf("  --dry-run          run the conversion without making the midi file, and print what it would contain as JSON to stdout instead: the notes per channel, the pitch bends per second, the wave tables, signs of sample playback and the projected file size. outfile.mid isn't written, so - will do. Works with subsong ranges, to go through a whole .gbs file quickly.\n");
+	printf("  --live=realtime    instead of a midi file, stream the midi events to outfile (- for stdout, or a FIFO) while gbsplay plays the .gbs file, each at the moment it is due.\n");
+	printf("  --live=fast        the same, but as fast as possible, one line per event: its time in seconds, then its bytes in hex.\n");
+}
+
+// what is done with each subsong's register writes
+struct conversion_options {
+	int PPQN = 0x7fff;
+	bool autoPPQN = false;
+	double maxTimingErrorMilliseconds = 0;
+	bool filterRegWrites = true;
+	double BPM = DEFAULT_MIDI_BPM;
+	std::string saveEventsFilename; // empty: don't save the register writes to a .gbce file
+	unsigned int threadCount = 1; // for songData2midi
+	double startSeconds = 0; // with endSeconds: only convert this part of the song, see songData2smfWindow
+	double endSeconds = 0; // 0: the end of the song
+	std::vector<output_variant> variants;
+	uint32_t channelMask = 0xF; // bit n is GB channel n. The other channels' writes are dropped by the filter, and their tracks are left out.
+	bool dryRun = false; // only count what the conversion would make, see songData2stats
+};
+
+// "13" -> square 1 and wave. Returns false if the list is empty or has anything but the digits 1 to 4.
+bool parseChannelList(const std::string& channelList, uint32_t& trackMask){
+	trackMask = 0;
+	for (char c : channelList) {
+		if (c < '1' || c > '4') return false;
+		trackMask |= 1 << (c - '1');
+	}
+	return trackMask != 0;
+}
+
+// FILE.mid or FILE.midi2, then [:PPQN][:bpm=N][:no-pitch-bend][:channels=DIGITS]
+bool parseOutputVariant(const std::string& spec, output_variant& variant){
+	size_t fieldStart = 0;
+	bool firstField = true;
+	while (fieldStart <= spec.size()) {
+		size_t fieldEnd = spec.find(':', fieldStart);
+		if (fieldEnd == std::string::npos) fieldEnd = spec.size();
+		const std::string field = spec.substr(fieldStart, fieldEnd - fieldStart);
+		if (firstField) {
+			if ((field.length() < 4 || field.substr(field.length()-4, 4) != ".mid") && isUmpClipFilename(field) == false) return false;
+			variant.outfilename = field;
+			firstField = false;
+		} else if (field == "no-pitch-bend") {
+			variant.pitchBends = false;
+		} else if (field.rfind("channels=", 0) == 0) {
+			if (parseChannelList(field.substr(strlen("channels=")), variant.trackMask) == false) return false;
+		} else if (field.rfind("bpm=", 0) == 0) {
+			variant.BPM = atof(field.c_str() + strlen("bpm="));
+			if (variant.BPM <= 0) return false;
+		} else {
+			variant.PPQN = atoi(field.c_str());
+			if (variant.PPQN < 1 || variant.PPQN > 0x7fff) return false;
+		}
+		fieldStart = fieldEnd + 1;
+	}
+	return true;
+}
+
+// converts each variant from the unfiltered register writes. Returns an errorCode.
+int songData2variants(const std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, const conversion_options& options, int mainPPQN){
+	for (const output_variant& variant : options.variants) {
+		if (songData2variantFile(songData, gbTimeUnitsPerSecond, variant, mainPPQN, options.filterRegWrites, options.threadCount) == false)
+			return OUTPUT_WRITE_FAILED;
+		if (verboseOutput) fprintf(stderr, "Wrote %s.\n", variant.outfilename.c_str());
+	}
+	return NOERROR;
+}
+
+// filters songData, converts it and writes the midi file (and the .gbce file if asked for). Returns an errorCode.
+int songData2output(std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, const conversion_options& options, const std::string& outfilename, run_metrics& metrics){
+	if (options.saveEventsFilename.empty() == false && saveGbceFile(songData, gbTimeUnitsPerSecond, options.saveEventsFilename) == false) // before the filter, which only keeps the writes that matter at this PPQN
+		return OUTPUT_WRITE_FAILED;
+	int PPQN = options.PPQN;
+	if (options.autoPPQN) {
+		PPQN = chooseMinimalPPQN(songData, gbTimeUnitsPerSecond, options.maxTimingErrorMilliseconds);
+		if (options.BPM < DEFAULT_MIDI_BPM) PPQN = std::min(0x7fff, (int)ceil(PPQN * DEFAULT_MIDI_BPM / options.BPM)); // the analysis is done in 120 BPM ticks. Keep ticks at least as short.
+		if (verboseOutput) fprintf(stderr, "Using %d PPQN for %s.\n", PPQN, outfilename.c_str());
+	}
+	metrics.PPQN = PPQN;
+	std::vector<gb_reg_write> unfilteredSongData; // the variants are filtered at their own PPQN and BPM
+	if (options.variants.empty() == false) unfilteredSongData = songData;
+	const bool timeWindow = options.startSeconds > 0 || options.endSeconds > 0;
+	if (timeWindow && options.endSeconds > 0) { // the writes after the window aren't needed, except the ones on its last tick
+		const uint64_t lastGbTime = llround(options.endSeconds * gbTimeUnitsPerSecond) + gbTimeUnitsPerSecond / midiTicksPerSecondFromPPQN(PPQN) + 1;
+		songData.erase(std::upper_bound(songData.begin(), songData.end(), lastGbTime, [](uint64_t gbTime, const gb_reg_write& regWrite){ return gbTime < regWrite.time; }), songData.end());
+	}
+	if (options.filterRegWrites) filterRedundantRegWrites(songData, gbTimeUnitsPerSecond, PPQN, &metrics, options.channelMask, options.BPM);
+	if (options.dryRun) {
+		stage_timer convertTimer;
+		songData2stats(songData, gbTimeUnitsPerSecond, PPQN, metrics);
+		metrics.convertMilliseconds = convertTimer.stop();
+		return NOERROR;
+	}
+	if (timeWindow) {
+		stage_timer convertTimer;
+		const uint64_t endGbTime = options.endSeconds > 0 ? llround(options.endSeconds * gbTimeUnitsPerSecond) : UINT64_MAX;
+		Smf* midiFile = songData2smfWindow(songData, gbTimeUnitsPerSecond, PPQN, llround(options.startSeconds * gbTimeUnitsPerSecond), endGbTime, &metrics);
+		smfKeepTracks(midiFile, options.channelMask);
+		metrics.convertMilliseconds = convertTimer.stop();
+		bool writeSucceeded = smf2midiFile(midiFile, outfilename, &metrics);
+		smfDelete(midiFile);
+		return writeSucceeded ? NOERROR : OUTPUT_WRITE_FAILED;
+	}
+	if (songData2midi(songData, gbTimeUnitsPerSecond, outfilename, PPQN, &metrics, options.threadCount, options.channelMask, options.BPM) == false)
+		return OUTPUT_WRITE_FAILED;
+	return songData2variants(unfilteredSongData, gbTimeUnitsPerSecond, options, PPQN);
+}
+
+// song.mid -> song-3.mid
+std::string subsongFilename(const std::string& filename, int subsongNum){
+	size_t extensionStart = filename.rfind('.');
+	if (extensionStart == std::string::npos || extensionStart < filename.find_last_of("/\\") + 1) extensionStart = filename.length();
+	return filename.substr(0, extensionStart) + "-" + std::to_string(subsongNum) + filename.substr(extensionStart);
 }
 
 bool exists(const std::string& name) { // https://stackoverflow.com/questions/12774207/fastest-way-to-check-if-a-file-exists-using-standard-c-c11-14-17-c
@@ -29,31 +183,154 @@ bool exists(const std::string& name) { // https://stackoverflow.com/questions/12
 
 int main(int argc, char *const argv[]){
 	
+stage_timer totalTimer;
+bool emitMetrics = false;
+std::string metricsFilename; // empty means stderr, or stdout for --dry-run
+bool filterRegWrites = true;
+std::string saveEventsFilename;
+double BPM = DEFAULT_MIDI_BPM;
+bool runAsDaemon = false;
+daemon_options daemonOptions;
+bool liveOutput = false;
+livePacing pacing = LIVE_PACING_REALTIME;
+unsigned int threadCount = 1;
+double startSeconds = 0;
+double endSeconds = 0;
+std::vector<output_variant> variants;
+uint32_t channelMask = 0xF;
+bool dryRun = false;
+std::vector<std::string> args; // positional arguments, including the program name
+for (int i=0; i<argc; i++) {
+	std::string arg = argv[i];
+	if (arg == "--verbose") {
+		verboseOutput = true;
+	} else if (arg == "--metrics") {
+		emitMetrics = true;
+	} else if (arg.rfind("--metrics=", 0) == 0) {
+		emitMetrics = true;
+		metricsFilename = arg.substr(strlen("--metrics="));
+	} else if (arg == "--no-filter") {
+		filterRegWrites = false;
+	} else if (arg.rfind("--save-events=", 0) == 0) {
+		saveEventsFilename = arg.substr(strlen("--save-events="));
+	} else if (arg.rfind("--daemon=", 0) == 0) {
+		runAsDaemon = true;
+		daemonOptions.socketPath = arg.substr(strlen("--daemon="));
+	} else if (arg.rfind("--workers=", 0) == 0) {
+		daemonOptions.workerCount = atoi(arg.c_str() + strlen("--workers="));
+	} else if (arg.rfind("--max-jobs=", 0) == 0) {
+		daemonOptions.maxJobsInFlight = atoi(arg.c_str() + strlen("--max-jobs="));
+	} else if (arg.rfind("--bpm=", 0) == 0) {
+		BPM = atof(arg.c_str() + strlen("--bpm="));
+		if (BPM <= 0) {
+			fprintf(stderr, "Warning: --bpm was set to a value that isn't above 0. Using 120 BPM...\n");
+			BPM = DEFAULT_MIDI_BPM;
+		}
+	} else if (arg.rfind("--threads=", 0) == 0) {
+		threadCount = atoi(arg.c_str() + strlen("--threads="));
+	} else if (arg.rfind("--also=", 0) == 0) {
+		output_variant variant;
+		if (parseOutputVariant(arg.substr(strlen("--also=")), variant) == false) {
+			fprintf(stderr, "Error: %s is not a valid variant. It needs a .mid or .midi2 file name, and optionally a PPQN from 1 to 32767, bpm=N, no-pitch-bend and channels= with the digits 1 to 4, separated by colons.\n", arg.c_str());
+			return INVALID_OUTPUT_TYPE;
+		}
+		variants.push_back(variant);
+	} else if (arg.rfind("--channels=", 0) == 0) {
+		if (parseChannelList(arg.substr(strlen("--channels=")), channelMask) == false) {
+			fprintf(stderr, "Error: --channels needs the numbers of the channels to convert, e.g. --channels=34 for the wave and noise channels.\n");
+			return INVALID_OUTPUT_TYPE;
+		}
+	} else if (arg.rfind("--start=", 0) == 0) {
+		startSeconds = atof(arg.c_str() + strlen("--start="));
+	} else if (arg.rfind("--end=", 0) == 0) {
+		endSeconds = atof(arg.c_str() + strlen("--end="));
+	} else if (arg == "--dry-run") {
+		dryRun = true;
+	} else if (arg == "--live=realtime" || arg == "--live=fast") {
+		liveOutput = true;
+		pacing = (arg == "--live=fast") ? LIVE_PACING_FAST : LIVE_PACING_REALTIME;
+	} else if (arg.rfind("--", 0) == 0) {
+		fprintf(stderr, "Error: unknown option %s.\n", arg.c_str());
+		displayHelp();
+		return NOT_ENOUGH_ARGS;
+	} else {
+		args.push_back(arg);
+	}
+}
+argc = args.size();
+if (runAsDaemon) return runDaemon(daemonOptions);
+#ifndef WIN32
+signal(SIGPIPE, SIG_IGN); // a reader that goes away early (stdout piped into head, a FIFO) must give a write error instead of ending gbs2midi
+#endif
+
 if (argc<4) {
 	displayHelp();
 	return NOT_ENOUGH_ARGS;
 }
-std::string inFilename = std::string(argv[1]);
+std::string inFilename = args[1];
 if (exists(inFilename) == false) {
 	fprintf(stderr, "Error: Input filename does not exist.\n");
 	return INPUT_NOT_FOUND;
 }
-int subsongNumber = atoi(argv[2]);
+int subsongNumber = atoi(args[2].c_str());
+int lastSubsongNumber = subsongNumber;
+size_t rangeDash = args[2].find('-', 1);
+if (rangeDash != std::string::npos) lastSubsongNumber = atoi(args[2].c_str() + rangeDash + 1);
 if (subsongNumber < 1) {
 	fprintf(stderr, "Warning: Subsong Number was set to a number less than 1. Forcing subsong number to 1...\n");
 	subsongNumber=1;
 }
-std::string outfilename = std::string(argv[3]);
-if (outfilename.substr(outfilename.length()-4, 4) != ".mid") {
-	fprintf(stderr, "Error: The only valid output file extension is .mid (in all lowercase).\n");
+if (lastSubsongNumber < subsongNumber) {
+	fprintf(stderr, "Warning: the subsong range ends before it starts. Converting subsong %d only...\n", subsongNumber);
+	lastSubsongNumber = subsongNumber;
+}
+const bool subsongRange = lastSubsongNumber > subsongNumber;
+std::string outfilename = args[3];
+if (liveOutput == false && dryRun == false && outfilename != "-" && (outfilename.length() < 4 || outfilename.substr(outfilename.length()-4, 4) != ".mid") && isUmpClipFilename(outfilename) == false) {
+	fprintf(stderr, "Error: The only valid output file extensions are .mid and .midi2 (in all lowercase).\n");
+	return INVALID_OUTPUT_TYPE;
+}
+if (subsongRange && outfilename == "-" && dryRun == false) {
+	fprintf(stderr, "Error: a subsong range writes one midi file per subsong, so it can't be written to stdout.\n");
 	return INVALID_OUTPUT_TYPE;
 }
-int PPQN = argc >= 5 ? atoi(argv[4]) : 0x7fff;
+if (startSeconds < 0 || endSeconds < 0 || (endSeconds > 0 && endSeconds <= startSeconds)) {
+	fprintf(stderr, "Error: --end must come after --start, and neither can be negative.\n");
+	return NOT_ENOUGH_ARGS;
+}
+const bool timeWindow = startSeconds > 0 || endSeconds > 0;
+if (timeWindow && (liveOutput || BPM != DEFAULT_MIDI_BPM || variants.empty() == false)) {
+	fprintf(stderr, "Error: --start and --end can't be used with %s.\n", liveOutput ? "--live" : (BPM != DEFAULT_MIDI_BPM ? "--bpm" : "--also"));
+	return INVALID_INPUT_TYPE;
+}
+if (liveOutput && (variants.empty() == false || channelMask != 0xF)) {
+	fprintf(stderr, "Error: %s can't be used with --live.\n", variants.empty() ? "--channels" : "--also");
+	return INVALID_INPUT_TYPE;
+}
+if (dryRun && (liveOutput || timeWindow || saveEventsFilename.empty() == false || BPM != DEFAULT_MIDI_BPM || variants.empty() == false || channelMask != 0xF)) {
+	fprintf(stderr, "Error: --dry-run only counts what the whole song's conversion would make, so it can't be used with %s.\n", liveOutput ? "--live" : (timeWindow ? "--start and --end" : (saveEventsFilename.empty() == false ? "--save-events" : (BPM != DEFAULT_MIDI_BPM ? "--bpm" : (variants.empty() ? "--channels" : "--also")))));
+	return INVALID_INPUT_TYPE;
+}
+if (dryRun) emitMetrics = true; // the metrics record is the result
+for (output_variant& variant : variants) variant.trackMask &= channelMask;
+conversion_options options;
+options.filterRegWrites = filterRegWrites;
+options.BPM = BPM;
+options.saveEventsFilename = saveEventsFilename;
+options.threadCount = threadCount;
+options.startSeconds = startSeconds;
+options.endSeconds = endSeconds;
+options.variants = variants;
+options.channelMask = channelMask;
+options.dryRun = dryRun;
+options.autoPPQN = argc >= 5 && parseAutoPPQN(args[4], options.maxTimingErrorMilliseconds);
+int PPQN = (argc >= 5 && options.autoPPQN == false) ? atoi(args[4].c_str()) : 0x7fff;
 if (PPQN < 1) {
 	fprintf(stderr, "Warning: Midi_ticks_per_quarter_note was set to a value less than 1. Forcing to 0x7fff...\n");
 	PPQN=0x7fff;
 }
-int timeInSeconds = argc >= 6 ? atoi(argv[5]) : 150;
+options.PPQN = PPQN;
+int timeInSeconds = argc >= 6 ? atoi(args[5].c_str()) : (endSeconds > 0 ? (int)ceil(endSeconds) + 1 : 150); // gbsplay only has to play as far as the window goes
 if (timeInSeconds < 1) {
 	fprintf(stderr, "Warning: Time was set to a value less than 1 second. Forcing time to 150 seconds...\n");
 	timeInSeconds=150;
@@ -64,8 +341,32 @@ if (timeInSeconds < 1) {
 // songData is a list of register writes pulled directly from gbsplay (or other source like vgm file)
 std::vector<gb_reg_write> songData;
 
-unsigned int gbTimeUnitsPerSecond;
-if (inFilename.substr(inFilename.length()-4, 4) == ".gbs" || inFilename.substr(inFilename.length()-4, 4) == ".GBS") {
+run_metrics metrics;
+metrics.inFilename = inFilename;
+metrics.outfilename = outfilename;
+metrics.subsongNumber = subsongNumber;
+metrics.PPQN = PPQN;
+std::vector<run_metrics> subsongMetrics; // one record per subsong of a range, instead of metrics
+
+int result = NOERROR;
+if (inFilename.length() >= 5 && inFilename.substr(inFilename.length()-5, 5) == ".gbce") {
+	if (liveOutput || subsongRange) {
+		fprintf(stderr, "Error: %s needs a .gbs file.\n", liveOutput ? "--live" : "a subsong range");
+		return INVALID_INPUT_TYPE;
+	}
+	stage_timer parseTimer;
+	unsigned int gbTimeUnitsPerSecond;
+	if (loadGbceFile(songData, gbTimeUnitsPerSecond, inFilename) == false) return INVALID_INPUT_TYPE;
+	metrics.parseMilliseconds = parseTimer.stop();
+	result = songData2output(songData, gbTimeUnitsPerSecond, options, outfilename, metrics);
+} else if (inFilename.length() >= 7 && inFilename.substr(inFilename.length()-7, 7) == ".iodump") {
+	if (liveOutput || subsongRange) {
+		fprintf(stderr, "Error: %s needs a .gbs file.\n", liveOutput ? "--live" : "a subsong range");
+		return INVALID_INPUT_TYPE;
+	}
+	if (iodumpFile2songData(inFilename, songData, &metrics) == false) return INVALID_INPUT_TYPE;
+	result = songData2output(songData, MASTER_CLOCK, options, outfilename, metrics);
+} else if (inFilename.substr(inFilename.length()-4, 4) == ".gbs" || inFilename.substr(inFilename.length()-4, 4) == ".GBS") {
 #ifdef WIN32
 	if (exists("gbsplay.exe") == false)
 #else
@@ -75,16 +376,97 @@ if (inFilename.substr(inFilename.length()-4, 4) == ".gbs" || inFilename.substr(i
 		fprintf(stderr, "Error: gbsplay executable does not exist in this directory.\n");
 		return NO_GBSPLAY;
 	}
-	gbsplayStdout2songData(songData, inFilename, subsongNumber, timeInSeconds);
-	gbTimeUnitsPerSecond = MASTER_CLOCK; // TODO: implement vgm2songData conversion. For this variable to the left, use 0x400000 for gbsplay and 44100 for vgm.
-	//printf("gbTimeUnitsPerSecond: %u\n", gbTimeUnitsPerSecond); // redundant
+	if (liveOutput && (options.autoPPQN || subsongRange)) {
+		fprintf(stderr, "Error: %s needs the whole song, so it can't be used with --live.\n", subsongRange ? "a subsong range" : "auto PPQN");
+		return INVALID_INPUT_TYPE;
+	}
+	const unsigned int gbTimeUnitsPerSecond = MASTER_CLOCK; // TODO: implement vgm2songData conversion. For this variable to the left, use 0x400000 for gbsplay and 44100 for vgm.
+	if (liveOutput) { // the filter, --save-events and --bpm need the whole song, so they don't apply
+		if (gbs2liveMidi(inFilename, subsongNumber, timeInSeconds, PPQN, outfilename, pacing, &metrics) == false) result = OUTPUT_WRITE_FAILED;
+	} else if (subsongRange) {
+		// each subsong is queued for the workers as soon as gbsplay has finished it, while gbsplay plays the next one
+		const size_t subsongCount = lastSubsongNumber - subsongNumber + 1;
+		subsongMetrics.resize(subsongCount);
+		std::vector<int> subsongResults(subsongCount, OUTPUT_WRITE_FAILED); // stays OUTPUT_WRITE_FAILED for subsongs gbsplay didn't play
+		struct pending_subsong {
+			int subsongNum;
+			std::vector<gb_reg_write> songData;
+		};
+		std::mutex queueMutex;
+		std::condition_variable queueCondition;
+		std::deque<pending_subsong> queue;
+		bool playingFinished = false;
+		auto workerLoop = [&]{
+			while (true) {
+				pending_subsong subsong;
+				{
+					std::unique_lock<std::mutex> lock(queueMutex);
+					queueCondition.wait(lock, [&]{ return playingFinished || queue.empty() == false; });
+					if (queue.empty()) return; // gbsplay has finished, and every subsong is converted
+					subsong = std::move(queue.front());
+					queue.pop_front();
+				}
+				const size_t subsongIndex = subsong.subsongNum - subsongNumber;
+				run_metrics& curMetrics = subsongMetrics[subsongIndex];
+				conversion_options subsongOptions = options;
+				subsongOptions.threadCount = 1; // the workers already use the cores
+				if (options.saveEventsFilename.empty() == false) subsongOptions.saveEventsFilename = subsongFilename(options.saveEventsFilename, subsong.subsongNum);
+				for (output_variant& variant : subsongOptions.variants) variant.outfilename = subsongFilename(variant.outfilename, subsong.subsongNum);
+				subsongResults[subsongIndex] = songData2output(subsong.songData, gbTimeUnitsPerSecond, subsongOptions, curMetrics.outfilename, curMetrics);
+				curMetrics.totalMilliseconds = totalTimer.stop(); // since gbs2midi started, so the last subsong's total is the whole run
+			}
+		};
+		const unsigned int workerCount = std::min<size_t>(threadCount > 1 ? threadCount : std::max(1u, std::thread::hardware_concurrency()), subsongCount);
+		std::vector<std::thread> workers;
+		for (unsigned int i=0; i < workerCount; i++) workers.emplace_back(workerLoop);
+		bool played = gbsplayStdout2subsongs(inFilename, subsongNumber, lastSubsongNumber, timeInSeconds, [&](int subsongNum, std::vector<gb_reg_write>& subsongData, const run_metrics& parseMetrics){
+			run_metrics& curMetrics = subsongMetrics[subsongNum - subsongNumber];
+			curMetrics = parseMetrics;
+			curMetrics.inFilename = inFilename;
+			curMetrics.outfilename = subsongFilename(outfilename, subsongNum);
+			std::lock_guard<std::mutex> lock(queueMutex);
+			queue.push_back({subsongNum, std::move(subsongData)});
+			queueCondition.notify_one();
+		});
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			playingFinished = true;
+		}
+		queueCondition.notify_all();
+		for (std::thread& worker : workers) worker.join();
+		for (size_t i=0; i<subsongCount; i++) {
+			if (subsongResults[i] == NOERROR) continue;
+			if (played && subsongMetrics[i].subsongNumber == 0) fprintf(stderr, "Warning: gbsplay didn't play subsong %zu.\n", subsongNumber + i);
+			if (result == NOERROR) result = subsongResults[i];
+		}
+		if (played == false) result = GBSPLAY_FAILED;
+		if (verboseOutput) fprintf(stderr, "Converted subsongs %d to %d in %.0f milliseconds.\n", subsongNumber, lastSubsongNumber, totalTimer.stop());
+	} else {
+		if (gbsplayStdout2songData(songData, inFilename, subsongNumber, timeInSeconds, &metrics) == false) return GBSPLAY_FAILED;
+		result = songData2output(songData, gbTimeUnitsPerSecond, options, outfilename, metrics);
+	}
 } else {
-	fprintf(stderr, "Error: Currently, the only valid input file extension is .gbs (in all lowercase, or in all uppercase).\n");
+	fprintf(stderr, "Error: Currently, the only valid input file extensions are .gbs (in all lowercase, or in all uppercase), .iodump and .gbce.\n");
 	if(inFilename.substr(inFilename.length()-4, 4) == ".vgm" || inFilename.substr(inFilename.length()-4, 4) == ".VGM") 
 		fprintf(stderr, "VGM support has not been added. If you would like me to add VGM support, please open an issue on the gbs2midi GitHub repository.\n");
 	return INVALID_INPUT_TYPE;
 }
-songData2midi(songData, gbTimeUnitsPerSecond, outfilename, PPQN);
 
-return NOERROR;
-}
\ No newline at end of file
+if (emitMetrics) {
+	if (subsongRange == false) {
+		metrics.totalMilliseconds = totalTimer.stop();
+		subsongMetrics.push_back(metrics);
+	}
+	FILE* metricsFile = metricsFilename.empty() ? (dryRun ? stdout : stderr) : fopen(metricsFilename.c_str(), "a");
+	if (metricsFile) {
+		for (const run_metrics& curMetrics : subsongMetrics) {
+			if (curMetrics.subsongNumber == 0) continue; // not played
+			fprintf(metricsFile, "%s\n", runMetrics2json(curMetrics).c_str());
+		}
+		if (metricsFile != stderr && metricsFile != stdout) fclose(metricsFile);
+	} else {
+		fprintf(stderr, "Warning: could not open %s to write metrics.\n", metricsFilename.c_str());
+	}
+}
+return result;
+}
@@ -0,0 +1,28 @@
+/*
+This file contains the code that converts the variants of --also.
+Each variant is converted from the unfiltered register writes at its own PPQN and BPM, rather than re-timed from the main output's events, because the converter's decisions (which writes on a tick make one note change, when a sound length ends a note) depend on the ticks. A variant is then the same as converting the song directly with its settings.
+*/
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "output_variant.hpp"
+#include "reg_write_filter.hpp"
+
+Smf* songData2variantSmf(const std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, const output_variant& variant, int mainPPQN, bool filterRegWrites, unsigned int threadCount){
+	const int PPQN = variant.PPQN ? variant.PPQN : mainPPQN;
+	std::vector<gb_reg_write> variantSongData = songData;
+	if (filterRegWrites) filterRedundantRegWrites(variantSongData, gbTimeUnitsPerSecond, PPQN, nullptr, variant.trackMask, variant.BPM);
+	Smf* midiFile = threadCount == 1 ? songData2smf(variantSongData, gbTimeUnitsPerSecond, PPQN, nullptr, variant.BPM) : songData2smfParallel(variantSongData, gbTimeUnitsPerSecond, PPQN, nullptr, threadCount, variant.BPM);
+	if (variant.pitchBends == false) smfDropPitchBends(midiFile);
+	smfKeepTracks(midiFile, variant.trackMask);
+	return midiFile;
+}
+
+bool songData2variantFile(const std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, const output_variant& variant, int mainPPQN, bool filterRegWrites, unsigned int threadCount){
+	Smf* midiFile = songData2variantSmf(songData, gbTimeUnitsPerSecond, variant, mainPPQN, filterRegWrites, threadCount);
+	bool writeSucceeded = smf2midiFile(midiFile, variant.outfilename);
+	smfDelete(midiFile);
+	return writeSucceeded;
+}
@@ -0,0 +1,24 @@
+/*
+This file contains the definition of output_variant, another midi file made from the same register writes as the main output (see --also), and the function that converts one.
+*/
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "gb_reg_write.h"
+#include "libsmfc.h"
+#include "to_midi.hpp"
+
+struct output_variant {
+	std::string outfilename;
+	int PPQN = 0; // 0: the same as the main output
+	double BPM = DEFAULT_MIDI_BPM;
+	bool pitchBends = true; // false: no pitch bend events, so every note plays at its midi note's pitch
+	uint32_t trackMask = 0xF; // bit n keeps track n, i.e. GB channel n. The tracks that are left out aren't written at all, and the events keep their midi channel.
+};
+
+// Converts songData at the variant's PPQN and BPM, the same way as the main output would be at those, then leaves out the events and tracks the variant doesn't keep. songData must not have been filtered, as filterRedundantRegWrites only keeps the writes that matter at one PPQN and BPM; a filtered copy is made when filterRegWrites is true. The caller owns the returned Smf and frees it with smfDelete.
+Smf* songData2variantSmf(const std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, const output_variant& variant, int mainPPQN, bool filterRegWrites = true, unsigned int threadCount = 1);
+bool songData2variantFile(const std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, const output_variant& variant, int mainPPQN, bool filterRegWrites = true, unsigned int threadCount = 1);
@@ -0,0 +1,180 @@
+/*
+This file contains the analysis behind "auto" as Midi_ticks_per_quarter_note.
+
+A low PPQN puts writes that were on separate ticks at 32767 PPQN on the same tick, where the same-tick lookahead in insertNoteIntoMidi treats them as one note change, and libsmfc moves note offs in front of note ons. That is wanted for the writes a driver makes in one update (e.g. NRx3 then NRx4 a few cycles apart), but not for two updates.
+A driver writes each pitch register at most once per update, so two writes to the same NRx3 or NRx4 belong to different updates. Those pairs are the ordering-relevant ones:
+1. Every NRx3/NRx4 write that changes the register, or triggers, is paired with the previous such write to the same register. Rewrites of the same value without a trigger don't do anything, so they don't count.
+2. Each pair that is on separate ticks at 32767 PPQN has to stay on separate ticks.
+3. Writes to other registers that change how a note sounds mustn't land on the tick of a trigger from another update either, or they would apply to that note from its start (or, before it, stop applying to the note it ends):
+   the volume and envelope (NR12, NR22, NR32, NR42), the channel's panning bits in NR51, and for the wave channel the DAC (NR30) and wave RAM, which select the wave table.
+   Each trigger is paired with the last such write to its channel before it, and with the first one after it. Later ones are on the same tick or later, so they stay apart too.
+   Unlike the writes to one pitch register, these are often in the same update as the trigger and a few cycles from it. Writes closer together than half of the shortest time between two writes to one pitch register are taken as one update, and aren't paired.
+4. If any note is triggered with sound length enabled, a sound length step has to be at least one tick. Otherwise every such note would end at the write after it started.
+The smallest PPQN that meets these (and the timing error bound) is found by bisection, checking every pair at each candidate.
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <array>
+#include <utility>
+
+#include "ppqn_analysis.hpp"
+#include "to_midi.hpp"
+#include "run_metrics.hpp"
+
+static const int MAX_PPQN = 0x7fff;
+
+static bool isPitchRegister(uint8_t address){ // NRx3 and NRx4 of every channel, NR43 and NR44 for noise
+	switch (address) {
+		case 0x13: case 0x14: case 0x18: case 0x19: case 0x1D: case 0x1E: case 0x22: case 0x23: return true;
+		default: return false;
+	}
+}
+static bool isTrigger(const gb_reg_write& regWrite){
+	return (regWrite.address == 0x14 || regWrite.address == 0x19 || regWrite.address == 0x1E || regWrite.address == 0x23) && (regWrite.value & 0x80);
+}
+static int triggerChannel(uint8_t address){ // NRx4 -> x-1
+	return (address - 0x14) / 5;
+}
+// the channels whose sound a write changes, as a bit mask, for the registers of rule 3. prevValue is -1 if the register hasn't been written yet.
+static uint8_t soundChannelsChanged(uint8_t address, uint8_t value, int16_t prevValue){
+	if (prevValue == value) return 0;
+	switch (address) {
+		case 0x12: return 1 << 0;
+		case 0x17: return 1 << 1;
+		case 0x1A: case 0x1C: return 1 << 2;
+		case 0x21: return 1 << 3;
+		case 0x25: { // NR51: bit i is channel i on the right, bit 4+i on the left
+			if (prevValue < 0) return 0xF;
+			const uint8_t changedBits = value ^ prevValue;
+			return (changedBits | (changedBits >> 4)) & 0xF;
+		}
+		default: return (address >= 0x30 && address < 0x40) ? 1 << 2 : 0;
+	}
+}
+
+struct ppqn_constraints {
+	std::vector<std::pair<size_t,size_t>> distinctPairs; // indexes into songData of writes that have to be on separate ticks
+	bool usesSoundLength = false;
+};
+
+static bool meetsConstraints(const std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, const ppqn_constraints& constraints, double maxTimingErrorMilliseconds, int PPQN, std::vector<uint64_t>& regWriteMidiTimes){
+	const uint64_t midiTicksPerSecond = midiTicksPerSecondFromPPQN(PPQN);
+	if (constraints.usesSoundLength && midiTicksPerSoundLenTickFromTicksPerSecond(midiTicksPerSecond) == 0) return false;
+	gbTimes2midiTimes(songData, gbTimeUnitsPerSecond, midiTicksPerSecond, regWriteMidiTimes);
+	for (const std::pair<size_t,size_t>& pair : constraints.distinctPairs) {
+		if (regWriteMidiTimes[pair.first] == regWriteMidiTimes[pair.second]) return false;
+	}
+	if (maxTimingErrorMilliseconds > 0) {
+		for (size_t i=0; i<songData.size(); i++) {
+			double errorSeconds = fabs((double)regWriteMidiTimes[i] / midiTicksPerSecond - (double)songData[i].time / gbTimeUnitsPerSecond);
+			if (errorSeconds * 1000 > maxTimingErrorMilliseconds) return false;
+		}
+	}
+	return true;
+}
+
+int chooseMinimalPPQN(const std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, double maxTimingErrorMilliseconds){
+	stage_timer analysisTimer;
+	std::vector<uint64_t> regWriteMidiTimes;
+	gbTimes2midiTimes(songData, gbTimeUnitsPerSecond, midiTicksPerSecondFromPPQN(MAX_PPQN), regWriteMidiTimes);
+
+	ppqn_constraints constraints;
+	std::array<int16_t, 0x100> shadow; // last value written to each register, -1 if it hasn't been written yet
+	shadow.fill(-1);
+	std::array<size_t, 0x100> prevRelevantWrite; // index of the last counted write to each register, songData.size() if there is none
+	prevRelevantWrite.fill(songData.size());
+	uint64_t minGbTimeGap = UINT64_MAX; // only for the verbose message
+	for (size_t i=0; i<songData.size(); i++) {
+		const gb_reg_write& regWrite = songData[i];
+		const bool trigger = isTrigger(regWrite);
+		if (trigger && (regWrite.value & 0x40)) constraints.usesSoundLength = true;
+		const bool relevant = isPitchRegister(regWrite.address) && (trigger || shadow[regWrite.address] != regWrite.value);
+		shadow[regWrite.address] = regWrite.value;
+		if (relevant == false) continue;
+		const size_t prevI = prevRelevantWrite[regWrite.address];
+		if (prevI < songData.size() && regWriteMidiTimes[prevI] != regWriteMidiTimes[i]) {
+			constraints.distinctPairs.push_back({prevI, i});
+			if (regWrite.time - songData[prevI].time < minGbTimeGap) minGbTimeGap = regWrite.time - songData[prevI].time;
+		}
+		prevRelevantWrite[regWrite.address] = i;
+	}
+
+	// rule 3, once the shortest time between updates is known
+	const size_t crossRegisterPairsStart = constraints.distinctPairs.size();
+	if (minGbTimeGap != UINT64_MAX) {
+		const uint64_t sameUpdateGap = minGbTimeGap / 2;
+		std::array<size_t, 4> lastTrigger, lastSoundWrite; // songData.size() if there is none
+		lastTrigger.fill(songData.size());
+		lastSoundWrite.fill(songData.size());
+		std::array<size_t, 4> updateOfLastTrigger, updateOfLastSoundWrite;
+		std::array<bool, 4> pairedSinceTrigger; // the first sound write after the last trigger has been paired with it
+		pairedSinceTrigger.fill(true);
+		shadow.fill(-1);
+		size_t update = 0;
+		for (size_t i=0; i<songData.size(); i++) {
+			const gb_reg_write& regWrite = songData[i];
+			if (i > 0 && regWrite.time - songData[i-1].time > sameUpdateGap) update++;
+			if (isTrigger(regWrite)) {
+				const int channel = triggerChannel(regWrite.address);
+				const size_t prevI = lastSoundWrite[channel];
+				if (prevI < songData.size() && updateOfLastSoundWrite[channel] != update && regWriteMidiTimes[prevI] != regWriteMidiTimes[i]) constraints.distinctPairs.push_back({prevI, i});
+				lastSoundWrite[channel] = songData.size();
+				lastTrigger[channel] = i;
+				updateOfLastTrigger[channel] = update;
+				pairedSinceTrigger[channel] = false;
+			}
+			const uint8_t channels = soundChannelsChanged(regWrite.address, regWrite.value, shadow[regWrite.address]);
+			shadow[regWrite.address] = regWrite.value;
+			for (int channel=0; channel<4; channel++) {
+				if ((channels & (1 << channel)) == 0) continue;
+				const size_t triggerI = lastTrigger[channel];
+				if (pairedSinceTrigger[channel] == false && triggerI < songData.size() && updateOfLastTrigger[channel] != update && regWriteMidiTimes[triggerI] != regWriteMidiTimes[i]) {
+					constraints.distinctPairs.push_back({triggerI, i});
+					pairedSinceTrigger[channel] = true;
+				}
+				lastSoundWrite[channel] = i;
+				updateOfLastSoundWrite[channel] = update;
+			}
+		}
+	}
+
+	// bisection assumes that every PPQN above one that works also works. That's true for the timing error, and nearly true for the pairs, so the result always meets the constraints but a smaller PPQN between two that don't may be missed.
+	int PPQN = MAX_PPQN;
+	if (meetsConstraints(songData, gbTimeUnitsPerSecond, constraints, maxTimingErrorMilliseconds, MAX_PPQN, regWriteMidiTimes) == false) {
+		fprintf(stderr, "Warning: no PPQN keeps every write within %g ms. Using %d...\n", maxTimingErrorMilliseconds, MAX_PPQN);
+	} else {
+		int low = 1; // the smallest candidate not yet ruled out
+		while (low < PPQN) {
+			int mid = low + (PPQN - low) / 2;
+			if (meetsConstraints(songData, gbTimeUnitsPerSecond, constraints, maxTimingErrorMilliseconds, mid, regWriteMidiTimes)) PPQN = mid;
+			else low = mid + 1;
+		}
+	}
+	if (verboseOutput) {
+		fprintf(stderr, "chooseMinimalPPQN: %zu pairs of pitch and trigger writes", crossRegisterPairsStart);
+		if (crossRegisterPairsStart > 0) fprintf(stderr, ", the closest %.3f ms apart", minGbTimeGap * 1000.0 / gbTimeUnitsPerSecond);
+		fprintf(stderr, ", %zu pairs of triggers and writes that change their sound", constraints.distinctPairs.size() - crossRegisterPairsStart);
+		fprintf(stderr, "%s. Chose %d PPQN in %.2f ms.\n", constraints.usesSoundLength ? ", sound length is used" : "", PPQN, analysisTimer.stop());
+	}
+	return PPQN;
+}
+
+bool parseAutoPPQN(const std::string& arg, double& maxTimingErrorMilliseconds){
+	if (arg == "auto") {
+		maxTimingErrorMilliseconds = 0;
+		return true;
+	}
+	if (arg.rfind("auto:", 0) != 0) return false;
+	maxTimingErrorMilliseconds = atof(arg.c_str() + strlen("auto:"));
+	if (maxTimingErrorMilliseconds <= 0) {
+		fprintf(stderr, "Warning: the timing error bound in %s isn't above 0 ms. Ignoring it...\n", arg.c_str());
+		maxTimingErrorMilliseconds = 0;
+	}
+	return true;
+}
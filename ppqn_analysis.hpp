@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "gb_reg_write.h"
+
+// Picks the smallest PPQN that songData can be converted at without changing the order of what it plays. See ppqn_analysis.cpp for which writes have to stay on distinct ticks.
+// maxTimingErrorMilliseconds also bounds how far any write may move when it is rounded to a tick. 0 means no bound.
+int chooseMinimalPPQN(const std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, double maxTimingErrorMilliseconds = 0);
+// Reads "auto" or "auto:<milliseconds>" given as Midi_ticks_per_quarter_note, and sets the timing error bound (0 for "auto"). Returns false for anything else, e.g. a number.
+bool parseAutoPPQN(const std::string& arg, double& maxTimingErrorMilliseconds);
@@ -0,0 +1,130 @@
+/*
+This file contains a pre-pass that removes redundant register writes before conversion.
+
+Sound drivers rewrite the same envelope, duty and NR51 values every frame, and keep writing wave RAM while the wave DAC is on. songData2smf ignores these writes, but still has to run their handlers and the per-write sound length checks.
+The filter keeps a shadow copy of every register and removes a write when all of these are true:
+1. It changes none of the state the converter keeps. That means the bits the converter reads are the same as the last write to the register, the register is one the converter ignores, or it is a wave RAM write while the DAC is on. NRx4 writes with the trigger bit set are never removed.
+2. It isn't an NRx3/NRx4 (or NR43) write on the same midi tick as the write before it, because insertNoteIntoMidi looks ahead at those writes to decide which note to insert.
+3. No channel could have its sound length run out at this write. The converter ends such notes at the first write whose tick is past the scheduled end, so removing that write would move the note off to a later write.
+4. It isn't the last write, which sets the end of the song.
+Writes to channels that aren't in channelMask are removed under rules 3 and 4 only, as their tracks are left out of the midi file.
+*/
+
+#include <cstdint>
+#include <vector>
+#include <array>
+
+#include "reg_write_filter.hpp"
+#include "to_midi.hpp"
+#include "alloc_stats.hpp"
+
+// the bits of each register that the converter keeps. Indexed by gb_reg_write::address. 0 for registers the converter ignores.
+static constexpr std::array<uint8_t, 0x100> makeStateMasks(){
+	std::array<uint8_t, 0x100> masks{};
+	masks[0x10] = 0x7F; // NR10: sweep
+	masks[0x11] = 0xFF; masks[0x12] = 0xFF; masks[0x13] = 0xFF; masks[0x14] = 0x47; // square 1: NRx4 without the trigger bit
+	masks[0x16] = 0xFF; masks[0x17] = 0xFF; masks[0x18] = 0xFF; masks[0x19] = 0x47; // square 2
+	masks[0x1A] = 0x80; masks[0x1B] = 0xFF; masks[0x1C] = 0x60; masks[0x1D] = 0xFF; masks[0x1E] = 0x47; // wave
+	masks[0x20] = 0x3F; masks[0x21] = 0xFF; masks[0x22] = 0xFF; masks[0x23] = 0x40; // noise
+	masks[0x25] = 0xFF; // NR51: panning
+	for (int address=0x30; address<0x40; address++) masks[address] = 0xFF; // wave RAM
+	return masks;
+}
+static constexpr std::array<uint8_t, 0x100> STATE_MASKS = makeStateMasks();
+static const std::array<uint8_t,4> NRx1_ADDRESSES = {0x11, 0x16, 0x1B, 0x20};
+static const std::array<uint8_t,4> NRx4_ADDRESSES = {0x14, 0x19, 0x1E, 0x23};
+
+static int registerChannel(uint8_t address){ // for NRx3 and NRx4, -1 otherwise
+	switch (address) {
+		case 0x13: case 0x14: return 0;
+		case 0x18: case 0x19: return 1;
+		case 0x1D: case 0x1E: return 2;
+		case 0x22: case 0x23: return 3;
+		default: return -1;
+	}
+}
+
+static int soundChannel(uint8_t address){ // the channel a register (or wave RAM) belongs to, -1 for the control registers
+	if (address >= 0x10 && address <= 0x14) return 0;
+	if (address >= 0x15 && address <= 0x19) return 1;
+	if ((address >= 0x1A && address <= 0x1E) || (address >= 0x30 && address < 0x40)) return 2;
+	if (address >= 0x1F && address <= 0x23) return 3;
+	return -1;
+}
+
+size_t filterRedundantRegWrites(std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, int inPPQN, run_metrics* metrics, uint32_t channelMask, double BPM){
+	ALLOC_STATS_STAGE(ALLOC_STAGE_FILTER);
+	stage_timer filterTimer;
+	const double midiTicksPerSecond = midiTicksPerSecondAtBPM(inPPQN ? inPPQN : 0x7fff, BPM);
+	const uint64_t midiTicksPerSoundLenTick = midiTicksPerSoundLenTickFromTicksPerSecond(midiTicksPerSecond);
+
+	std::array<int16_t, 0x100> shadow; // last value kept for each register, -1 if it hasn't been written yet
+	shadow.fill(-1);
+	bool waveDACon = false;
+	std::array<bool,4> noteMayBePlaying = {false, false, false, false}; // set when a kept write may have started a note, cleared when a kept write would have ended it by sound length
+	std::array<uint64_t,4> scheduledSoundLenEndTime = {0, 0, 0, 0}; // the same as in songData2smf
+
+	std::vector<uint64_t> regWriteMidiTimes;
+	gbTimes2midiTimes(songData, gbTimeUnitsPerSecond, midiTicksPerSecond, regWriteMidiTimes);
+
+	size_t keptCount = 0;
+	uint64_t prevRegWriteMidiTime = 0;
+	for (size_t i=0; i<songData.size(); i++) {
+		const gb_reg_write regWrite = songData[i];
+		const uint64_t regWriteMidiTime = regWriteMidiTimes[i];
+		const bool sharesTickWithPrev = i > 0 && regWriteMidiTime == prevRegWriteMidiTime;
+		prevRegWriteMidiTime = regWriteMidiTime;
+		const int channel = registerChannel(regWrite.address);
+		const uint8_t mask = STATE_MASKS[regWrite.address];
+
+		const int ownerChannel = soundChannel(regWrite.address);
+		const bool channelEnabled = ownerChannel < 0 || (channelMask >> ownerChannel) & 1;
+
+		bool redundant;
+		if (channelEnabled == false) {
+			redundant = true;
+		} else if (mask == 0) {
+			redundant = true;
+		} else if (regWrite.address == 0x1A) {
+			redundant = ((regWrite.value & 0x80) != 0) == waveDACon;
+		} else if (regWrite.address >= 0x30 && regWrite.address < 0x40 && waveDACon) {
+			redundant = true;
+		} else if (channel >= 0 && regWrite.address == NRx4_ADDRESSES[channel] && (regWrite.value & 0x80)) {
+			redundant = false; // trigger
+		} else {
+			redundant = shadow[regWrite.address] >= 0 && (regWrite.value & mask) == (shadow[regWrite.address] & mask);
+		}
+		if (redundant && channel >= 0 && channelEnabled && sharesTickWithPrev) redundant = false; // visible to the same-tick lookahead
+		if (redundant && i + 1 == songData.size()) redundant = false;
+		for (int c=0; c<4 && redundant; c++) {
+			if (((channelMask >> c) & 1) && noteMayBePlaying[c] && shadow[NRx4_ADDRESSES[c]] >= 0 && (shadow[NRx4_ADDRESSES[c]] & 0x40) && scheduledSoundLenEndTime[c] <= regWriteMidiTime) redundant = false;
+		}
+		if (redundant) continue;
+
+		// the write is kept. Update the shadow state the same way songData2smf updates its state.
+		for (int c=0; c<4; c++) {
+			if (shadow[NRx4_ADDRESSES[c]] >= 0 && (shadow[NRx4_ADDRESSES[c]] & 0x40) && scheduledSoundLenEndTime[c] <= regWriteMidiTime) noteMayBePlaying[c] = false;
+		}
+		if (regWrite.address == 0x1A) {
+			waveDACon = regWrite.value & 0x80;
+		}
+		if ((regWrite.address < 0x30 || regWrite.address >= 0x40) || waveDACon == false) shadow[regWrite.address] = regWrite.value;
+		if (channel >= 0) {
+			noteMayBePlaying[channel] = true; // a trigger or a pitch change
+			if (regWrite.address == NRx4_ADDRESSES[channel] && (regWrite.value & 0x80) && (regWrite.value & 0x40) && shadow[NRx1_ADDRESSES[channel]] >= 0) {
+				uint8_t soundLength = shadow[NRx1_ADDRESSES[channel]] & (channel == 2 ? 0xFF : 0x3F);
+				scheduledSoundLenEndTime[channel] = regWriteMidiTime + ((channel == 2 ? 256 : 64) - soundLength) * midiTicksPerSoundLenTick;
+			}
+		}
+		songData[keptCount++] = regWrite;
+	}
+	size_t removedCount = songData.size() - keptCount;
+	songData.resize(keptCount);
+
+	if (verboseOutput) fprintf(stderr, "filterRedundantRegWrites: removed %zu of %zu register writes.\n", removedCount, keptCount + removedCount);
+	if (metrics) {
+		metrics->filterMilliseconds = filterTimer.stop();
+		metrics->regWritesRemoved = removedCount;
+	}
+	return removedCount;
+}
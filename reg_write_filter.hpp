@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "gb_reg_write.h"
+#include "run_metrics.hpp"
+#include "to_midi.hpp"
+
+// Removes register writes that can't change the midi file songData2smf makes from songData at the given PPQN and BPM, and returns how many were removed. See reg_write_filter.cpp for what counts as redundant.
+// Bit n of channelMask is GB channel n. The writes of the other channels are removed too, wherever the channels in channelMask don't need them for their timing, as their tracks are left out (see smfKeepTracks).
+size_t filterRedundantRegWrites(std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, int inPPQN, run_metrics* metrics = nullptr, uint32_t channelMask = 0xF, double BPM = DEFAULT_MIDI_BPM);
@@ -0,0 +1,119 @@
+/*
+This file contains the code that collects run metrics and formats them as JSON.
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#ifndef WIN32
+#include <sys/resource.h> // getrusage
+#endif
+
+#include "run_metrics.hpp"
+#include "alloc_stats.hpp"
+
+bool verboseOutput = false;
+
+static const char* const MIDI_EVENT_TYPE_NAMES[MIDI_EVENT_TYPE_COUNT] = {"note_on", "note_off", "control_change", "pitch_bend", "other_channel", "sysex", "meta"};
+
+static midiEventType classifySmfEvent(const SmfEvent* event){
+	uint8_t status = event->data[0];
+	switch (status & 0xF0) {
+		case 0x80: return MIDI_EVENT_NOTE_OFF;
+		case 0x90: return (event->size >= 3 && event->data[2] == 0) ? MIDI_EVENT_NOTE_OFF : MIDI_EVENT_NOTE_ON;
+		case 0xB0: return MIDI_EVENT_CONTROL_CHANGE;
+		case 0xE0: return MIDI_EVENT_PITCH_BEND;
+		case 0xF0: return status == 0xFF ? MIDI_EVENT_META : MIDI_EVENT_SYSEX;
+		default: return MIDI_EVENT_OTHER_CHANNEL;
+	}
+}
+void countSmfEvents(Smf* midiFile, run_metrics& metrics){
+	metrics.eventsPerTrack.assign(midiFile->numTracks, std::array<uint64_t, MIDI_EVENT_TYPE_COUNT>{});
+	for (int trackIndex=0; trackIndex < midiFile->numTracks; trackIndex++) {
+		for (SmfEvent* event = midiFile->track[trackIndex]->firstEvent; event != nullptr; event = event->nextEvent) {
+			metrics.eventsPerTrack[trackIndex][classifySmfEvent(event)]++;
+		}
+	}
+}
+
+long getPeakMemoryKilobytes(){
+#ifdef WIN32
+	return -1;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return -1;
+	return usage.ru_maxrss; // kilobytes on Linux
+#endif
+}
+
+static std::string json2string(const std::string& inString){
+	std::string out = "\"";
+	for (unsigned char c : inString) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if (c < 0x20) {
+			char escaped[8];
+			snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+			out += escaped;
+		} else {
+			out += c;
+		}
+	}
+	return out + "\"";
+}
+static std::string changeRate2json(const change_rate& rate){
+	char buffer[256];
+	snprintf(buffer, sizeof(buffer), "{\"changes\":%llu,\"peak_per_second\":%llu,\"fast_seconds\":%llu}", (unsigned long long)rate.changes, (unsigned long long)rate.peakPerSecond, (unsigned long long)rate.fastSeconds);
+	return buffer;
+}
+static std::string dryRunStats2json(const run_metrics& metrics){ // the fields a dry run adds, derived from what it counted
+	char buffer[256];
+	snprintf(buffer, sizeof(buffer), ",\"dry_run\":true,\"song_seconds\":%.3f", metrics.songSeconds);
+	std::string json = buffer;
+	json += ",\"notes_per_channel\":[";
+	for (size_t trackIndex=0; trackIndex < metrics.eventsPerTrack.size(); trackIndex++) {
+		snprintf(buffer, sizeof(buffer), "%s%llu", trackIndex ? "," : "", (unsigned long long)metrics.eventsPerTrack[trackIndex][MIDI_EVENT_NOTE_ON]);
+		json += buffer;
+	}
+	json += "],\"pitch_bends_per_second\":[";
+	for (size_t trackIndex=0; trackIndex < metrics.eventsPerTrack.size(); trackIndex++) {
+		const uint64_t pitchBends = metrics.eventsPerTrack[trackIndex][MIDI_EVENT_PITCH_BEND];
+		snprintf(buffer, sizeof(buffer), "%s%.2f", trackIndex ? "," : "", metrics.songSeconds > 0 ? pitchBends / metrics.songSeconds : 0);
+		json += buffer;
+	}
+	json += "],\"sample_playback\":{\"wavetable_swapping\":" + changeRate2json(metrics.wavetableSwapping) + ",\"volume_toggling\":" + changeRate2json(metrics.waveVolumeToggling) + "}";
+	return json;
+}
+std::string runMetrics2json(const run_metrics& metrics){
+	char buffer[512];
+	std::string json = "{";
+	json += "\"input\":" + json2string(metrics.inFilename);
+	if (metrics.dryRun == false) json += ",\"output\":" + json2string(metrics.outfilename); // a dry run writes nothing
+	snprintf(buffer, sizeof(buffer), ",\"subsong\":%d,\"ppqn\":%d", metrics.subsongNumber, metrics.PPQN);
+	json += buffer;
+	snprintf(buffer, sizeof(buffer), ",\"stage_ms\":{\"spawn\":%.3f,\"parse\":%.3f,\"filter\":%.3f,\"convert\":%.3f,\"serialise\":%.3f,\"write\":%.3f,\"total\":%.3f}",
+		metrics.spawnMilliseconds, metrics.parseMilliseconds, metrics.filterMilliseconds, metrics.convertMilliseconds, metrics.serialiseMilliseconds, metrics.writeMilliseconds, metrics.totalMilliseconds);
+	json += buffer;
+	snprintf(buffer, sizeof(buffer), ",\"register_writes\":%llu,\"register_writes_removed\":%llu,\"unique_wavetables\":%zu,\"%s\":%zu,\"peak_memory_kb\":%ld",
+		(unsigned long long)metrics.regWritesProcessed, (unsigned long long)metrics.regWritesRemoved, metrics.uniqueWavetables, metrics.dryRun ? "projected_midi_bytes" : "midi_bytes", metrics.midiBytes, getPeakMemoryKilobytes());
+	json += buffer;
+	if (metrics.umpMessages) json += ",\"ump_messages\":" + std::to_string(metrics.umpMessages);
+	json += ",\"events_per_track\":[";
+	for (size_t trackIndex=0; trackIndex < metrics.eventsPerTrack.size(); trackIndex++) {
+		json += trackIndex ? ",{" : "{";
+		for (int eventType=0; eventType < MIDI_EVENT_TYPE_COUNT; eventType++) {
+			snprintf(buffer, sizeof(buffer), "%s\"%s\":%llu", eventType ? "," : "", MIDI_EVENT_TYPE_NAMES[eventType], (unsigned long long)metrics.eventsPerTrack[trackIndex][eventType]);
+			json += buffer;
+		}
+		json += "}";
+	}
+	json += "]";
+	if (metrics.dryRun) json += dryRunStats2json(metrics);
+#ifdef GBS2MIDI_ALLOC_STATS
+	json += ",\"allocations\":" + allocStats2json();
+#endif
+	json += "}";
+	return json;
+}
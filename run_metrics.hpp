@@ -0,0 +1,78 @@
+/*
+This file contains the definition of the run_metrics struct, which collects per-stage measurements of one conversion so they can be printed as a single JSON record.
+*/
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <array>
+#include <chrono>
+
+#include "libsmfc.h"
+
+extern bool verboseOutput; // set with --verbose. When false, only warnings and errors are printed.
+
+enum midiEventType
+{
+	MIDI_EVENT_NOTE_ON,
+	MIDI_EVENT_NOTE_OFF,
+	MIDI_EVENT_CONTROL_CHANGE,
+	MIDI_EVENT_PITCH_BEND,
+	MIDI_EVENT_OTHER_CHANNEL, // key pressure, program change, channel pressure
+	MIDI_EVENT_SYSEX,
+	MIDI_EVENT_META,
+	MIDI_EVENT_TYPE_COUNT
+};
+
+// how often a property of the wave channel changed, counted per whole second of the song. Fast changes are how the GB plays samples (see "2 main methods of sample playback on Game Boy.txt").
+struct change_rate {
+	uint64_t changes = 0;
+	uint64_t peakPerSecond = 0;
+	uint64_t fastSeconds = 0; // seconds with more changes than a once-per-frame sound driver makes
+};
+
+struct run_metrics {
+	std::string inFilename;
+	std::string outfilename;
+	int subsongNumber = 0;
+	int PPQN = 0;
+
+	// wall time of each stage, in milliseconds
+	double spawnMilliseconds = 0; // starting gbsplay until its first output arrives
+	double parseMilliseconds = 0; // reading and parsing the rest of gbsplay's output
+	double filterMilliseconds = 0; // removing redundant register writes
+	double convertMilliseconds = 0; // songData -> Smf
+	double serialiseMilliseconds = 0; // Smf -> bytes
+	double writeMilliseconds = 0; // bytes -> output file
+	double totalMilliseconds = 0;
+
+	uint64_t regWritesRemoved = 0; // by filterRedundantRegWrites
+	uint64_t regWritesProcessed = 0; // by songData2smf, after filtering
+	size_t uniqueWavetables = 0;
+	size_t midiBytes = 0;
+	size_t umpMessages = 0; // in a .midi2 clip file, not counting the delta clockstamps
+	std::vector<std::array<uint64_t, MIDI_EVENT_TYPE_COUNT>> eventsPerTrack; // indexed by track, then by midiEventType
+
+	// set by a dry run (songData2stats), which counts the events instead of making them. midiBytes is then the projected size of the midi file.
+	bool dryRun = false;
+	double songSeconds = 0;
+	change_rate wavetableSwapping; // wavetable PCM
+	change_rate waveVolumeToggling; // NR32 volume modulation
+};
+
+// measures the wall time from construction until stop() is called
+class stage_timer {
+public:
+	stage_timer() : start(std::chrono::steady_clock::now()) {}
+	double stop(){
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+private:
+	std::chrono::steady_clock::time_point start;
+};
+
+void countSmfEvents(Smf* midiFile, run_metrics& metrics);
+long getPeakMemoryKilobytes(); // returns -1 if the platform doesn't report it
+std::string runMetrics2json(const run_metrics& metrics);
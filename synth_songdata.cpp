@@ -0,0 +1,232 @@
+/*
+This file contains a generator for synthetic register streams. It is used by the benchmark so that every stage of the conversion can be measured without gbsplay or any GBS files.
+
+The stream is built one 60 Hz frame at a time, like a real sound driver that runs once per vblank. The wave channel cycles through three 8 second sections:
+1. melodic: a new waveform is loaded (DAC off, wave RAM writes, DAC on) at the start of every note.
+2. PCM wave swapping: the waveform is swapped 256 times per second to play a sample (see "2 main methods of sample playback on Game Boy.txt").
+3. NR32 toggling: the wave channel plays a flat waveform and the volume is toggled between 100% and 0% 4096 times per second.
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <array>
+#include <algorithm> // std::stable_sort
+
+#include "synth_songdata.hpp"
+
+static const uint32_t CYCLES_PER_SECOND = 0x400000;
+static const uint32_t CYCLES_PER_FRAME = 70224; // one vblank
+static const uint32_t CYCLES_PER_WRITE = 16; // spacing between consecutive writes made by the driver
+static const uint32_t FRAMES_PER_WAVE_SECTION = 8*60;
+static const uint32_t PCM_SWAPS_PER_SECOND = 256; // 8192 Hz sample rate, 32 samples per waveform
+static const uint32_t NR32_TOGGLES_PER_SECOND = 4096;
+
+static uint32_t xorshift32(uint32_t& state){
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+static uint16_t midiNote2gbPeriod(int note){ // inverse of the table in gbPitch2noteAndPitch. Square channel frequency is 131072/(2048-period) Hz
+	double frequency = 440 * pow(2, (note - 69) / 12.0);
+	return (uint16_t)lround(2048 - 131072 / frequency);
+}
+
+class synth_frame_writer { // appends writes that the driver makes back-to-back, starting at a given time
+public:
+	synth_frame_writer(std::vector<gb_reg_write>& inOut, uint64_t startTime) : out(inOut), time(startTime) {}
+	void write(uint8_t address, uint8_t value){
+		out.push_back(gb_reg_write{time, address, value});
+		time += CYCLES_PER_WRITE;
+	}
+	void writePeriod(uint8_t loAddress, uint16_t period, bool trigger, uint8_t extraHiBits = 0){ // NRx3 followed by NRx4
+		write(loAddress, period & 0xFF);
+		write(loAddress + 1, (trigger ? 0x80 : 0) | extraHiBits | ((period >> 8) & 0b111));
+	}
+	void loadWave(const std::array<uint8_t,16>& waveRAM){ // DAC off, write wave RAM, DAC on
+		write(0x1A, 0x00);
+		for (int i=0; i<16; i++) write(0x30 + i, waveRAM[i]);
+		write(0x1A, 0x80);
+	}
+private:
+	std::vector<gb_reg_write>& out;
+	uint64_t time;
+};
+
+void generateSyntheticSongData(std::vector<gb_reg_write>& songData, double seconds, uint32_t seed){
+	uint32_t rng = seed ? seed : 1;
+	const uint64_t totalFrames = (uint64_t)(seconds * CYCLES_PER_SECOND / CYCLES_PER_FRAME);
+
+	const std::array<int,4> CHORD_ROOTS = {48, 53, 55, 50};
+	const std::array<int,3> ARPEGGIO = {0, 4, 7};
+	const std::array<int,7> SCALE = {0, 2, 4, 5, 7, 9, 11};
+	const std::array<uint8_t,3> DRUM_NR43 = {0x55, 0x32, 0x10}; // kick, snare, hat
+	const std::array<uint8_t,3> DRUM_NR42 = {0xA1, 0x81, 0x41};
+
+	std::array<std::array<uint8_t,16>,4> melodicWaves; // a few instrument waveforms
+	for (int w=0; w<4; w++) {
+		for (int i=0; i<16; i++) {
+			uint8_t hi = (uint8_t)(7.5 + 7.5 * sin((2*i) * 2 * M_PI / 32 * (w+1)));
+			uint8_t lo = (uint8_t)(7.5 + 7.5 * sin((2*i+1) * 2 * M_PI / 32 * (w+1)));
+			melodicWaves[w][i] = (hi << 4) | lo;
+		}
+	}
+	std::vector<std::array<uint8_t,16>> pcmLoop(64); // a looping sample, 64 waveforms long. A random walk, so the waveforms are all different.
+	int sample = 8;
+	for (std::array<uint8_t,16>& pcmWave : pcmLoop) {
+		for (int i=0; i<32; i++) {
+			sample += (int)(xorshift32(rng) % 5) - 2;
+			sample = std::clamp(sample, 0, 15);
+			if (i % 2 == 0) pcmWave[i/2] = sample << 4;
+			else pcmWave[i/2] |= sample;
+		}
+	}
+	const std::array<uint8_t,16> FLAT_WAVE = {0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF};
+
+	std::vector<gb_reg_write> frameWrites;
+	std::vector<gb_reg_write> carriedWrites; // writes started near the end of a frame that spill into the next one
+	uint16_t sq2Period = midiNote2gbPeriod(72);
+	uint8_t nr51 = 0xFF;
+	uint64_t pcmSwapCount = 0;
+
+	for (uint64_t frame=0; frame < totalFrames; frame++) {
+		const uint64_t frameStart = frame * CYCLES_PER_FRAME;
+		const int chordRoot = CHORD_ROOTS[(frame / 120) % CHORD_ROOTS.size()];
+		const uint32_t waveSection = (frame / FRAMES_PER_WAVE_SECTION) % 3;
+		const bool waveSectionStart = frame % FRAMES_PER_WAVE_SECTION == 0;
+		frameWrites.swap(carriedWrites);
+		carriedWrites.clear();
+		synth_frame_writer driver(frameWrites, frameStart);
+
+		// control registers are rewritten every frame, usually with the same value
+		if (frame % 240 == 0) nr51 = (nr51 == 0xFF) ? 0xED : 0xFF;
+		driver.write(0x24, 0x77);
+		driver.write(0x25, nr51);
+
+		// square 1: arpeggio. Retriggered every 8 frames, pitch steps every frame.
+		uint16_t sq1Period = midiNote2gbPeriod(chordRoot + 12 + ARPEGGIO[frame % ARPEGGIO.size()]);
+		if (frame % 8 == 0) {
+			driver.write(0x10, 0x00);
+			driver.write(0x11, 0x80);
+			driver.write(0x12, 0xF3);
+			driver.writePeriod(0x13, sq1Period, true);
+		} else {
+			driver.write(0x12, 0xF3);
+			driver.writePeriod(0x13, sq1Period, false);
+		}
+
+		// square 2: melody with vibrato
+		if (frame % 24 == 0) {
+			sq2Period = midiNote2gbPeriod(chordRoot + 24 + SCALE[xorshift32(rng) % SCALE.size()]);
+			driver.write(0x16, 0x40 | (xorshift32(rng) % 0x20));
+			driver.write(0x17, 0xA7);
+			driver.writePeriod(0x18, sq2Period, true);
+		} else {
+			int vibratoOffset = (int)lround(3 * sin(2 * M_PI * (frame % 6) / 6));
+			driver.write(0x16, 0x40);
+			driver.write(0x17, 0xA7);
+			driver.writePeriod(0x18, sq2Period + vibratoOffset, false);
+		}
+
+		// noise: dense drums, a hit every other frame
+		if (frame % 2 == 0) {
+			int drum = (frame % 16 == 0) ? 0 : (frame % 8 == 4) ? 1 : 2;
+			driver.write(0x20, 0x3F - (xorshift32(rng) % 0x10));
+			driver.write(0x21, DRUM_NR42[drum]);
+			driver.write(0x22, DRUM_NR43[drum] ^ (xorshift32(rng) % 2));
+			driver.write(0x23, drum == 2 ? 0xC0 : 0x80);
+		} else {
+			driver.write(0x21, DRUM_NR42[2]);
+		}
+
+		// wave
+		if (waveSection == 0) {
+			if (frame % 16 == 0) {
+				driver.loadWave(melodicWaves[(frame / 16) % melodicWaves.size()]);
+				driver.write(0x1B, 0x00);
+				driver.write(0x1C, 0x20);
+				driver.writePeriod(0x1D, midiNote2gbPeriod(chordRoot + ARPEGGIO[(frame / 16) % ARPEGGIO.size()]), true);
+			}
+		} else if (waveSection == 1) {
+			const uint64_t swapsPerFrame = (uint64_t)PCM_SWAPS_PER_SECOND * CYCLES_PER_FRAME / CYCLES_PER_SECOND + 1;
+			const uint64_t cyclesPerSwap = CYCLES_PER_SECOND / PCM_SWAPS_PER_SECOND;
+			const uint64_t firstSwap = (frameStart + cyclesPerSwap - 1) / cyclesPerSwap;
+			for (uint64_t swap = firstSwap; swap < firstSwap + swapsPerFrame && swap * cyclesPerSwap < frameStart + CYCLES_PER_FRAME; swap++) {
+				synth_frame_writer pcmDriver(frameWrites, swap * cyclesPerSwap + CYCLES_PER_WRITE / 2); // timer interrupt
+				pcmDriver.loadWave(pcmLoop[pcmSwapCount++ % pcmLoop.size()]);
+				pcmDriver.write(0x1C, 0x20);
+				pcmDriver.writePeriod(0x1D, 0x700, true);
+			}
+		} else {
+			if (waveSectionStart) {
+				driver.loadWave(FLAT_WAVE);
+				driver.writePeriod(0x1D, 0x7C0, true);
+			}
+			const uint64_t cyclesPerToggle = CYCLES_PER_SECOND / NR32_TOGGLES_PER_SECOND;
+			for (uint64_t t = (frameStart / cyclesPerToggle + 1) * cyclesPerToggle; t < frameStart + CYCLES_PER_FRAME; t += cyclesPerToggle) {
+				frameWrites.push_back(gb_reg_write{t + CYCLES_PER_WRITE / 2, 0x1C, (uint8_t)((xorshift32(rng) & 1) ? 0x20 : 0x00)});
+			}
+		}
+
+		std::stable_sort(frameWrites.begin(), frameWrites.end(), [](const gb_reg_write& a, const gb_reg_write& b){ return a.time < b.time; });
+		auto nextFrameBegin = std::lower_bound(frameWrites.begin(), frameWrites.end(), frameStart + CYCLES_PER_FRAME, [](const gb_reg_write& a, uint64_t time){ return a.time < time; });
+		songData.insert(songData.end(), frameWrites.begin(), nextFrameBegin);
+		carriedWrites.assign(nextFrameBegin, frameWrites.end());
+	}
+	songData.insert(songData.end(), carriedWrites.begin(), carriedWrites.end());
+}
+
+void generateRandomSongData(std::vector<gb_reg_write>& songData, double seconds, uint32_t seed){
+	uint32_t rng = seed ? seed : 1;
+	const std::array<uint8_t,25> ADDRESSES = {0x10,0x11,0x12,0x13,0x14,0x16,0x17,0x18,0x19,0x1A,0x1B,0x1C,0x1D,0x1E,0x20,0x21,0x22,0x23,0x24,0x25,0x26,0x30,0x31,0x35,0x3F};
+	const uint64_t endTime = (uint64_t)(seconds * CYCLES_PER_SECOND);
+	uint64_t time = 0;
+	while (time < endTime) {
+		if (xorshift32(rng) % 100 >= 30) time += xorshift32(rng) % 20000; // 30% of writes share the previous write's timestamp
+		uint8_t address = ADDRESSES[xorshift32(rng) % ADDRESSES.size()];
+		uint8_t value = xorshift32(rng) & 0xFF;
+		const bool isNRx4 = address == 0x14 || address == 0x19 || address == 0x1E || address == 0x23;
+		if (isNRx4 && xorshift32(rng) % 3) value &= 0x7F;
+		if (xorshift32(rng) % 4 == 0) value = 0x80 | (value & 0x47); // trigger, possibly with sound length enabled
+		songData.push_back(gb_reg_write{time, address, value});
+	}
+}
+
+void appendRedundantWrites(std::vector<gb_reg_write>& songData, size_t count){
+	std::array<int,0x40> lastValue; // indexed by address, -1 if never written
+	lastValue.fill(-1);
+	for (const gb_reg_write& regWrite : songData) {
+		if (regWrite.address >= 0x10 && regWrite.address < 0x40) lastValue[regWrite.address] = regWrite.value;
+	}
+	std::vector<gb_reg_write> rewrites;
+	for (int address=0x10; address < 0x40; address++) {
+		if (lastValue[address] < 0) continue;
+		uint8_t value = lastValue[address];
+		if (address == 0x14 || address == 0x19 || address == 0x1E || address == 0x23) value &= 0x7F; // NRx4 without the trigger bit
+		rewrites.push_back(gb_reg_write{0, (uint8_t)address, value});
+	}
+	if (rewrites.empty()) return;
+	uint64_t time = (songData.empty() ? 0 : songData.back().time) + CYCLES_PER_FRAME;
+	for (size_t i=0; i<count; i++) {
+		gb_reg_write regWrite = rewrites[i % rewrites.size()];
+		regWrite.time = time;
+		songData.push_back(regWrite);
+		time += CYCLES_PER_WRITE;
+	}
+}
+
+std::string songData2iodumperText(const std::vector<gb_reg_write>& songData, int subsongNum){
+	std::string text = "\nsubsong " + std::to_string(subsongNum) + "\n";
+	text.reserve(text.size() + songData.size() * 17);
+	char line[32];
+	uint64_t prevTime = 0;
+	for (const gb_reg_write& regWrite : songData) {
+		int lineLength = snprintf(line, sizeof(line), "%08lx %04x=%02x\n", (unsigned long)(regWrite.time - prevTime), 0xff00 | regWrite.address, regWrite.value);
+		text.append(line, lineLength);
+		prevTime = regWrite.time;
+	}
+	return text;
+}
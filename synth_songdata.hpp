@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "gb_reg_write.h"
+
+// Generates a deterministic register stream that imitates what a sound driver writes: square 1 arpeggios, square 2 vibrato, dense noise drums, per-frame rewrites of unchanged envelope/duty/NR51 values, and a wave channel that cycles between melodic playback, PCM wave swapping and NR32 volume toggling. Timestamps are in GB cycles (0x400000 per second).
+void generateSyntheticSongData(std::vector<gb_reg_write>& songData, double seconds, uint32_t seed = 1);
+// Generates random writes to every sound register, many of them sharing a timestamp (e.g. NRx3/NRx4 pairs on the same tick) and many of them triggers with sound length enabled. Not musical, but it reaches corner cases of the converter that the driver-like stream above never does.
+void generateRandomSongData(std::vector<gb_reg_write>& songData, double seconds, uint32_t seed = 1);
+// Appends count writes that repeat the last value written to each sound register (trigger bits cleared), starting one frame after the last write. None of them change what the converter emits, so converting them should cost no allocations.
+void appendRedundantWrites(std::vector<gb_reg_write>& songData, size_t count);
+// Formats songData the way gbsplay's iodumper output plugin does, so it can be fed to iodumperText2songData.
+std::string songData2iodumperText(const std::vector<gb_reg_write>& songData, int subsongNum = 1);
@@ -13,6 +13,10 @@ F7
 
 Throughout the song, the index of the current wave to use will be selected with CC21
 
+Live mode (live_conversion) can't wait for the end of the song, so it sends each wave as soon as it is found, in a sysex of its own with the wave's index first (the same two 7 bit halves as CC21 and CC53):
+F0 00 01 (index 1) 00 00 00 00 00 00 00 00 00 00 00 00 0F 0F 00 00 00 00 00 00 00 00 00 00 00 00 00 00 0F 0F 00 00 F7
+It has 34 data bytes, so it can't be mistaken for the sysex of a midi file, which has a multiple of 32.
+
 
 notes on notes:
 when to start notes:
@@ -38,25 +42,39 @@ Above all, we should avoid a situation where one note accidentally lasts the len
 #include <cmath>
 #include <array>
 #include <cstring>
+#include <cstddef> // offsetof
 #include <algorithm> // std::find
-#include <chrono> // for measuring performance
 #include <utility>
+#include <initializer_list>
+#include <memory> // std::make_unique
+#include <thread>
+#ifndef WIN32
+#include <cerrno>
+#include <climits> // IOV_MAX
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "gb_chip_state.hpp"
 #include "libsmfc.h"
 #include "libsmfcx.h"
+#include "run_metrics.hpp"
+#include "alloc_stats.hpp"
+#include "ump_clip.hpp"
 
 #include "to_midi.hpp"
 
+#define SMF_EVENT_NOTEOFF       0x80
+#define SMF_EVENT_NOTEON        0x90
 #define SMF_EVENT_CONTROL       0xb0
 #define SMF_EVENT_PITCHBEND     0xe0
+#define SMF_EVENT_SYSEX         0xf0
+#define SMF_EVENT_META          0xff
+#define SMF_DELTATIME_MAX       0x0fffffff // as in libsmfc.c. Longer delta times are split with filler events.
 
-std::vector<uint8_t> NOISE_PITCH_LIST; // this variable is global so that all functions can access it without me needing to pass it in.
-uint64_t midiTicksPerSoundLenTick = 1;
-std::vector<gb_reg_write>* songDataPointer;
-int* regWriteIpointer;
-unsigned int* gbTimeUnitsPerSecondPointer;
-const uint64_t* midiTicksPerSecondPointer;
 
 /*
 static bool smfOverwriteControl(Smf* seq, int time, int channel, int track, int controlNumber, int value){ // a wrapper around smfInsertControl that checks if the last event in the track has the same type and time as the event currently being inserted, and overwrites it if true.
@@ -103,32 +121,64 @@ static bool smfOverwriteControl(Smf* seq, int time, int channel, int track, int
 // 	return smfInsertPitchBend(seq, time, channel, track, value);
 // }
 
-static uint64_t gbTime2midiTime(uint64_t gbTime /*timestamp relative to start of song*/, unsigned int gbTimeUnitsPerSecond, const uint64_t midiTicksPerSecond){
+uint64_t gbTime2midiTime(uint64_t gbTime /*timestamp relative to start of song*/, unsigned int gbTimeUnitsPerSecond, const double midiTicksPerSecond){
 	double gbTimeInSeconds = gbTime / (double)gbTimeUnitsPerSecond;
 	uint64_t midiTime = llround(gbTimeInSeconds * midiTicksPerSecond);
 	return midiTime;
 }
+void gbTimes2midiTimes(const std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, const double exactMidiTicksPerSecond, std::vector<uint64_t>& midiTimes){
+	midiTimes.resize(songData.size());
+	if (songData.empty()) return;
+	// With a power of two time base (gbsplay's 0x400000) and a whole number of ticks per second (any PPQN at 120 BPM), the division in gbTime2midiTime is exact, and so is the multiplication while gbTime * midiTicksPerSecond < 2^53. llround of the result is then (gbTime * midiTicksPerSecond + half) >> shift. songData is in time order, so the last write has the largest product.
+	const bool powerOfTwoTimeBase = gbTimeUnitsPerSecond != 0 && (gbTimeUnitsPerSecond & (gbTimeUnitsPerSecond - 1)) == 0;
+	const uint64_t EXACT_DOUBLE_LIMIT = (uint64_t)1 << 53;
+	const uint64_t midiTicksPerSecond = exactMidiTicksPerSecond >= 1 && exactMidiTicksPerSecond <= UINT32_MAX ? (uint64_t)exactMidiTicksPerSecond : 0;
+	if (powerOfTwoTimeBase == false || midiTicksPerSecond == 0 || midiTicksPerSecond != exactMidiTicksPerSecond || songData.back().time >= EXACT_DOUBLE_LIMIT / midiTicksPerSecond) {
+		for (size_t i=0; i<songData.size(); i++) midiTimes[i] = gbTime2midiTime(songData[i].time, gbTimeUnitsPerSecond, exactMidiTicksPerSecond);
+		return;
+	}
+	int shift = 0;
+	while (((unsigned int)1 << shift) != gbTimeUnitsPerSecond) shift++;
+	const uint64_t half = shift ? (uint64_t)1 << (shift - 1) : 0;
+
+	size_t i = 0;
+#ifdef __SSE2__
+	// two writes at a time. SSE2 only multiplies 32 bit lanes, so gbTime * midiTicksPerSecond is assembled from the low and high halves of gbTime.
+	static_assert(sizeof(gb_reg_write) == 16 && offsetof(gb_reg_write, time) == 0, "the time of each write is loaded from the start of its 16 bytes");
+	const __m128i multiplier = _mm_set1_epi64x(midiTicksPerSecond);
+	const __m128i rounding = _mm_set1_epi64x(half);
+	const __m128i shiftCount = _mm_cvtsi32_si128(shift);
+	for (; i + 2 <= songData.size(); i += 2) {
+		const __m128i first = _mm_loadu_si128((const __m128i*)&songData[i]);
+		const __m128i second = _mm_loadu_si128((const __m128i*)&songData[i+1]);
+		const __m128i gbTimes = _mm_unpacklo_epi64(first, second);
+		const __m128i lowProducts = _mm_mul_epu32(gbTimes, multiplier);
+		const __m128i highProducts = _mm_mul_epu32(_mm_srli_epi64(gbTimes, 32), multiplier);
+		const __m128i products = _mm_add_epi64(lowProducts, _mm_slli_epi64(highProducts, 32));
+		_mm_storeu_si128((__m128i*)&midiTimes[i], _mm_srl_epi64(_mm_add_epi64(products, rounding), shiftCount));
+	}
+#endif
+	for (; i<songData.size(); i++) midiTimes[i] = (songData[i].time * midiTicksPerSecond + half) >> shift;
+}
 static uint16_t combinePitch(uint8_t inPitchMSB, uint8_t inPitchLSB){
 	return (uint16_t)(inPitchLSB) | ((uint16_t)(inPitchMSB) << 8);
 }
-static int closest(std::vector<uint16_t> const& vec, int value) { // https://stackoverflow.com/questions/8647635/elegant-way-to-find-closest-value-in-a-vector-from-above
-	auto const it = std::lower_bound(vec.begin(), vec.end(), value);
-	if (it == vec.end()) { return -1; }
-	return *it;
-}
-static std::pair<int, int> gbPitch2noteAndPitch(uint16_t gbPitch){ // https://www.devrs.com/gb/files/sndtab.html
+static const std::array<uint16_t,72> GB_PITCH_ARRAY = {44,156,262,363,457,547,631,710,786,854,923,986,1046,1102,1155,1205,1253,1297,1339,1379,1417,1452,1486,1517,1546,1575,1602,1627,1650,1673,1694,1714,1732,1750,1767,1783,1798,1812,1825,1837,1849,1860,1871,1881,1890,1899,1907,1915,1923,1930,1936,1943,1949,1954,1959,1964,1969,1974,1978,1982,1985,1988,1992,1995,1998,2001,2004,2006,2009,2011,2013,2015}; // https://www.devrs.com/gb/files/sndtab.html
+static std::pair<int, int> gbPitch2noteAndPitch(uint16_t gbPitch){
 	int note;
 	int pitchAdjust;
-	std::vector<uint16_t> gbPitchArray = {44,156,262,363,457,547,631,710,786,854,923,986,1046,1102,1155,1205,1253,1297,1339,1379,1417,1452,1486,1517,1546,1575,1602,1627,1650,1673,1694,1714,1732,1750,1767,1783,1798,1812,1825,1837,1849,1860,1871,1881,1890,1899,1907,1915,1923,1930,1936,1943,1949,1954,1959,1964,1969,1974,1978,1982,1985,1988,1992,1995,1998,2001,2004,2006,2009,2011,2013,2015}; // length: 72
+	const std::array<uint16_t,72>& gbPitchArray = GB_PITCH_ARRAY;
 	uint8_t noteC2=36; // midi note number
-	uint16_t closestGbpitch = closest(gbPitchArray, gbPitch);
-	uint8_t gbPitchArrayIndex=std::distance( gbPitchArray.begin(), std::find(gbPitchArray.begin(), gbPitchArray.end(), closestGbpitch) );
+	auto closestIt = std::lower_bound(gbPitchArray.begin(), gbPitchArray.end(), gbPitch); // the closest value from above
+	if (closestIt == gbPitchArray.end()) closestIt--; // pitches above 2015 (B7) are clamped to the highest note instead of reading past the end of the array
+	uint16_t closestGbpitch = *closestIt;
+	uint8_t gbPitchArrayIndex = std::distance(gbPitchArray.begin(), closestIt);
 	note = noteC2 + gbPitchArrayIndex;
 	int pitchDifference = (int)gbPitch - closestGbpitch;
-	
-	
+
+
 	if (pitchDifference > 0) {
-		if (gbPitchArrayIndex+1 >= gbPitchArray.size()) {
+		if ((size_t)gbPitchArrayIndex+1 >= gbPitchArray.size()) {
 			pitchAdjust = 0;
 		} else {
 			uint16_t totalSemitoneDiff = gbPitchArray[gbPitchArrayIndex+1] - gbPitchArray[gbPitchArrayIndex];
@@ -152,62 +202,185 @@ static std::pair<int, int> gbPitch2noteAndPitch(uint16_t gbPitch){ // https://ww
 	} else {
 		pitchAdjust = 0;
 	}
-	
+
 	return std::make_pair(note, pitchAdjust);
 }
-static void insertNoteIntoMidi(const uint8_t newNote, const uint8_t channel, std::array<uint8_t,4>& curPlayingMidiNote, const uint64_t& regWriteMidiTime, Smf* midiFile, const uint16_t prevRegPitch){ // ends the currently playing note and inserts a new note.
-	int tempCheckAddress = channel*0x5 + 0x10;
-	bool doNotInsertNote = false;
-	for (int i = (*regWriteIpointer) + 1; i < songDataPointer->size(); i++){ // if any of the upcoming regWrites both happen at the same time as this one AND would also cause a note to be inserted, don't do anything yet. This is necessary in order to prevent accidentally inserting long, overlapping notes into the midi. BUG: because this only keeps certain notes, this has produced a new bug where sometimes the "wrong" notes will be preserved and the song sounds off. HOWEVER, this only seems to be an issue when the PPQN is low.
-		uint64_t nextRegWriteMidiTime = gbTime2midiTime((*songDataPointer)[i].time, *gbTimeUnitsPerSecondPointer, *midiTicksPerSecondPointer);
-		if (nextRegWriteMidiTime != regWriteMidiTime) 
-			break;
-		int nextRegAddress = (*songDataPointer)[i].address;
-		if (nextRegAddress == (tempCheckAddress+3) || nextRegAddress == (tempCheckAddress+4)) {
-			/*
-			if (channel == 2) { 
-				printf("There is another pitch reg write at the same time. nextRegAddress: %02X\n", nextRegAddress);
-			}
-			*/
-			// TODO: remove redundant code.
-			uint16_t nextRegPitch = 0;
-			uint8_t nextTrigger=0;
-			if (channel != 3){ // simply checking if the next regWrite would change pitch is not enough. I need to check if it would actually change the midi note.
-				if (nextRegAddress == (tempCheckAddress+3)) {
-					nextRegPitch = combinePitch((prevRegPitch & 0b11100000000) >> 8, (*songDataPointer)[i].value);
-				} else if (nextRegAddress == (tempCheckAddress+4)) {
-					nextRegPitch = combinePitch((*songDataPointer)[i].value & 0b111, prevRegPitch & 0xFF);
-					nextTrigger = (*songDataPointer)[i].value & 0b10000000;
-				}
-				uint8_t nextMidiNote = gbPitch2noteAndPitch(nextRegPitch).first;
-				if (nextMidiNote != curPlayingMidiNote[channel] || nextTrigger){
-					doNotInsertNote = true;
-				}
-			} else {
-				doNotInsertNote = true; // TODO: TEST
-			}
-			break;
+
+// the part of conversion_state that changes while songData is walked through. It is all that one write's conversion depends on besides songData, so a copy of it is a checkpoint that the conversion can be resumed from (see songData2smfParallel).
+struct conversion_checkpoint {
+	uint64_t midiTicksPassed = 0; // the time of the latest write handled so far
+	gb_chip_state apu; // whenever a register write is encountered, it will converted to a midi event and then written here. Used to compare the current register write to the previous state.
+	std::array<uint8_t,4> curPlayingMidiNote = {0xFF, 0xFF, 0xFF, 0xFF}; // The note number of the midi note that is currently playing. One entry for each channel. Used to end the current note, whatever it is. 0xFF means no notes are currently playing.
+	std::array<bool,4> legatoState = {false, false, false, false}; // legato mode is turned on whenever the GB does a pitch bend without retriggering the note, but the pitch bend goes beyond the range of a midi note. Legato mode means that when the Plugin is reading back the midi, it should read new notes as pitch changes with no trigger.
+	std::array<uint64_t,4> scheduledSoundLenEndTime = {0,0,0,0}; // time when a note's sound length should run out in midi ticks (relative to the start of the song)
+	std::vector<std::array<std::pair<uint8_t,bool>, 32>> uniqueWavetables;
+	uint16_t prevWavetableIndex = 0xFFFF;
+};
+static const uint64_t SAMPLE_PLAYBACK_CHANGES_PER_SECOND = 120; // twice the frame rate. A sound driver updates once per frame, so a property that changes faster than this is being driven by a timer interrupt to play a sample.
+// counts the events a dry run (songData2stats) would have made, instead of making them: how many of each type, how fast the wave channel changes, and how many bytes each track would take when written by libsmfc.
+struct dry_run_counter {
+	struct projected_track { // follows smfTrackGetSizeProc
+		uint64_t prevTime = 0;
+		uint8_t runningStatus = 0;
+		bool hasEvents = false;
+		size_t bytes = 8; // the MTrk chunk header
+		// the status bytes of the events on the latest tick. libsmfc sorts note offs before the other events of their tick, which changes where running status applies.
+		uint64_t tickTime = 0;
+		std::vector<uint8_t> tickNoteOffs;
+		std::vector<uint8_t> tickOtherEvents;
+	};
+	struct change_bucket { // the changes in the current second of the song
+		uint64_t second = 0;
+		uint64_t count = 0;
+	};
+	dry_run_counter(run_metrics& inMetrics, uint64_t inMidiTicksPerSecond) : metrics(inMetrics), midiTicksPerSecond(inMidiTicksPerSecond) {
+		metrics.eventsPerTrack.assign(tracks.size(), std::array<uint64_t, MIDI_EVENT_TYPE_COUNT>{});
+		metrics.wavetableSwapping = change_rate{};
+		metrics.waveVolumeToggling = change_rate{};
+	}
+	void countChannelEvent(const uint8_t track, const uint64_t midiTime, const uint8_t status, const uint8_t data1){
+		switch (status & 0xF0) {
+			case SMF_EVENT_NOTEOFF: metrics.eventsPerTrack[track][MIDI_EVENT_NOTE_OFF]++; break;
+			case SMF_EVENT_NOTEON: metrics.eventsPerTrack[track][MIDI_EVENT_NOTE_ON]++; break;
+			case SMF_EVENT_CONTROL: metrics.eventsPerTrack[track][MIDI_EVENT_CONTROL_CHANGE]++; break;
+			case SMF_EVENT_PITCHBEND: metrics.eventsPerTrack[track][MIDI_EVENT_PITCH_BEND]++; break;
+		}
+		projected_track& projectedTrack = tracks[track];
+		if (midiTime != projectedTrack.tickTime) projectTick(projectedTrack);
+		projectedTrack.tickTime = midiTime;
+		((status & 0xF0) == SMF_EVENT_NOTEOFF ? projectedTrack.tickNoteOffs : projectedTrack.tickOtherEvents).push_back(status);
+		if (track == 2 && (status & 0xF0) == SMF_EVENT_CONTROL) {
+			if (data1 == 53) countChange(wavetableSwaps, metrics.wavetableSwapping, midiTime); // CC53 comes with every change of wave table
+			else if (data1 == SMF_CONTROL_VOLUME) countChange(waveVolumeChanges, metrics.waveVolumeToggling, midiTime);
 		}
 	}
-	/*
-	if (channel == 2) { 
-		printf("doNotInsertNote: %d\n", doNotInsertNote);
+	void finish(const size_t wavetableSysexSize, const uint64_t endMidiTime){ // the wavetable sysex at tick 0 and the end of every track
+		for (projected_track& track : tracks) projectTick(track);
+		const size_t sysexLength = wavetableSysexSize - 1; // the bytes after F0
+		const size_t sysexSize = 1 + smfGetVarLengthSize(sysexLength) + sysexLength;
+		if (sysexAfterTickZero) tracks[2].bytes += 1 /* delta time 0 */ + sysexSize;
+		else projectEvent(tracks[2], 0, SMF_EVENT_SYSEX, sysexSize);
+		metrics.eventsPerTrack[2][MIDI_EVENT_SYSEX]++;
+		metrics.midiBytes = 14; // the MThd chunk
+		for (size_t trackIndex=0; trackIndex < tracks.size(); trackIndex++) {
+			projectEvent(tracks[trackIndex], endMidiTime, SMF_EVENT_META, 3);
+			metrics.eventsPerTrack[trackIndex][MIDI_EVENT_META]++;
+			metrics.midiBytes += tracks[trackIndex].bytes;
+		}
+		closeBucket(wavetableSwaps, metrics.wavetableSwapping);
+		closeBucket(waveVolumeChanges, metrics.waveVolumeToggling);
 	}
-	*/
-	if (doNotInsertNote == false) {
-		if (curPlayingMidiNote[channel] != 0xFF){ // a note is playing
-			// end the currently playing note
-			smfInsertNoteOff(midiFile, regWriteMidiTime, channel, channel, curPlayingMidiNote[channel], 0x7F);
+private:
+	void projectTick(projected_track& track){
+		for (uint8_t status : track.tickNoteOffs) projectEvent(track, track.tickTime, status, 3);
+		for (uint8_t status : track.tickOtherEvents) projectEvent(track, track.tickTime, status, 3);
+		if (&track == &tracks[2] && track.tickTime == 0 && track.hasEvents) { // the sysex is inserted at tick 0 last, so it follows the wave track's events there and ends their running status
+			sysexAfterTickZero = true;
+			track.runningStatus = 0;
 		}
-		// insert new note
-		smfInsertNoteOn(midiFile, regWriteMidiTime, channel, channel, newNote, 0x7F);
-		curPlayingMidiNote[channel] = newNote; // a new note has started. Put it in the array to keep track of it.
-		//if (channel == 2) printf("regWriteMidiTime: %lu. nextRegWriteMidiTime: %lu. nextRegWriteMidiTime == regWriteMidiTime: %d. nextRegAddress: 0x%02X\n", regWriteMidiTime, nextRegWriteMidiTime, nextRegWriteMidiTime == regWriteMidiTime, nextRegAddress);
+		track.tickNoteOffs.clear();
+		track.tickOtherEvents.clear();
+	}
+	void projectEvent(projected_track& track, uint64_t midiTime, const uint8_t status, const size_t size){
+		if (track.hasEvents == false && status != SMF_EVENT_META) { // the writer starts the track with a port change meta event at the time of the first event
+			track.hasEvents = true;
+			projectEvent(track, midiTime, SMF_EVENT_META, 4);
+		}
+		if (midiTime < track.prevTime) midiTime = track.prevTime; // only the sysex at tick 0 is made out of order. Inserted at the front, it takes the same bytes.
+		uint64_t deltaTime = midiTime - track.prevTime;
+		if (deltaTime > SMF_DELTATIME_MAX) {
+			const uint64_t fillerCount = (deltaTime - 1) / SMF_DELTATIME_MAX;
+			deltaTime -= fillerCount * SMF_DELTATIME_MAX;
+			track.bytes += fillerCount * 7;
+			track.runningStatus = 0;
+		}
+		track.bytes += smfGetVarLengthSize(deltaTime) + size;
+		if (status < SMF_EVENT_SYSEX) {
+			if (status == track.runningStatus) track.bytes--;
+			track.runningStatus = status;
+		} else {
+			track.runningStatus = 0;
+		}
+		track.prevTime = midiTime;
+	}
+	void countChange(change_bucket& bucket, change_rate& rate, const uint64_t midiTime){
+		const uint64_t second = midiTime / midiTicksPerSecond;
+		if (second != bucket.second) {
+			closeBucket(bucket, rate);
+			bucket.second = second;
+		}
+		bucket.count++;
+	}
+	void closeBucket(change_bucket& bucket, change_rate& rate){
+		if (bucket.count >= SAMPLE_PLAYBACK_CHANGES_PER_SECOND) rate.fastSeconds++;
+		rate.peakPerSecond = std::max(rate.peakPerSecond, bucket.count);
+		rate.changes += bucket.count;
+		bucket.count = 0;
+	}
+	run_metrics& metrics;
+	const uint64_t midiTicksPerSecond;
+	std::array<projected_track,4> tracks;
+	change_bucket wavetableSwaps;
+	change_bucket waveVolumeChanges;
+	bool sysexAfterTickZero = false;
+};
+// everything songData2smf keeps track of while it walks through songData. The handlers below read and update it.
+struct conversion_state : conversion_checkpoint {
+	conversion_state(const std::vector<gb_reg_write>& inSongData, const std::vector<uint64_t>& inRegWriteMidiTimes, unsigned int inGbTimeUnitsPerSecond, double inMidiTicksPerSecond, Smf* inMidiFile)
+		: songData(inSongData), regWriteMidiTimes(inRegWriteMidiTimes), gbTimeUnitsPerSecond(inGbTimeUnitsPerSecond), midiTicksPerSecond(inMidiTicksPerSecond), midiFile(inMidiFile) {
+		midiTicksPerSoundLenTick = midiTicksPerSoundLenTickFromTicksPerSecond(midiTicksPerSecond);
+	}
+	conversion_state(const conversion_state&) = delete; // soundLengthEnable points into apu. Copy the conversion_checkpoint instead.
+	const std::vector<gb_reg_write>& songData;
+	const std::vector<uint64_t>& regWriteMidiTimes; // the time of each write in midi ticks, indexed like songData
+	size_t regWriteI = 0; // index of the write being handled
+	const unsigned int gbTimeUnitsPerSecond;
+	const double midiTicksPerSecond;
+	uint64_t midiTicksPerSoundLenTick = 1;
+	Smf* midiFile; // nullptr replays the writes without making any events
+	dry_run_counter* dryRun = nullptr; // when midiFile is nullptr, counts the events instead
+	const std::array<std::pair<uint8_t, bool>*,4> soundLengthEnable = {&(apu.gb_square1_state.sound_length_enable), &(apu.gb_square2_state.sound_length_enable), &(apu.gb_wave_state.sound_length_enable), &(apu.gb_noise_state.sound_length_enable)};
+};
+template<int CHANNEL> static auto& channelState(gb_chip_state& apu){
+	static_assert(CHANNEL >= 0 && CHANNEL <= 3, "the GB has 4 channels");
+	if constexpr (CHANNEL == 0) return apu.gb_square1_state;
+	else if constexpr (CHANNEL == 1) return apu.gb_square2_state;
+	else if constexpr (CHANNEL == 2) return apu.gb_wave_state;
+	else return apu.gb_noise_state;
+}
+
+// the register slot of a write, i.e. y in NRxy. The same-tick lookahead in insertNoteIntoMidi looks for slots 3 and 4 of the same channel.
+enum registerSlot : uint8_t
+{
+	REGISTER_SLOT_NRx0,
+	REGISTER_SLOT_NRx1,
+	REGISTER_SLOT_NRx2,
+	REGISTER_SLOT_NRx3,
+	REGISTER_SLOT_NRx4,
+	REGISTER_SLOT_CONTROL, // NR50-NR52
+	REGISTER_SLOT_WAVE_RAM,
+	REGISTER_SLOT_NONE
+};
+typedef void (*regWriteHandler)(conversion_state& state, const gb_reg_write& regWrite, const uint64_t regWriteMidiTime);
+struct register_class {
+	regWriteHandler handler = nullptr; // nullptr for registers that don't affect the midi
+	uint8_t channel = 0xFF; // 0xFF for registers that don't belong to a channel
+	registerSlot slot = REGISTER_SLOT_NONE;
+};
+
+static void insertNoteIntoMidi(conversion_state& state, const uint8_t newNote, const uint8_t channel, const uint64_t regWriteMidiTime, const uint16_t prevRegPitch); // uses REGISTER_CLASSES, which is defined after the handlers
+static constexpr std::array<uint8_t, 0x100> makeNoisePitch2noteTable(){
+	std::array<uint8_t, 0x100> table{};
+	uint8_t note = 0;
+	for (int noisePitch=0xF7; noisePitch >= 0; noisePitch--){ // the list should be written backwards because lower values tend to be higher pitched. 0xF7 is 0b11110111.
+		if ((noisePitch & 8) == 0) table[noisePitch] = note++;
 	}
+	for (int noisePitch=0xF8; noisePitch <= 0xFF; noisePitch++) table[noisePitch] = note; // never used: noise_pitch has bit 3 cleared and is at most 0xF7
+	return table;
 }
+static constexpr std::array<uint8_t, 0x100> NOISE_PITCH_TO_NOTE = makeNoisePitch2noteTable();
 static uint8_t noisePitch2note(uint8_t noisePitch){
-	uint8_t note = std::distance(NOISE_PITCH_LIST.begin(), std::find(NOISE_PITCH_LIST.begin(), NOISE_PITCH_LIST.end(), noisePitch));
-	return note;
+	return NOISE_PITCH_TO_NOTE[noisePitch];
 }
 static uint8_t extractBitValueFromByte(const uint8_t inByte, uint8_t startBit, uint8_t endBit) {
 	if (startBit > 7) startBit = 7;
@@ -229,401 +402,779 @@ static uint8_t convertValToMidiCCrange(uint8_t inVal, uint8_t inValMax){
 	const uint8_t MIDI_CC_MAX = 0x7F;
 	return (uint8_t)round((float)MIDI_CC_MAX * ((float)inVal / inValMax));
 }
-static void handleCommonRegWrite(const uint8_t inRegWriteVal, std::vector<std::pair<uint8_t, bool>*> propertyVector, const std::vector<std::pair<uint8_t, uint8_t>> bitRangeVector, const std::vector<uint8_t> midiCCvector, const uint8_t channel, const uint64_t& regWriteMidiTime, Smf* midiFile){
-	for (int i=0; i<midiCCvector.size(); i++){ // all the vectors should be the same size
-		uint8_t regBitVal = extractBitValueFromByte(inRegWriteVal, bitRangeVector[i].first, bitRangeVector[i].second);
-		uint8_t regBitValMax = extractBitValueFromByte(0xFF, bitRangeVector[i].first, bitRangeVector[i].second);
-		if ((*(propertyVector[i])).first != regBitVal || (*(propertyVector[i])).second == false)
-			smfInsertControl(midiFile, regWriteMidiTime, channel, channel, midiCCvector[i], convertValToMidiCCrange(regBitVal, regBitValMax));
-		*(propertyVector[i]) = std::make_pair(regBitVal, true); // change the value that is pointed to. Write the new value to the APU state
-	}
-}
-static void handleSqDutyAndSoundLen(const uint8_t inRegWriteVal, gb_chip_state::square_channels* chanState, const uint8_t channel, const uint64_t& regWriteMidiTime, Smf* midiFile){
-	std::vector<std::pair<uint8_t, bool>*> propertyVector;
-	std::vector<std::pair<uint8_t, uint8_t>> bitRangeVector;
-	std::vector<uint8_t> midiCCvector;
-	propertyVector = {&(chanState->duty_cycle), &(chanState->sound_length) /*this may need a special dynamic_cast*/};
-	bitRangeVector = {std::make_pair(7,6), std::make_pair(5,0)};
-	midiCCvector = {19, 15};
-	handleCommonRegWrite(inRegWriteVal, propertyVector, bitRangeVector, midiCCvector, channel, regWriteMidiTime, midiFile);
-}
-static void handleEnv(const uint8_t inRegWriteVal, gb_chip_state::channels_with_env* chanState, const uint8_t channel, const uint64_t& regWriteMidiTime, Smf* midiFile){
-	std::vector<std::pair<uint8_t, bool>*> propertyVector;
-	std::vector<std::pair<uint8_t, uint8_t>> bitRangeVector;
-	std::vector<uint8_t> midiCCvector;
-	propertyVector = {&(chanState->env_start_vol), &(chanState->env_down_or_up), &(chanState->env_length)};
-	bitRangeVector = {std::make_pair(7,4), std::make_pair(3,3), std::make_pair(2,0)};
-	midiCCvector = {SMF_CONTROL_VOLUME, 12, 13};
-	handleCommonRegWrite(inRegWriteVal, propertyVector, bitRangeVector, midiCCvector, channel, regWriteMidiTime, midiFile);
-}
-static void handlePitchBend(uint16_t curRegPitch, uint16_t prevRegPitch, bool isPitchValid, Smf* midiFile, const uint64_t& regWriteMidiTime, const uint8_t channel, std::array<uint8_t,4>& curPlayingMidiNote, bool& chanLegato /*legatoState*/){
+// the handlers make their events through these. Without an Smf, the events are only counted, or not made at all.
+static void insertControl(conversion_state& state, const uint64_t midiTime, const uint8_t channel, const uint8_t controlNumber, const uint8_t value){
+	if (state.midiFile) smfInsertControl(state.midiFile, midiTime, channel, channel, controlNumber, value);
+	else if (state.dryRun) state.dryRun->countChannelEvent(channel, midiTime, SMF_EVENT_CONTROL | channel, controlNumber);
+}
+static void insertPitchBend(conversion_state& state, const uint64_t midiTime, const uint8_t channel, const int value){
+	if (state.midiFile) smfInsertPitchBend(state.midiFile, midiTime, channel, channel, value);
+	else if (state.dryRun) state.dryRun->countChannelEvent(channel, midiTime, SMF_EVENT_PITCHBEND | channel, 0);
+}
+static void insertNoteOn(conversion_state& state, const uint64_t midiTime, const uint8_t channel, const uint8_t note){
+	if (state.midiFile) smfInsertNoteOn(state.midiFile, midiTime, channel, channel, note, 0x7F);
+	else if (state.dryRun) state.dryRun->countChannelEvent(channel, midiTime, SMF_EVENT_NOTEON | channel, note);
+}
+static void insertNoteOff(conversion_state& state, const uint64_t midiTime, const uint8_t channel, const uint8_t note){
+	if (state.midiFile) smfInsertNoteOff(state.midiFile, midiTime, channel, channel, note, 0x7F);
+	else if (state.dryRun) state.dryRun->countChannelEvent(channel, midiTime, SMF_EVENT_NOTEOFF | channel, note);
+}
+// the lists are passed as initializer lists rather than vectors so that handling a register write never touches the heap
+static void handleCommonRegWrite(const uint8_t inRegWriteVal, std::initializer_list<std::pair<uint8_t, bool>*> propertyList, std::initializer_list<std::pair<uint8_t, uint8_t>> bitRangeList, std::initializer_list<uint8_t> midiCCList, const uint8_t channel, const uint64_t regWriteMidiTime, conversion_state& state){
+	for (size_t i=0; i<midiCCList.size(); i++){ // all the lists should be the same size
+		std::pair<uint8_t, bool>* property = propertyList.begin()[i];
+		const std::pair<uint8_t, uint8_t>& bitRange = bitRangeList.begin()[i];
+		uint8_t regBitVal = extractBitValueFromByte(inRegWriteVal, bitRange.first, bitRange.second);
+		uint8_t regBitValMax = extractBitValueFromByte(0xFF, bitRange.first, bitRange.second);
+		if (property->first != regBitVal || property->second == false)
+			insertControl(state, regWriteMidiTime, channel, midiCCList.begin()[i], convertValToMidiCCrange(regBitVal, regBitValMax));
+		*property = std::make_pair(regBitVal, true); // change the value that is pointed to. Write the new value to the APU state
+	}
+}
+static void handlePitchBend(conversion_state& state, uint16_t curRegPitch, uint16_t prevRegPitch, bool isPitchValid, const uint64_t regWriteMidiTime, const uint8_t channel){
 	if (isPitchValid) {
 		if (curRegPitch != prevRegPitch) {
 			// calculate note and pitchAdjust
 			std::pair<int, int> noteAndPitchAdjust = gbPitch2noteAndPitch(curRegPitch);
 			// insert pitch bend
-			smfInsertPitchBend(midiFile, regWriteMidiTime, channel, channel, noteAndPitchAdjust.second);
-			int prevMidiNote = curPlayingMidiNote[channel]; // TODO: just pass curPlayingMidiNote[channel] as an argument (as a modifiable reference), instead of passing the whole array?
+			insertPitchBend(state, regWriteMidiTime, channel, noteAndPitchAdjust.second);
+			int prevMidiNote = state.curPlayingMidiNote[channel];
 			if (noteAndPitchAdjust.first != prevMidiNote) {
-				insertNoteIntoMidi(noteAndPitchAdjust.first, channel, curPlayingMidiNote, regWriteMidiTime, midiFile, prevRegPitch);
+				insertNoteIntoMidi(state, noteAndPitchAdjust.first, channel, regWriteMidiTime, prevRegPitch);
 				//printf("noteAndPitchAdjust.first == curPlayingMidiNote[channel]: %d\n", noteAndPitchAdjust.first == curPlayingMidiNote[channel]); // after insertNoteIntoMidi() runs, these should be equal
-				if (chanLegato==false) {
-					smfInsertControl(midiFile, regWriteMidiTime, channel, channel, 68, 0x7F);
-					chanLegato=true;
+				if (state.legatoState[channel]==false) {
+					insertControl(state, regWriteMidiTime, channel, 68, 0x7F);
+					state.legatoState[channel]=true;
 				}
 			}
 		}
 	}
 }
-static void handlePitchLSB(const uint8_t inRegWriteVal, gb_chip_state::melodic_channels* chanState, const uint8_t channel, const uint64_t& regWriteMidiTime, Smf* midiFile, std::array<uint8_t,4>& curPlayingMidiNote, bool& chanLegato){
-	bool isPitchValid = chanState->pitchMSB.second; // we know that pitchLSB is valid because it's being written to right now.
-	
-	uint16_t curRegPitch = combinePitch(chanState->pitchMSB.first, inRegWriteVal);
-	uint16_t prevRegPitch = chanState->getPitch();
-	handlePitchBend(curRegPitch, prevRegPitch, isPitchValid, midiFile, regWriteMidiTime, channel, curPlayingMidiNote, chanLegato);
-	chanState->pitchLSB = std::make_pair(inRegWriteVal, true);
-}
-static void handlePitchMSBtriggerSoundLenEnable(const uint8_t inRegWriteVal, gb_chip_state::base_chan_class* chanState, const uint8_t channel, const uint64_t& regWriteMidiTime, Smf* midiFile, std::array<uint8_t,4>& curPlayingMidiNote, bool& chanLegato, std::array<uint64_t,4>& scheduledSoundLenEndTime){
-	std::vector<std::pair<uint8_t, bool>*> propertyVector = {&(chanState->sound_length_enable)};
-	std::vector<std::pair<uint8_t, uint8_t>> bitRangeVector = {std::make_pair(6,6)};
-	std::vector<uint8_t> midiCCvector = {14};
-	handleCommonRegWrite(inRegWriteVal, propertyVector, bitRangeVector, midiCCvector, channel, regWriteMidiTime, midiFile);
-	
+
+// register write handlers. Each one is instantiated per channel where the channels share a register layout, so the channel and the type of its state are known at compile time.
+static void handleSweep(conversion_state& state, const gb_reg_write& regWrite, const uint64_t regWriteMidiTime){ // NR10
+	gb_chip_state::square_1& chanState = state.apu.gb_square1_state;
+	handleCommonRegWrite(regWrite.value, {&(chanState.sweep_speed), &(chanState.sweep_up_or_down), &(chanState.sweep_shift)}, {std::make_pair(6,4), std::make_pair(3,3), std::make_pair(2,0)}, {16, 18, 17}, 0, regWriteMidiTime, state); // handles simple regValue -> midi CC conversions
+}
+template<int CHANNEL> static void handleSqDutyAndSoundLen(conversion_state& state, const gb_reg_write& regWrite, const uint64_t regWriteMidiTime){ // NR11, NR21
+	gb_chip_state::square_channels& chanState = channelState<CHANNEL>(state.apu);
+	handleCommonRegWrite(regWrite.value, {&(chanState.duty_cycle), &(chanState.sound_length)}, {std::make_pair(7,6), std::make_pair(5,0)}, {19, 15}, CHANNEL, regWriteMidiTime, state);
+}
+template<int CHANNEL> static void handleEnv(conversion_state& state, const gb_reg_write& regWrite, const uint64_t regWriteMidiTime){ // NR12, NR22, NR42
+	gb_chip_state::channels_with_env& chanState = channelState<CHANNEL>(state.apu);
+	handleCommonRegWrite(regWrite.value, {&(chanState.env_start_vol), &(chanState.env_down_or_up), &(chanState.env_length)}, {std::make_pair(7,4), std::make_pair(3,3), std::make_pair(2,0)}, {SMF_CONTROL_VOLUME, 12, 13}, CHANNEL, regWriteMidiTime, state);
+}
+template<int CHANNEL> static void handlePitchLSB(conversion_state& state, const gb_reg_write& regWrite, const uint64_t regWriteMidiTime){ // NR13, NR23, NR33
+	gb_chip_state::melodic_channels& chanState = channelState<CHANNEL>(state.apu);
+	bool isPitchValid = chanState.pitchMSB.second; // we know that pitchLSB is valid because it's being written to right now.
+
+	uint16_t curRegPitch = combinePitch(chanState.pitchMSB.first, regWrite.value);
+	uint16_t prevRegPitch = chanState.getPitch();
+	handlePitchBend(state, curRegPitch, prevRegPitch, isPitchValid, regWriteMidiTime, CHANNEL);
+	chanState.pitchLSB = std::make_pair(regWrite.value, true);
+}
+template<int CHANNEL> static void handlePitchMSBtriggerSoundLenEnable(conversion_state& state, const gb_reg_write& regWrite, const uint64_t regWriteMidiTime){ // NR14, NR24, NR34, NR44. Skips handling pitchMSB if the channel is noise.
+	auto& chanState = channelState<CHANNEL>(state.apu);
+	const uint8_t inRegWriteVal = regWrite.value;
+	handleCommonRegWrite(inRegWriteVal, {&(chanState.sound_length_enable)}, {std::make_pair(6,6)}, {14}, CHANNEL, regWriteMidiTime, state);
+
 	uint8_t trigger = extractBitValueFromByte(inRegWriteVal, 7, 7);
 	uint8_t pitchMSB=0;
 	uint16_t curRegPitch=0;
-	
+
 	bool isPitchValid = false;
-	if (channel!=3) {
-		isPitchValid = dynamic_cast<gb_chip_state::melodic_channels*>(chanState)->pitchLSB.second; // we know that pitchMSB is valid because it's being written to right now.
+	if constexpr (CHANNEL != 3) {
+		isPitchValid = chanState.pitchLSB.second; // we know that pitchMSB is valid because it's being written to right now.
 		pitchMSB = extractBitValueFromByte(inRegWriteVal, 2, 0);
-		curRegPitch = combinePitch(pitchMSB, dynamic_cast<gb_chip_state::melodic_channels*>(chanState)->pitchLSB.first);
+		curRegPitch = combinePitch(pitchMSB, chanState.pitchLSB.first);
 	} else {
-		curRegPitch = dynamic_cast<gb_chip_state::noise*>(chanState)->noise_pitch.first;
+		curRegPitch = chanState.noise_pitch.first;
 	}
-	
+
 	if (trigger==1){
 		// set scheduledSoundLenEndTime
-		if (chanState->sound_length_enable.first && chanState->sound_length_enable.second && chanState->sound_length.second) {
-			scheduledSoundLenEndTime[channel] = regWriteMidiTime + ((channel == 2 ? 256 : 64) - chanState->sound_length.first) * midiTicksPerSoundLenTick; // in the main loop, check scheduledSoundLenEndTime for all channels and see if any of them are in the past compared to regWriteMidiTime. If yes, insert a noteOff at that scheduledSoundLenEndTime. It should be okay to insert midi events at any time in any order.
+		if (chanState.sound_length_enable.first && chanState.sound_length_enable.second && chanState.sound_length.second) {
+			state.scheduledSoundLenEndTime[CHANNEL] = regWriteMidiTime + ((CHANNEL == 2 ? 256 : 64) - chanState.sound_length.first) * state.midiTicksPerSoundLenTick; // in the main loop, check scheduledSoundLenEndTime for all channels and see if any of them are in the past compared to regWriteMidiTime. If yes, insert a noteOff at that scheduledSoundLenEndTime. It should be okay to insert midi events at any time in any order.
 			// if a note retriggers before its scheduledSoundLenEndTime arrives, that scheduledSoundLenEndTime will be overwritten, thus a channel will only do a note off if it actually reaches its scheduledSoundLenEndTime without retriggering.
 		}
-		
-		if (chanLegato==true) {
-			smfInsertControl(midiFile, regWriteMidiTime, channel, channel, 68, 0);
-			chanLegato=false;
+
+		if (state.legatoState[CHANNEL]==true) {
+			insertControl(state, regWriteMidiTime, CHANNEL, 68, 0);
+			state.legatoState[CHANNEL]=false;
 		}
 		// end previous note
 		// insert note
 		int note=0;
 		uint16_t prevRegPitch = 0;
-		if (channel!=3) {
+		if constexpr (CHANNEL != 3) {
 			std::pair<int, int> noteAndPitchAdjust;
 			noteAndPitchAdjust = gbPitch2noteAndPitch(curRegPitch);
-			smfInsertPitchBend(midiFile, regWriteMidiTime, channel, channel, noteAndPitchAdjust.second);
+			insertPitchBend(state, regWriteMidiTime, CHANNEL, noteAndPitchAdjust.second);
 			note = noteAndPitchAdjust.first;
-			prevRegPitch = dynamic_cast<gb_chip_state::melodic_channels*>(chanState)->getPitch();
+			prevRegPitch = chanState.getPitch();
 		} else {
 			note = noisePitch2note((uint8_t)curRegPitch);
 			prevRegPitch = curRegPitch;
 		}
-		insertNoteIntoMidi(note, channel, curPlayingMidiNote, regWriteMidiTime, midiFile, prevRegPitch);
+		insertNoteIntoMidi(state, note, CHANNEL, regWriteMidiTime, prevRegPitch);
 	} else {
-		if (channel!=3) {
-			uint16_t prevRegPitch = dynamic_cast<gb_chip_state::melodic_channels*>(chanState)->getPitch();
-			handlePitchBend(curRegPitch, prevRegPitch, isPitchValid, midiFile, regWriteMidiTime, channel, curPlayingMidiNote, chanLegato);
+		if constexpr (CHANNEL != 3) {
+			uint16_t prevRegPitch = chanState.getPitch();
+			handlePitchBend(state, curRegPitch, prevRegPitch, isPitchValid, regWriteMidiTime, CHANNEL);
+		}
+	}
+	if constexpr (CHANNEL != 3) chanState.pitchMSB = std::make_pair(pitchMSB, true);
+}
+static void insertWavetableIndex(conversion_state& state, const uint64_t midiTime, const uint16_t wavetableIndex){ // CC21 and CC53 select an entry of the wavetable sysex
+	// NOTE: This change is incompatible with previous midis made for Nelly GB
+	uint8_t wavetableIndexMSB = (wavetableIndex & 0b11111110000000) >> 7;
+	uint8_t wavetableIndexLSB = wavetableIndex & 0x7F;
+	insertControl(state, midiTime, 2, 21, wavetableIndexMSB);
+	insertControl(state, midiTime, 2, 53, wavetableIndexLSB);
+}
+static void handleWaveDAC(conversion_state& state, const gb_reg_write& regWrite, const uint64_t regWriteMidiTime){ // NR30
+	gb_chip_state::wave& waveState = state.apu.gb_wave_state;
+	uint8_t curWavDAC = extractBitValueFromByte(regWrite.value, 7, 7);
+	if (waveState.DAC_off_on.first == 0 && curWavDAC == 1 /* && waveState.DAC_off_on.second*/) { // if the DAC was previously off and is now being turned on
+		// push waveState.wavetable to uniqueWavetables
+		std::vector<std::array<std::pair<uint8_t,bool>, 32>>& uniqueWavetables = state.uniqueWavetables;
+		auto wavetableIt = std::find(uniqueWavetables.begin(), uniqueWavetables.end(), waveState.wavetable.first);
+		if (wavetableIt == uniqueWavetables.end()) { // element is not in vector
+			uniqueWavetables.push_back(waveState.wavetable.first);
+			wavetableIt = uniqueWavetables.end() - 1;
+		}
+		// add index of current wave to CC21 at regWriteMidiTime
+		uint16_t wavetableIndex = std::distance(uniqueWavetables.begin(), wavetableIt);
+		if (wavetableIndex != state.prevWavetableIndex) {
+			insertWavetableIndex(state, regWriteMidiTime, wavetableIndex);
+			state.prevWavetableIndex = wavetableIndex;
 		}
 	}
-	if (channel!=3) dynamic_cast<gb_chip_state::melodic_channels*>(chanState)->pitchMSB = std::make_pair(pitchMSB, true);
+	waveState.DAC_off_on = std::make_pair(curWavDAC, true);
+}
+static void handleWaveSoundLen(conversion_state& state, const gb_reg_write& regWrite, const uint64_t regWriteMidiTime){ // NR31
+	handleCommonRegWrite(regWrite.value, {&(state.apu.gb_wave_state.sound_length)}, {std::make_pair(7,0)}, {15}, 2, regWriteMidiTime, state);
+}
+static const std::array<uint8_t,4> MIDI_WAVE_VOLUME = {0, 127, 64, 32}; // 0%, 100%, 50%, 25%
+static void handleWaveVolume(conversion_state& state, const gb_reg_write& regWrite, const uint64_t regWriteMidiTime){ // NR32
+	gb_chip_state::wave& waveState = state.apu.gb_wave_state;
+	uint8_t curWaveVol = (regWrite.value & 0x60) >> 5;
+	if (curWaveVol != waveState.volume.first || waveState.volume.second == false){
+		insertControl(state, regWriteMidiTime, 2, SMF_CONTROL_VOLUME, MIDI_WAVE_VOLUME[curWaveVol]);
+	}
+	waveState.volume = std::make_pair(curWaveVol, true);
+}
+static void handleNoiseSoundLen(conversion_state& state, const gb_reg_write& regWrite, const uint64_t regWriteMidiTime){ // NR41
+	handleCommonRegWrite(regWrite.value, {&(state.apu.gb_noise_state.sound_length)}, {std::make_pair(5,0)}, {15}, 3, regWriteMidiTime, state);
+}
+static void handleNoisePitch(conversion_state& state, const gb_reg_write& regWrite, const uint64_t regWriteMidiTime){ // NR43
+	handleCommonRegWrite(regWrite.value, {&(state.apu.gb_noise_state.noise_long_or_short)}, {std::make_pair(3,3)}, {20}, 3, regWriteMidiTime, state);
+	state.apu.gb_noise_state.noise_pitch = std::make_pair(regWrite.value & 0xF7, true); // noise pitch only takes effect when the channel is triggered.
+}
+static uint8_t panning2midiPan(uint8_t panningRegVal){ // 0b10 is left, 0b01 is right, and 0b11 is center. 0 (muted) is sent as CC9 instead.
+	uint8_t midiPan=0;
+	switch (panningRegVal){
+		case 0b01:
+			midiPan=0x7F;
+			break;
+		case 0b10:
+			midiPan=0;
+			break;
+		case 0b11:
+			midiPan=64;
+			break;
+	}
+	return midiPan;
 }
-static void handlePanning(gb_chip_state* curAPUstate, const uint8_t inRegWriteVal, Smf* midiFile, const uint64_t& regWriteMidiTime){
-	std::vector<gb_chip_state::base_chan_class*> channelPointerVector = {&(curAPUstate->gb_square1_state), &(curAPUstate->gb_square2_state), &(curAPUstate->gb_wave_state), &(curAPUstate->gb_noise_state)};
+static void handlePanning(conversion_state& state, const gb_reg_write& regWrite, const uint64_t regWriteMidiTime){ // NR51
+	const std::array<gb_chip_state::base_chan_class*,4> channelPointerVector = {&(state.apu.gb_square1_state), &(state.apu.gb_square2_state), &(state.apu.gb_wave_state), &(state.apu.gb_noise_state)};
 	for (int i=0; i<4; i++){
-		uint8_t panningRegVal = ((inRegWriteVal >> (3+i)) & 0b10) | ((inRegWriteVal >> i) & 0b01);
+		uint8_t panningRegVal = ((regWrite.value >> (3+i)) & 0b10) | ((regWrite.value >> i) & 0b01);
 		if (panningRegVal != channelPointerVector[i]->panning.first || channelPointerVector[i]->panning.second == false) {
 			if (panningRegVal == 0) {
-				smfInsertControl(midiFile, regWriteMidiTime, i, i, 9, 0x7F); // pan mute on
+				insertControl(state, regWriteMidiTime, i, 9, 0x7F); // pan mute on
 			} else if (panningRegVal != 0) {
 				if (channelPointerVector[i]->panning.first == 0 || channelPointerVector[i]->panning.second == false)
-					smfInsertControl(midiFile, regWriteMidiTime, i, i, 9, 0); // pan mute off
-				uint8_t midiPan=0;
-				switch (panningRegVal){
-					case 0b01:
-						midiPan=0x7F;
-						break;
-					case 0b10:
-						midiPan=0;
-						break;
-					case 0b11:
-						midiPan=64;
-						break;
-				}
-				smfInsertControl(midiFile, regWriteMidiTime, i, i, SMF_CONTROL_PANPOT, midiPan);
+					insertControl(state, regWriteMidiTime, i, 9, 0); // pan mute off
+				insertControl(state, regWriteMidiTime, i, SMF_CONTROL_PANPOT, panning2midiPan(panningRegVal));
 			}
 		}
 		channelPointerVector[i]->panning = std::make_pair(panningRegVal, true);
 	}
 }
-bool songData2midi(std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, std::string outfilename, int inPPQN){
-	auto start = std::chrono::high_resolution_clock::now();
-	
-	std::vector<uint8_t> tempNoisePitchList;
-	for (int16_t noisePitch=0xF7; noisePitch >= 0; noisePitch--){ // the list should be written backwards because lower values tend to be higher pitched. 0xF7 is 0b11110111.
-		if ((noisePitch & 8) == 0) {
-			tempNoisePitchList.push_back(noisePitch);
+static void handleWaveRAM(conversion_state& state, const gb_reg_write& regWrite, const uint64_t /*regWriteMidiTime*/){ // 0xFF30-0xFF3F
+	gb_chip_state::wave& waveState = state.apu.gb_wave_state;
+	if (waveState.DAC_off_on.first == 0 /*&& waveState.DAC_off_on.second*/) {
+		uint8_t regWriteWaveIndex = (uint8_t)((regWrite.address - 0x30)*2);
+		waveState.wavetable.first[regWriteWaveIndex].first = (regWrite.value & 0xF0) >> 4;
+		waveState.wavetable.first[regWriteWaveIndex].second = true;
+		waveState.wavetable.first[regWriteWaveIndex+1].first = regWrite.value & 0xF;
+		waveState.wavetable.first[regWriteWaveIndex+1].second = true;
+	}
+}
+
+// indexed by gb_reg_write::address, i.e. the register address minus 0xFF00
+static constexpr std::array<register_class, 0x100> makeRegisterClasses(){
+	std::array<register_class, 0x100> classes{};
+	// square 1
+	classes[0x10] = {handleSweep, 0, REGISTER_SLOT_NRx0};
+	classes[0x11] = {handleSqDutyAndSoundLen<0>, 0, REGISTER_SLOT_NRx1};
+	classes[0x12] = {handleEnv<0>, 0, REGISTER_SLOT_NRx2};
+	classes[0x13] = {handlePitchLSB<0>, 0, REGISTER_SLOT_NRx3};
+	classes[0x14] = {handlePitchMSBtriggerSoundLenEnable<0>, 0, REGISTER_SLOT_NRx4};
+	// square 2. 0xFF15 is unused.
+	classes[0x15] = {nullptr, 1, REGISTER_SLOT_NRx0};
+	classes[0x16] = {handleSqDutyAndSoundLen<1>, 1, REGISTER_SLOT_NRx1};
+	classes[0x17] = {handleEnv<1>, 1, REGISTER_SLOT_NRx2};
+	classes[0x18] = {handlePitchLSB<1>, 1, REGISTER_SLOT_NRx3};
+	classes[0x19] = {handlePitchMSBtriggerSoundLenEnable<1>, 1, REGISTER_SLOT_NRx4};
+	// wave
+	classes[0x1A] = {handleWaveDAC, 2, REGISTER_SLOT_NRx0};
+	classes[0x1B] = {handleWaveSoundLen, 2, REGISTER_SLOT_NRx1};
+	classes[0x1C] = {handleWaveVolume, 2, REGISTER_SLOT_NRx2};
+	classes[0x1D] = {handlePitchLSB<2>, 2, REGISTER_SLOT_NRx3};
+	classes[0x1E] = {handlePitchMSBtriggerSoundLenEnable<2>, 2, REGISTER_SLOT_NRx4};
+	// noise. 0xFF1F is unused.
+	classes[0x1F] = {nullptr, 3, REGISTER_SLOT_NRx0};
+	classes[0x20] = {handleNoiseSoundLen, 3, REGISTER_SLOT_NRx1};
+	classes[0x21] = {handleEnv<3>, 3, REGISTER_SLOT_NRx2};
+	classes[0x22] = {handleNoisePitch, 3, REGISTER_SLOT_NRx3};
+	classes[0x23] = {handlePitchMSBtriggerSoundLenEnable<3>, 3, REGISTER_SLOT_NRx4};
+	// control. NR50 (master volume) and NR52 (sound on/off) aren't converted.
+	classes[0x24] = {nullptr, 0xFF, REGISTER_SLOT_CONTROL};
+	classes[0x25] = {handlePanning, 0xFF, REGISTER_SLOT_CONTROL};
+	classes[0x26] = {nullptr, 0xFF, REGISTER_SLOT_CONTROL};
+	// wave table
+	for (int address=0x30; address<0x40; address++) classes[address] = {handleWaveRAM, 2, REGISTER_SLOT_WAVE_RAM};
+	return classes;
+}
+static constexpr std::array<register_class, 0x100> REGISTER_CLASSES = makeRegisterClasses();
+
+static void insertNoteIntoMidi(conversion_state& state, const uint8_t newNote, const uint8_t channel, const uint64_t regWriteMidiTime, const uint16_t prevRegPitch){ // ends the currently playing note and inserts a new note.
+	const std::vector<gb_reg_write>& songData = state.songData;
+	bool doNotInsertNote = false;
+	for (size_t i = state.regWriteI + 1; i < songData.size(); i++){ // if any of the upcoming regWrites both happen at the same time as this one AND would also cause a note to be inserted, don't do anything yet. This is necessary in order to prevent accidentally inserting long, overlapping notes into the midi. BUG: because this only keeps certain notes, this has produced a new bug where sometimes the "wrong" notes will be preserved and the song sounds off. HOWEVER, this only seems to be an issue when the PPQN is low.
+		if (state.regWriteMidiTimes[i] != regWriteMidiTime)
+			break;
+		const register_class& nextRegClass = REGISTER_CLASSES[songData[i].address];
+		if (nextRegClass.channel == channel && (nextRegClass.slot == REGISTER_SLOT_NRx3 || nextRegClass.slot == REGISTER_SLOT_NRx4)) {
+			uint16_t nextRegPitch = 0;
+			uint8_t nextTrigger=0;
+			if (channel != 3){ // simply checking if the next regWrite would change pitch is not enough. I need to check if it would actually change the midi note.
+				if (nextRegClass.slot == REGISTER_SLOT_NRx3) {
+					nextRegPitch = combinePitch((prevRegPitch & 0b11100000000) >> 8, songData[i].value);
+				} else {
+					nextRegPitch = combinePitch(songData[i].value & 0b111, prevRegPitch & 0xFF);
+					nextTrigger = songData[i].value & 0b10000000;
+				}
+				uint8_t nextMidiNote = gbPitch2noteAndPitch(nextRegPitch).first;
+				if (nextMidiNote != state.curPlayingMidiNote[channel] || nextTrigger){
+					doNotInsertNote = true;
+				}
+			} else {
+				doNotInsertNote = true; // TODO: TEST
+			}
+			break;
 		}
 	}
-	NOISE_PITCH_LIST = tempNoisePitchList;
-	
-	songDataPointer = &songData;
-	
+	if (doNotInsertNote == false) {
+		if (state.curPlayingMidiNote[channel] != 0xFF){ // a note is playing
+			// end the currently playing note
+			insertNoteOff(state, regWriteMidiTime, channel, state.curPlayingMidiNote[channel]);
+		}
+		// insert new note
+		insertNoteOn(state, regWriteMidiTime, channel, newNote);
+		state.curPlayingMidiNote[channel] = newNote; // a new note has started. Put it in the array to keep track of it.
+	}
+}
+uint64_t midiTicksPerSecondFromPPQN(int PPQN){
 	const int SECONDS_IN_A_MINUTE=60;
 	const int MIDI_BPM=120;
+	return (float)PPQN * ((float)MIDI_BPM / SECONDS_IN_A_MINUTE);
+}
+double midiTicksPerSecondAtBPM(int PPQN, double BPM){
+	const int microsecondsPerQuarterNote = 60000000 / BPM; // truncated the same way as in smfInsertTempoBPM
+	return (double)PPQN * 1000000 / microsecondsPerQuarterNote;
+}
+uint64_t midiTicksPerSoundLenTickFromTicksPerSecond(double midiTicksPerSecond){
+	return round((float)midiTicksPerSecond / 256);
+}
+static void convertRegWrite(conversion_state& state){ // handles state.songData[state.regWriteI]
+	const gb_reg_write& regWrite = state.songData[state.regWriteI];
+	ALLOC_STATS_REGISTER(regWrite.address);
+	const uint64_t regWriteMidiTime = state.regWriteMidiTimes[state.regWriteI];
+
+	for (int i=0; i<4; i++){
+		if (state.scheduledSoundLenEndTime[i] <= regWriteMidiTime && state.soundLengthEnable[i]->first == true){
+			if (state.curPlayingMidiNote[i]!=0xFF) {
+				insertNoteOff(state, regWriteMidiTime, i, state.curPlayingMidiNote[i]);
+				state.curPlayingMidiNote[i] = 0xFF;
+			}
+		}
+	}
+
+	const register_class& regClass = REGISTER_CLASSES[regWrite.address]; // channel, register slot and handler in one lookup
+	if (regClass.handler) regClass.handler(state, regWrite, regWriteMidiTime);
+	if (regWriteMidiTime > state.midiTicksPassed) state.midiTicksPassed = regWriteMidiTime;
+}
+static std::vector<uint8_t> wavetableSysex(const conversion_checkpoint& state){ // every wavetable found so far, in the order CC21/CC53 index them
+	const std::vector<std::array<std::pair<uint8_t,bool>, 32>>& uniqueWavetables = state.uniqueWavetables;
+	unsigned int sysexDataSize = 2 /* start and end bytes */ + 32 * uniqueWavetables.size();
+	std::vector<uint8_t> sysexData(sysexDataSize);
+	sysexData[0]=0xF0;
+	unsigned int sysexWaveIndex=0;
+	for (const std::array<std::pair<uint8_t,bool>, 32>& curWavetable : uniqueWavetables) {
+		for (int i=0; i<32; i++){
+			sysexData[1+sysexWaveIndex*32+i] = curWavetable[i].first & 0x0F; // DO NOT convert wave back to gb format. leave each 4-bit sample in its own byte so that the data can never accidentally match the sysex end byte 0xF7
+		}
+		sysexWaveIndex++;
+	}
+	sysexData[sysexDataSize-1]=0xF7;
+	return sysexData;
+}
+static std::vector<uint8_t> singleWavetableSysex(const std::array<std::pair<uint8_t,bool>, 32>& wavetable, uint16_t wavetableIndex){ // one wavetable and its index, for live mode
+	std::vector<uint8_t> sysexData;
+	sysexData.reserve(2 /* start and end bytes */ + 2 + 32);
+	sysexData.push_back(0xF0);
+	sysexData.push_back((wavetableIndex >> 7) & 0x7F);
+	sysexData.push_back(wavetableIndex & 0x7F);
+	for (int i=0; i<32; i++) sysexData.push_back(wavetable[i].first & 0x0F);
+	sysexData.push_back(0xF7);
+	return sysexData;
+}
+static Smf* createSmf(int inPPQN, double BPM = DEFAULT_MIDI_BPM){
 	//const double DENSITY_ADJUST = 1; // ((double)1/(32));
 	//const int MIDI_PPQN = round((double)0x7fff * DENSITY_ADJUST);
 	const int MIDI_PPQN = inPPQN ? inPPQN : 0x7fff;
 	//const int MIDI_PPQN=99;
 	Smf* midiFile = smfCreate();
 	smfSetTimebase(midiFile, MIDI_PPQN); // timebase should be high to make adjusting the song easy.
-	const uint64_t midiTicksPerSecond = (float)MIDI_PPQN * ((float)MIDI_BPM / SECONDS_IN_A_MINUTE);
-	printf("midiTicksPerSecond: %lu\n", midiTicksPerSecond);
-	printf("gbTimeUnitsPerSecond: %u\n", gbTimeUnitsPerSecond);
-	midiTicksPerSoundLenTick = round((float)midiTicksPerSecond / 256);
-	
-	midiTicksPerSecondPointer = &midiTicksPerSecond;
-	gbTimeUnitsPerSecondPointer = &gbTimeUnitsPerSecond;
-	
-	std::vector<std::array<std::pair<uint8_t,bool>, 32>> uniqueWavetables;
-	
+	if (BPM != DEFAULT_MIDI_BPM) smfInsertTempoBPM(midiFile, 0, 0, BPM); // inserted first, so it comes before every other event of the first track
+	return midiFile;
+}
+static void finishSmf(Smf* midiFile, size_t regWritesConverted, const conversion_checkpoint& finalState, run_metrics* metrics){ // called once every write has been converted
+	// add wavetables to midi.
+	const std::vector<uint8_t> sysexData = wavetableSysex(finalState);
+	smfInsertSysex(midiFile, 0 /* time */, 0 /* port */, 2 /* wave track */, sysexData.data(), sysexData.size());
+	const uint64_t midiTicksPassed = finalState.midiTicksPassed;
+
+	smfSetEndTimingOfTrack(midiFile, 0, midiTicksPassed);
+	smfSetEndTimingOfTrack(midiFile, 1, midiTicksPassed);
+	smfSetEndTimingOfTrack(midiFile, 2, midiTicksPassed);
+	smfSetEndTimingOfTrack(midiFile, 3, midiTicksPassed);
+
+	if (metrics) {
+		metrics->regWritesProcessed = regWritesConverted;
+		metrics->uniqueWavetables = finalState.uniqueWavetables.size();
+	}
+}
+Smf* songData2smf(std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, int inPPQN, run_metrics* metrics, double BPM){
+	ALLOC_STATS_STAGE(ALLOC_STAGE_CONVERT);
+
+	Smf* midiFile = createSmf(inPPQN, BPM);
+	const double midiTicksPerSecond = midiTicksPerSecondAtBPM(inPPQN ? inPPQN : 0x7fff, BPM);
+	std::vector<uint64_t> regWriteMidiTimes;
+	gbTimes2midiTimes(songData, gbTimeUnitsPerSecond, midiTicksPerSecond, regWriteMidiTimes);
+
+	conversion_state state(songData, regWriteMidiTimes, gbTimeUnitsPerSecond, midiTicksPerSecond, midiFile);
+
 	//for (int i=0; i<4; i++){
 	//	smfInsertControl(midiFile, 0, i, i, SMF_CONTROL_VOLUME, 0); // prevent garbage noise from playing
 	//}
-		
-	gb_chip_state curAPUstate; // whenever a register write is encountered, it will converted to a midi event and then written here. Used to compare the current register write to the previous state.
-	
-	std::array<uint8_t,4> curPlayingMidiNote = {0xFF, 0xFF, 0xFF, 0xFF}; // The note number of the midi note that is currently playing. One entry for each channel. Used to end the current note, whatever it is. 0xFF means no notes are currently playing.
-	std::array<bool,4> legatoState = {false, false, false, false}; // legato mode is turned on whenever the GB does a pitch bend without retriggering the note, but the pitch bend goes beyond the range of a midi note. Legato mode means that when the Plugin is reading back the midi, it should read new notes as pitch changes with no trigger.
-	
-	//uint8_t prevWavetableIndex=0xFF; // TODO: change waveTable index from a 7-bit CC to a 14-bit CC (Combine CC21 and CC53).
-	uint16_t prevWavetableIndex = 0xFFFF;
 
-	uint64_t midiTicksPassed=0;
-	//std::array<bool,4> isDACon={true,true,true,true};
-	std::array<uint64_t,4> scheduledSoundLenEndTime={0,0,0,0}; // time when a note's sound length should run out in midi ticks (relative to the start of the song)
-	for (int regWriteI=0; regWriteI<songData.size(); regWriteI++){
-		regWriteIpointer = &regWriteI;
-		
-		uint16_t registerIndex = songData[regWriteI].address + 0xff00; // TODO: remove " + 0xff00". For now, I'm putting it here for testing; I don't want to rewrite all the case conditions yet.
-		uint8_t registerValue = songData[regWriteI].value;
-		
-		uint8_t regWriteWaveIndex;
-		uint64_t regWriteMidiTime = gbTime2midiTime(songData[regWriteI].time, gbTimeUnitsPerSecond, midiTicksPerSecond);
-		
-		// variables for this switch case.
-		std::vector<std::pair<uint8_t, bool>*> propertyVector;
-		std::vector<std::pair<uint8_t, uint8_t>> bitRangeVector;
-		std::vector<uint8_t> midiCCvector;
-		uint8_t channel=0;
-		channel = (uint8_t)floor((songData[regWriteI].address - 0x10) / (float)0x5);
-		if (channel > 3) channel = 0xFF;
-		
-		propertyVector = {&(curAPUstate.gb_square1_state.sound_length_enable), &(curAPUstate.gb_square2_state.sound_length_enable), &(curAPUstate.gb_wave_state.sound_length_enable), &(curAPUstate.gb_noise_state.sound_length_enable)};
-		for (int i=0; i<4; i++){
-			if (scheduledSoundLenEndTime[i] <= regWriteMidiTime && propertyVector[i]->first == true){
-				if (curPlayingMidiNote[i]!=0xFF) {
-					smfInsertNoteOff(midiFile, regWriteMidiTime, i, i, curPlayingMidiNote[i], 0x7F);
-					curPlayingMidiNote[i] = 0xFF;
-				}
+	for (state.regWriteI=0; state.regWriteI<songData.size(); state.regWriteI++){
+		convertRegWrite(state);
+	}
+	finishSmf(midiFile, songData.size(), state, metrics);
+	return midiFile;
+}
+void songData2stats(const std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, int inPPQN, run_metrics& metrics){
+	ALLOC_STATS_STAGE(ALLOC_STAGE_CONVERT);
+
+	const uint64_t midiTicksPerSecond = midiTicksPerSecondFromPPQN(inPPQN ? inPPQN : 0x7fff);
+	std::vector<uint64_t> regWriteMidiTimes;
+	gbTimes2midiTimes(songData, gbTimeUnitsPerSecond, midiTicksPerSecond, regWriteMidiTimes);
+
+	dry_run_counter counter(metrics, midiTicksPerSecond);
+	conversion_state state(songData, regWriteMidiTimes, gbTimeUnitsPerSecond, midiTicksPerSecond, nullptr);
+	state.dryRun = &counter;
+	for (state.regWriteI=0; state.regWriteI<songData.size(); state.regWriteI++){
+		convertRegWrite(state);
+	}
+	counter.finish(2 /* F0 and F7 */ + 32 * state.uniqueWavetables.size(), state.midiTicksPassed);
+	metrics.dryRun = true;
+	metrics.songSeconds = (double)state.midiTicksPassed / midiTicksPerSecond;
+	metrics.regWritesProcessed = songData.size();
+	metrics.uniqueWavetables = state.uniqueWavetables.size();
+}
+Smf* songData2smfParallel(std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, int inPPQN, run_metrics* metrics, unsigned int threadCount, double BPM){
+	ALLOC_STATS_STAGE(ALLOC_STAGE_CONVERT);
+	const size_t MIN_SHARD_SIZE = 1 << 16; // writes. Below this, starting a thread costs more than converting the shard.
+	if (threadCount == 0) threadCount = std::max(1u, std::thread::hardware_concurrency());
+	const size_t shardCount = std::min<size_t>(threadCount, songData.size() / MIN_SHARD_SIZE + 1);
+	if (shardCount == 1) return songData2smf(songData, gbTimeUnitsPerSecond, inPPQN, metrics, BPM);
+
+	Smf* midiFile = createSmf(inPPQN, BPM);
+	const double midiTicksPerSecond = midiTicksPerSecondAtBPM(inPPQN ? inPPQN : 0x7fff, BPM);
+	std::vector<uint64_t> regWriteMidiTimes;
+	gbTimes2midiTimes(songData, gbTimeUnitsPerSecond, midiTicksPerSecond, regWriteMidiTimes);
+	// every shard but the first starts at the first write of a midi tick. Every event is made at the tick of the write that caused it, so each shard's events all come after the previous shard's, and the same-tick lookahead never has to look into the next shard.
+	std::vector<size_t> shardStarts(shardCount + 1, songData.size());
+	shardStarts[0] = 0;
+	for (size_t shard=1; shard < shardCount; shard++) {
+		size_t start = std::max(songData.size() / shardCount * shard, shardStarts[shard-1]);
+		while (start > 0 && start < songData.size() && regWriteMidiTimes[start] == regWriteMidiTimes[start-1]) start++;
+		shardStarts[shard] = start;
+	}
+
+	// 1. the writes before the last shard are replayed without making any events, and the state at the start of each shard is kept
+	std::vector<conversion_checkpoint> checkpoints(shardCount);
+	{
+		conversion_state replayState(songData, regWriteMidiTimes, gbTimeUnitsPerSecond, midiTicksPerSecond, nullptr);
+		for (size_t shard=1; shard < shardCount; shard++) {
+			for (replayState.regWriteI = shardStarts[shard-1]; replayState.regWriteI < shardStarts[shard]; replayState.regWriteI++) {
+				convertRegWrite(replayState);
 			}
+			checkpoints[shard] = replayState;
 		}
-		
-		switch (registerIndex){
-			case 0xff10: // square 1
-				propertyVector = {&(curAPUstate.gb_square1_state.sweep_speed), &(curAPUstate.gb_square1_state.sweep_up_or_down), &(curAPUstate.gb_square1_state.sweep_shift)};
-				bitRangeVector = {std::make_pair(6,4), std::make_pair(3,3), std::make_pair(2,0)};
-				midiCCvector = {16, 18, 17};
-				handleCommonRegWrite(registerValue, propertyVector, bitRangeVector, midiCCvector, channel, regWriteMidiTime, midiFile); // handles simple regValue -> midi CC conversions
-				break;
-			case 0xff11:
-				handleSqDutyAndSoundLen(registerValue, &(curAPUstate.gb_square1_state), channel, regWriteMidiTime, midiFile); 
-				break;
-			case 0xff12:
-				handleEnv(registerValue, &(curAPUstate.gb_square1_state), channel, regWriteMidiTime, midiFile);
-				break;
-			case 0xff13:
-				//printf("curPlayingMidiNote before: %u\n", curPlayingMidiNote[channel]);
-				handlePitchLSB(registerValue, &(curAPUstate.gb_square1_state), channel, regWriteMidiTime, midiFile, curPlayingMidiNote, legatoState[channel]);
-				//printf("registerValue == curAPUstate.gb_square1_state.pitchLSB.first: %d\n", registerValue == curAPUstate.gb_square1_state.pitchLSB.first);
-				//printf("curPlayingMidiNote after: %u\n", curPlayingMidiNote[channel]);
-				break;
-			case 0xff14:
-				handlePitchMSBtriggerSoundLenEnable(registerValue, &(curAPUstate.gb_square1_state), channel, regWriteMidiTime, midiFile, curPlayingMidiNote, legatoState[channel], scheduledSoundLenEndTime); // skips handling pitchMSB if the channel is noise
-				//printf("registerValue & 0b00000111 == curAPUstate.gb_square1_state.pitchMSB.first: %d, %u, %u\n", (registerValue & 0b00000111) == curAPUstate.gb_square1_state.pitchMSB.first, registerValue & 0b00000111, curAPUstate.gb_square1_state.pitchMSB.first);
-				break;
-			case 0xff16: // square 2
-				handleSqDutyAndSoundLen(registerValue, &(curAPUstate.gb_square2_state), channel, regWriteMidiTime, midiFile);
-				break;
-			case 0xff17:
-				handleEnv(registerValue, &(curAPUstate.gb_square2_state), channel, regWriteMidiTime, midiFile);
-				break;
-			case 0xff18:
-				handlePitchLSB(registerValue, &(curAPUstate.gb_square2_state), channel, regWriteMidiTime, midiFile, curPlayingMidiNote, legatoState[channel]);
-				break;
-			case 0xff19:
-				handlePitchMSBtriggerSoundLenEnable(registerValue, &(curAPUstate.gb_square2_state), channel, regWriteMidiTime, midiFile, curPlayingMidiNote, legatoState[channel], scheduledSoundLenEndTime);
-				break;
-			case 0xff1A: // wave
-				{
-					uint8_t curWavDAC = extractBitValueFromByte(registerValue, 7, 7);
-					if (curAPUstate.gb_wave_state.DAC_off_on.first == 0 && curWavDAC == 1 /* && curAPUstate.gb_wave_state.DAC_off_on.second*/) { // if the DAC was previously off and is now being turned on
-						// push curAPUstate.gb_wave_state.wavetable to uniqueWavetables
-						if ((std::find(uniqueWavetables.begin(), uniqueWavetables.end(), curAPUstate.gb_wave_state.wavetable.first)) == uniqueWavetables.end()) // element is not in vector
-							uniqueWavetables.push_back(curAPUstate.gb_wave_state.wavetable.first);
-						// add index of current wave to CC21 at regWriteMidiTime
-						uint16_t wavetableIndex = std::distance(std::begin(uniqueWavetables), std::find(uniqueWavetables.begin(), uniqueWavetables.end(), curAPUstate.gb_wave_state.wavetable.first));
-						if (wavetableIndex != prevWavetableIndex) {
-							// NOTE: This change is incompatible with previous midis made for Nelly GB
-							uint8_t wavetableIndexMSB = (wavetableIndex & 0b11111110000000) >> 7;
-							uint8_t wavetableIndexLSB = wavetableIndex & 0x7F;
-							/*
-							printf("wavetableIndex: %04X\n", wavetableIndex);
-							printf("wavetableIndexMSB: %04X\n", wavetableIndexMSB);
-							printf("wavetableIndexLSB: %04X\n", wavetableIndexLSB);
-							*/
-							smfInsertControl(midiFile, regWriteMidiTime, 2, 2, 21, wavetableIndexMSB);
-							smfInsertControl(midiFile, regWriteMidiTime, 2, 2, 53, wavetableIndexLSB);
-							
-							prevWavetableIndex = wavetableIndex;
-						}
-					}
-					curAPUstate.gb_wave_state.DAC_off_on = std::make_pair(curWavDAC, true);
-				}
-				break;
-			case 0xff1B: 
-				propertyVector = {&(curAPUstate.gb_wave_state.sound_length)};
-				bitRangeVector = {std::make_pair(7,0)};
-				midiCCvector = {15};
-				handleCommonRegWrite(registerValue, propertyVector, bitRangeVector, midiCCvector, channel, regWriteMidiTime, midiFile);
-				break;
-			case 0xff1C:
-				{
-					uint8_t curWaveVol = (registerValue & 0x60) >> 5;
-					if (curWaveVol != curAPUstate.gb_wave_state.volume.first || curAPUstate.gb_wave_state.volume.second == false){
-						uint8_t midiWaveVol=0;
-						switch (curWaveVol){
-							case 0:
-								midiWaveVol=0;
-								break;
-							case 0b01:
-								midiWaveVol=127;
-								break;
-							case 0b10:
-								midiWaveVol=64;
-								break;
-							case 0b11:
-								midiWaveVol=32;
-								break;
-							default:
-								break;
-						}
-						smfInsertControl(midiFile, regWriteMidiTime, channel, channel, SMF_CONTROL_VOLUME, midiWaveVol);
-					}
-					curAPUstate.gb_wave_state.volume = std::make_pair(curWaveVol, true);
-				}
-				break;
-			case 0xff1D:
-				handlePitchLSB(registerValue, &(curAPUstate.gb_wave_state), channel, regWriteMidiTime, midiFile, curPlayingMidiNote, legatoState[channel]);
-				break;
-			case 0xff1E:
-				handlePitchMSBtriggerSoundLenEnable(registerValue, &(curAPUstate.gb_wave_state), channel, regWriteMidiTime, midiFile, curPlayingMidiNote, legatoState[channel], scheduledSoundLenEndTime);
-				break;
-			case 0xff20: // noise
-				propertyVector = {&(curAPUstate.gb_noise_state.sound_length)};
-				bitRangeVector = {std::make_pair(5,0)};
-				midiCCvector = {15};
-				handleCommonRegWrite(registerValue, propertyVector, bitRangeVector, midiCCvector, channel, regWriteMidiTime, midiFile);
-				break;
-			case 0xff21:
-				handleEnv(registerValue, &(curAPUstate.gb_noise_state), channel, regWriteMidiTime, midiFile);
-				break;
-			case 0xff22:
-				propertyVector = {&(curAPUstate.gb_noise_state.noise_long_or_short)};
-				bitRangeVector = {std::make_pair(3,3)};
-				midiCCvector = {20};
-				handleCommonRegWrite(registerValue, propertyVector, bitRangeVector, midiCCvector, channel, regWriteMidiTime, midiFile);
-				curAPUstate.gb_noise_state.noise_pitch = std::make_pair(registerValue & 0xF7, true); // noise pitch only takes effect when the channel is triggered.
-				break;
-			case 0xff23:
-				handlePitchMSBtriggerSoundLenEnable(registerValue, &(curAPUstate.gb_noise_state), channel, regWriteMidiTime, midiFile, curPlayingMidiNote, legatoState[channel], scheduledSoundLenEndTime);
-				break;
-			case 0xff25: // control
-				handlePanning(&(curAPUstate), registerValue, midiFile, regWriteMidiTime);
-				break;
-			case 0xff30: // wave table
-			case 0xff31:
-			case 0xff32:
-			case 0xff33:
-			case 0xff34:
-			case 0xff35:
-			case 0xff36:
-			case 0xff37:
-			case 0xff38:
-			case 0xff39:
-			case 0xff3A:
-			case 0xff3B:
-			case 0xff3C:
-			case 0xff3D:
-			case 0xff3E:
-			case 0xff3F:
-				if (curAPUstate.gb_wave_state.DAC_off_on.first == 0 /*&& curAPUstate.gb_wave_state.DAC_off_on.second*/) {
-					regWriteWaveIndex = (uint8_t)((registerIndex - 0xff30)*2);
-					curAPUstate.gb_wave_state.wavetable.first[regWriteWaveIndex].first = (registerValue & 0xF0) >> 4;
-					curAPUstate.gb_wave_state.wavetable.first[regWriteWaveIndex].second = true;
-					curAPUstate.gb_wave_state.wavetable.first[regWriteWaveIndex+1].first = registerValue & 0xF;
-					curAPUstate.gb_wave_state.wavetable.first[regWriteWaveIndex+1].second = true;
-				}
-				break;
-			default:
+	}
+	// 2. each shard is converted from its checkpoint into its own Smf, the first one straight into midiFile
+	std::vector<Smf*> shardFiles(shardCount, midiFile);
+	for (size_t shard=1; shard < shardCount; shard++) shardFiles[shard] = smfCreate();
+	conversion_checkpoint finalState;
+	auto convertShard = [&](size_t shard){
+		ALLOC_STATS_STAGE(ALLOC_STAGE_CONVERT);
+		conversion_state state(songData, regWriteMidiTimes, gbTimeUnitsPerSecond, midiTicksPerSecond, shardFiles[shard]);
+		static_cast<conversion_checkpoint&>(state) = checkpoints[shard];
+		for (state.regWriteI = shardStarts[shard]; state.regWriteI < shardStarts[shard+1]; state.regWriteI++) {
+			convertRegWrite(state);
+		}
+		if (shard == shardCount - 1) finalState = state;
+	};
+	std::vector<std::thread> threads;
+	for (size_t shard=1; shard < shardCount; shard++) threads.emplace_back(convertShard, shard);
+	convertShard(0);
+	for (std::thread& thread : threads) thread.join();
+	// 3. the shards' events are moved to the end of midiFile's tracks in order, without copying them
+	for (size_t shard=1; shard < shardCount; shard++) {
+		for (int trackIndex=0; trackIndex < shardFiles[shard]->numTracks; trackIndex++) {
+			smfMoveTrackEvents(midiFile, trackIndex, shardFiles[shard]->track[trackIndex]);
+		}
+		smfDelete(shardFiles[shard]);
+	}
+	finishSmf(midiFile, songData.size(), finalState, metrics);
+	return midiFile;
+}
+
+// the events that bring a player into the state the converter is in: every property that has been written, the selected wave table, legato and the notes that are playing. Used at the start of a window that doesn't start at the beginning of the song, so midiFile must be empty.
+// Returns the note on of each channel that has one, else nullptr.
+static std::array<SmfEvent*,4> insertStatePreamble(conversion_state& state, const uint64_t midiTime){
+	std::array<SmfEvent*,4> noteOns = {nullptr, nullptr, nullptr, nullptr};
+	gb_chip_state& apu = state.apu;
+	auto insertProperty = [&](const std::pair<uint8_t, bool>& property, uint8_t propertyMax, uint8_t midiCC, uint8_t channel){ // the same CC as handleCommonRegWrite makes for it
+		if (property.second) smfInsertControl(state.midiFile, midiTime, channel, channel, midiCC, convertValToMidiCCrange(property.first, propertyMax));
+	};
+	insertProperty(apu.gb_square1_state.sweep_speed, 7, 16, 0);
+	insertProperty(apu.gb_square1_state.sweep_up_or_down, 1, 18, 0);
+	insertProperty(apu.gb_square1_state.sweep_shift, 7, 17, 0);
+	const std::array<gb_chip_state::square_channels*,2> squareChannels = {&(apu.gb_square1_state), &(apu.gb_square2_state)};
+	for (uint8_t channel=0; channel<2; channel++) {
+		insertProperty(squareChannels[channel]->duty_cycle, 3, 19, channel);
+		insertProperty(squareChannels[channel]->sound_length, 63, 15, channel);
+	}
+	const std::array<std::pair<gb_chip_state::channels_with_env*, uint8_t>,3> envChannels = {std::make_pair(&(apu.gb_square1_state), 0), std::make_pair(&(apu.gb_square2_state), 1), std::make_pair(&(apu.gb_noise_state), 3)};
+	for (const std::pair<gb_chip_state::channels_with_env*, uint8_t>& envChannel : envChannels) {
+		insertProperty(envChannel.first->env_start_vol, 15, SMF_CONTROL_VOLUME, envChannel.second);
+		insertProperty(envChannel.first->env_down_or_up, 1, 12, envChannel.second);
+		insertProperty(envChannel.first->env_length, 7, 13, envChannel.second);
+	}
+	insertProperty(apu.gb_wave_state.sound_length, 255, 15, 2);
+	if (apu.gb_wave_state.volume.second) smfInsertControl(state.midiFile, midiTime, 2, 2, SMF_CONTROL_VOLUME, MIDI_WAVE_VOLUME[apu.gb_wave_state.volume.first]);
+	if (state.prevWavetableIndex != 0xFFFF) insertWavetableIndex(state, midiTime, state.prevWavetableIndex);
+	insertProperty(apu.gb_noise_state.sound_length, 63, 15, 3);
+	insertProperty(apu.gb_noise_state.noise_long_or_short, 1, 20, 3);
+
+	const std::array<gb_chip_state::base_chan_class*,4> channelPointerVector = {&(apu.gb_square1_state), &(apu.gb_square2_state), &(apu.gb_wave_state), &(apu.gb_noise_state)};
+	const std::array<gb_chip_state::melodic_channels*,3> melodicChannels = {&(apu.gb_square1_state), &(apu.gb_square2_state), &(apu.gb_wave_state)};
+	for (uint8_t i=0; i<4; i++) {
+		insertProperty(channelPointerVector[i]->sound_length_enable, 1, 14, i);
+		const std::pair<uint8_t, bool>& panning = channelPointerVector[i]->panning;
+		if (panning.second) {
+			smfInsertControl(state.midiFile, midiTime, i, i, 9, panning.first == 0 ? 0x7F : 0); // pan mute
+			if (panning.first != 0) smfInsertControl(state.midiFile, midiTime, i, i, SMF_CONTROL_PANPOT, panning2midiPan(panning.first));
+		}
+		if (state.legatoState[i]) smfInsertControl(state.midiFile, midiTime, i, i, 68, 0x7F);
+		if (state.curPlayingMidiNote[i] != 0xFF) {
+			if (i != 3 && melodicChannels[i]->pitchLSB.second && melodicChannels[i]->pitchMSB.second)
+				smfInsertPitchBend(state.midiFile, midiTime, i, i, gbPitch2noteAndPitch(melodicChannels[i]->getPitch()).second);
+			if (smfInsertNoteOn(state.midiFile, midiTime, i, i, state.curPlayingMidiNote[i], 0x7F)) noteOns[i] = state.midiFile->track[i]->lastEvent->prevEvent; // the latest event of the track, as they all have the same time
+		}
+	}
+	return noteOns;
+}
+static void removeEvent(SmfTrack* track, SmfEvent* event){ // event can't be the end of track
+	if (event->prevEvent) event->prevEvent->nextEvent = event->nextEvent;
+	else track->firstEvent = event->nextEvent;
+	event->nextEvent->prevEvent = event->prevEvent;
+	smfEventDelete(event);
+}
+Smf* songData2smfWindow(std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, int inPPQN, uint64_t startGbTime, uint64_t endGbTime, run_metrics* metrics){
+	ALLOC_STATS_STAGE(ALLOC_STAGE_CONVERT);
+
+	Smf* midiFile = createSmf(inPPQN);
+	const uint64_t midiTicksPerSecond = midiTicksPerSecondFromPPQN(inPPQN ? inPPQN : 0x7fff);
+	std::vector<uint64_t> regWriteMidiTimes;
+	gbTimes2midiTimes(songData, gbTimeUnitsPerSecond, midiTicksPerSecond, regWriteMidiTimes);
+	const uint64_t startMidiTime = gbTime2midiTime(startGbTime, gbTimeUnitsPerSecond, midiTicksPerSecond);
+	// the window is made of whole ticks, so that the same-tick lookahead sees the same writes as in the whole song. The writes before startGbTime on its tick are on startMidiTime, so no event is made before it.
+	auto isBefore = [](const gb_reg_write& regWrite, uint64_t gbTime){ return regWrite.time < gbTime; };
+	size_t windowStart = std::lower_bound(songData.begin(), songData.end(), startGbTime, isBefore) - songData.begin();
+	size_t windowEnd = std::lower_bound(songData.begin() + windowStart, songData.end(), endGbTime, isBefore) - songData.begin();
+	while (windowStart > 0 && windowStart < songData.size() && regWriteMidiTimes[windowStart] == regWriteMidiTimes[windowStart-1]) windowStart--;
+	while (windowEnd > windowStart && windowEnd < songData.size() && regWriteMidiTimes[windowEnd] == regWriteMidiTimes[windowEnd-1]) windowEnd++;
+
+	// the writes before the window only update the state
+	conversion_state state(songData, regWriteMidiTimes, gbTimeUnitsPerSecond, midiTicksPerSecond, nullptr);
+	for (state.regWriteI=0; state.regWriteI<windowStart; state.regWriteI++){
+		convertRegWrite(state);
+	}
+	state.midiFile = midiFile;
+	const std::array<SmfEvent*,4> preambleNoteOns = insertStatePreamble(state, startMidiTime);
+	for (state.regWriteI=windowStart; state.regWriteI<windowEnd; state.regWriteI++){
+		convertRegWrite(state);
+	}
+	// a note the preamble starts can end on the first tick of the window. Its note off is then sorted before the note on, which would leave it playing, so both are dropped.
+	for (int i=0; i<4; i++) {
+		SmfEvent* noteOn = preambleNoteOns[i];
+		if (noteOn == nullptr) continue;
+		SmfTrack* track = midiFile->track[i];
+		for (SmfEvent* event = track->firstEvent; event != noteOn; event = event->nextEvent) {
+			if (event->data[0] == (SMF_EVENT_NOTEOFF | i) && event->data[1] == noteOn->data[1]) {
+				removeEvent(track, event);
+				removeEvent(track, noteOn);
 				break;
+			}
 		}
-		if (regWriteMidiTime > midiTicksPassed) midiTicksPassed = regWriteMidiTime;
 	}
-	// add wavetables to midi.
-	unsigned int sysexDataSize = 2 /* start and end bytes */ + 32 * uniqueWavetables.size();
-	uint8_t sysexData[sysexDataSize];
-	sysexData[0]=0xF0;
-	unsigned int sysexWaveIndex=0;
-	unsigned int sysexDataIndex=0;
-	for (std::array<std::pair<uint8_t,bool>, 32> curWavetable : uniqueWavetables) {
-		sysexDataIndex = 1+sysexWaveIndex*32;
-		if (sysexDataIndex >= sysexDataSize) {fprintf(stderr, "out of range (1)! %u >= %u\n", sysexDataIndex, sysexDataSize);}
-		for (int i=0; i<32; i++){
-			sysexDataIndex = 1+sysexWaveIndex*32+i;
-			if (sysexDataIndex >= sysexDataSize) {fprintf(stderr, "out of range (2)! %u >= %u\n", sysexDataIndex, sysexDataSize);}
-			sysexData[sysexDataIndex] = curWavetable[i].first & 0x0F; // DO NOT convert wave back to gb format. leave each 4-bit sample in its own byte so that the data can never accidentally match the sysex end byte 0xF7
+	// the window starts at tick 0
+	for (int trackIndex=0; trackIndex < midiFile->numTracks; trackIndex++) {
+		for (SmfEvent* event = midiFile->track[trackIndex]->firstEvent; event != nullptr; event = event->nextEvent) { // the end of track too
+			event->time = (uint64_t)event->time > startMidiTime ? event->time - startMidiTime : 0;
 		}
-		sysexWaveIndex++;
 	}
-	sysexData[sysexDataSize-1]=0xF7;
-	smfInsertSysex(midiFile, 0 /* time */, 0 /* port */, 2 /* wave track */, sysexData, sysexDataSize);
-	
-	/*
-	for (std::array<uint8_t,32> curWavetable : uniqueWavetables) {
-		for (int i=0; i<32; i++){
-			printf("%02X ", curWavetable[i]);
+	state.midiTicksPassed = state.midiTicksPassed > startMidiTime ? state.midiTicksPassed - startMidiTime : 0;
+	finishSmf(midiFile, windowEnd - windowStart, state, metrics);
+	return midiFile;
+}
+
+live_conversion::live_conversion(unsigned int inGbTimeUnitsPerSecond, int inPPQN, event_sink inSink) : sink(inSink) {
+	midiFile = createSmf(inPPQN);
+	state = std::make_unique<conversion_state>(heldRegWrites, heldRegWriteMidiTimes, inGbTimeUnitsPerSecond, midiTicksPerSecondFromPPQN(inPPQN ? inPPQN : 0x7fff), midiFile);
+}
+live_conversion::~live_conversion(){
+	smfDelete(midiFile);
+}
+void live_conversion::addRegWrite(const gb_reg_write& regWrite){
+	ALLOC_STATS_STAGE(ALLOC_STAGE_CONVERT);
+	const uint64_t regWriteMidiTime = gbTime2midiTime(regWrite.time, state->gbTimeUnitsPerSecond, state->midiTicksPerSecond);
+	if (heldRegWrites.empty() == false && regWriteMidiTime != heldRegWriteMidiTimes.back()) convertHeldRegWrites();
+	heldRegWrites.push_back(regWrite);
+	heldRegWriteMidiTimes.push_back(regWriteMidiTime);
+}
+void live_conversion::finish(){
+	ALLOC_STATS_STAGE(ALLOC_STAGE_CONVERT);
+	convertHeldRegWrites();
+	for (int i=0; i<4; i++) { // nothing comes after the last write, so notes that are still playing would never end
+		if (state->curPlayingMidiNote[i] != 0xFF) smfInsertNoteOff(midiFile, state->midiTicksPassed, i, i, state->curPlayingMidiNote[i], 0x7F);
+		state->curPlayingMidiNote[i] = 0xFF;
+	}
+	sendEvents();
+}
+void live_conversion::convertHeldRegWrites(){
+	for (state->regWriteI=0; state->regWriteI < heldRegWrites.size(); state->regWriteI++){
+		convertRegWrite(*state);
+	}
+	regWritesConverted += heldRegWrites.size();
+	heldRegWrites.clear();
+	heldRegWriteMidiTimes.clear();
+	// the wavetable indexes in CC21/CC53 refer to these sysexes, so they have to arrive before them
+	for (; wavetablesSent < state->uniqueWavetables.size(); wavetablesSent++) {
+		const std::vector<uint8_t> sysexData = singleWavetableSysex(state->uniqueWavetables[wavetablesSent], wavetablesSent);
+		sink(state->midiTicksPassed, sysexData.data(), sysexData.size());
+	}
+	sendEvents();
+}
+void live_conversion::sendEvents(){ // every event in midiFile was made at the tick of the writes just converted, so they are all final
+	for (int trackIndex=0; trackIndex < midiFile->numTracks; trackIndex++) {
+		SmfTrack* track = midiFile->track[trackIndex];
+		SmfEvent* event = track->firstEvent;
+		while (event != track->lastEvent) {
+			SmfEvent* nextEvent = event->nextEvent;
+			sink(event->time, event->data, event->size);
+			smfEventDelete(event);
+			event = nextEvent;
 		}
-		printf("\n");
+		track->firstEvent = track->lastEvent; // only the end of track is left
+		track->lastEvent->prevEvent = nullptr;
 	}
-	*/
+}
+// serialises the MThd header into chunks[0] and every track into the chunk after it. The tracks don't depend on each other, so those of a long song are each serialised on their own thread. Every track chunk is complete, with its length backpatched, so the chunks only have to be written in order.
+static bool smf2chunks(Smf* midiFile, std::vector<SmfWriteBuffer>& chunks){
+	ALLOC_STATS_STAGE(ALLOC_STAGE_SERIALISE);
+	const double MIN_PARALLEL_SECONDS = 30; // of song. Below this, starting the threads costs more than serialising the tracks.
+	chunks.resize(midiFile->numTracks + 1);
+	for (SmfWriteBuffer& chunk : chunks) smfWriteBufferInit(&chunk);
+	bool headerWritten = smfWriteHeader(midiFile, &chunks[0]);
+	std::vector<char> trackSerialised(midiFile->numTracks, false); // not vector<bool>, which the threads couldn't write to at the same time
+	auto serialiseTrack = [&](int trackIndex){
+		trackSerialised[trackIndex] = smfTrackSerialize(midiFile->track[trackIndex], &chunks[trackIndex + 1]);
+	};
+	SmfTime endTime = 0;
+	for (int trackIndex=0; trackIndex < midiFile->numTracks; trackIndex++) endTime = std::max(endTime, midiFile->track[trackIndex]->lastEvent->time);
+	const double songSeconds = endTime / (double)midiTicksPerSecondFromPPQN(midiFile->timebase);
+	if (std::thread::hardware_concurrency() > 1 && songSeconds >= MIN_PARALLEL_SECONDS) {
+		std::vector<std::thread> threads;
+		for (int trackIndex=1; trackIndex < midiFile->numTracks; trackIndex++) threads.emplace_back([&serialiseTrack, trackIndex]{
+			ALLOC_STATS_STAGE(ALLOC_STAGE_SERIALISE);
+			serialiseTrack(trackIndex);
+		});
+		if (midiFile->numTracks > 0) serialiseTrack(0);
+		for (std::thread& thread : threads) thread.join();
+	} else {
+		for (int trackIndex=0; trackIndex < midiFile->numTracks; trackIndex++) serialiseTrack(trackIndex);
+	}
+	return headerWritten && std::find(trackSerialised.begin(), trackSerialised.end(), false) == trackSerialised.end();
+}
+static void freeChunks(std::vector<SmfWriteBuffer>& chunks){
+	for (SmfWriteBuffer& chunk : chunks) smfWriteBufferFree(&chunk);
+	chunks.clear();
+}
+// writes the chunks in order, in a single writev call unless the OS takes fewer bytes than that
+static bool writeChunks(const std::vector<SmfWriteBuffer>& chunks, FILE* outFile){
+#ifdef WIN32
+	bool result = true;
+	for (const SmfWriteBuffer& chunk : chunks) result = result && fwrite(chunk.data, 1, chunk.size, outFile) == chunk.size;
+	return result && fflush(outFile) == 0;
+#else
+	if (fflush(outFile) != 0) return false; // writev bypasses the FILE's buffer
+	std::vector<iovec> iov;
+	for (const SmfWriteBuffer& chunk : chunks) {
+		if (chunk.size) iov.push_back({chunk.data, chunk.size});
+	}
+	const int fd = fileno(outFile);
+	size_t first = 0;
+	while (first < iov.size()) {
+		ssize_t written = writev(fd, &iov[first], std::min<size_t>(iov.size() - first, IOV_MAX));
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		while (first < iov.size() && (size_t)written >= iov[first].iov_len) written -= iov[first++].iov_len;
+		if (first < iov.size()) {
+			iov[first].iov_base = (char*)iov[first].iov_base + written;
+			iov[first].iov_len -= written;
+		}
+	}
+	return true;
+#endif
+}
+static bool writeSmf(Smf* midiFile, FILE* outFile, run_metrics* metrics){ // same as smfWriteStream, but serialises the tracks in parallel and times serialisation and writing separately
+	std::vector<SmfWriteBuffer> chunks;
+	stage_timer serialiseTimer;
+	bool result = smf2chunks(midiFile, chunks);
+	double serialiseMilliseconds = serialiseTimer.stop();
+	size_t midiBytes = 0;
+	for (const SmfWriteBuffer& chunk : chunks) midiBytes += chunk.size;
+	double writeMilliseconds = 0;
+	{
+		ALLOC_STATS_STAGE(ALLOC_STAGE_WRITE);
+		stage_timer writeTimer;
+		result = result && writeChunks(chunks, outFile);
+		writeMilliseconds = writeTimer.stop();
+	}
+	freeChunks(chunks);
+	if (metrics) {
+		metrics->serialiseMilliseconds = serialiseMilliseconds;
+		metrics->writeMilliseconds = writeMilliseconds;
+		metrics->midiBytes = midiBytes;
+	}
+	return result;
+}
+bool smf2midiFile(Smf* midiFile, const std::string& outfilename, run_metrics* metrics){
+	if (metrics) countSmfEvents(midiFile, *metrics);
+	if (isUmpClipFilename(outfilename)) return smf2umpClipFile(midiFile, outfilename, metrics);
+	FILE* outFile = (outfilename == "-") ? stdout /* output can be piped */ : fopen(outfilename.c_str(), "wb");
+	if (outFile) errno = 0; // else errno says why it couldn't be opened
+	bool writeSucceeded = outFile && writeSmf(midiFile, outFile, metrics);
+	const int writeError = writeSucceeded ? 0 : errno; // e.g. EPIPE when the reader of stdout has gone
+	if (outFile && outFile != stdout && fclose(outFile) != 0)
+		writeSucceeded = false;
+	if (writeSucceeded == false)
+		fprintf(stderr, "Error: could not write the midi file %s%s%s.\n", outfilename.c_str(), writeError ? ": " : "", writeError ? strerror(writeError) : "");
+	return writeSucceeded;
+}
+bool smf2midiBytes(Smf* midiFile, std::string& midiBytes, run_metrics* metrics){
+	ALLOC_STATS_STAGE(ALLOC_STAGE_SERIALISE);
+	if (metrics) countSmfEvents(midiFile, *metrics);
+	stage_timer serialiseTimer;
+	std::vector<SmfWriteBuffer> chunks;
+	bool result = smf2chunks(midiFile, chunks);
+	if (result) {
+		size_t size = 0;
+		for (const SmfWriteBuffer& chunk : chunks) size += chunk.size;
+		midiBytes.clear();
+		midiBytes.reserve(size);
+		for (const SmfWriteBuffer& chunk : chunks) midiBytes.append((const char*)chunk.data, chunk.size);
+	}
+	freeChunks(chunks);
+	if (metrics) {
+		metrics->serialiseMilliseconds = serialiseTimer.stop();
+		metrics->midiBytes = result ? midiBytes.size() : 0;
+	}
+	return result;
+}
+void smfKeepTracks(Smf* midiFile, uint32_t trackMask){
+	int outTrackIndex = 0;
+	for (int trackIndex=0; trackIndex < midiFile->numTracks; trackIndex++) {
+		if (trackIndex < 32 && (trackMask & ((uint32_t)1 << trackIndex)) == 0) {
+			smfTrackDelete(midiFile->track[trackIndex]);
+		} else {
+			midiFile->track[outTrackIndex++] = midiFile->track[trackIndex];
+		}
+	}
+	midiFile->numTracks = outTrackIndex;
+}
+void smfDropPitchBends(Smf* midiFile){
+	for (int trackIndex=0; trackIndex < midiFile->numTracks; trackIndex++) {
+		SmfTrack* track = midiFile->track[trackIndex];
+		SmfEvent* event = track->firstEvent;
+		while (event) {
+			SmfEvent* nextEvent = event->nextEvent;
+			if ((event->data[0] & 0xF0) == SMF_EVENT_PITCHBEND) {
+				if (event->prevEvent) event->prevEvent->nextEvent = nextEvent;
+				else track->firstEvent = nextEvent;
+				if (nextEvent) nextEvent->prevEvent = event->prevEvent;
+				else track->lastEvent = event->prevEvent;
+				smfEventDelete(event);
+			}
+			event = nextEvent;
+		}
+	}
+}
+bool songData2midi(std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, std::string outfilename, int inPPQN, run_metrics* metrics, unsigned int threadCount, uint32_t trackMask, double BPM){
+	stage_timer totalTimer;
 	
-	smfSetEndTimingOfTrack(midiFile, 0, midiTicksPassed);
-	smfSetEndTimingOfTrack(midiFile, 1, midiTicksPassed);
-	smfSetEndTimingOfTrack(midiFile, 2, midiTicksPassed);
-	smfSetEndTimingOfTrack(midiFile, 3, midiTicksPassed);
-	smfWriteFile(midiFile, outfilename.c_str());
+	if (verboseOutput) {
+		fprintf(stderr, "midiTicksPerSecond: %f\n", midiTicksPerSecondAtBPM(inPPQN ? inPPQN : 0x7fff, BPM));
+		fprintf(stderr, "gbTimeUnitsPerSecond: %u\n", gbTimeUnitsPerSecond);
+	}
+	stage_timer convertTimer;
+	Smf* midiFile = threadCount == 1 ? songData2smf(songData, gbTimeUnitsPerSecond, inPPQN, metrics, BPM) : songData2smfParallel(songData, gbTimeUnitsPerSecond, inPPQN, metrics, threadCount, BPM);
+	smfKeepTracks(midiFile, trackMask);
+	if (metrics) metrics->convertMilliseconds = convertTimer.stop();
+	bool writeSucceeded = smf2midiFile(midiFile, outfilename, metrics);
+	smfDelete(midiFile);
 	
-	auto stop = std::chrono::high_resolution_clock::now();
-	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start);
-	printf("songData2midi: %ld milliseconds.\n", duration.count());
-	return true;
+	if (verboseOutput) fprintf(stderr, "songData2midi: %.0f milliseconds.\n", totalTimer.stop());
+	return writeSucceeded;
 }
@@ -1,8 +1,54 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
+#include <memory>
+#include <functional>
 
 #include "gb_reg_write.h"
+#include "libsmfc.h"
+#include "run_metrics.hpp"
 
-bool songData2midi(std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, std::string outfilename, int inPPQN);
\ No newline at end of file
+const double DEFAULT_MIDI_BPM = 120; // the tempo of the midi file unless a BPM is given. No tempo event is written for it.
+
+uint64_t midiTicksPerSecondFromPPQN(int PPQN); // at 120 BPM
+double midiTicksPerSecondAtBPM(int PPQN, double BPM); // at the tempo the midi file's tempo event gives, so the song plays at its real speed. The same as midiTicksPerSecondFromPPQN at 120 BPM.
+uint64_t midiTicksPerSoundLenTickFromTicksPerSecond(double midiTicksPerSecond); // sound length counts in 1/256 s steps
+uint64_t gbTime2midiTime(uint64_t gbTime, unsigned int gbTimeUnitsPerSecond, const double midiTicksPerSecond);
+void gbTimes2midiTimes(const std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, const double midiTicksPerSecond, std::vector<uint64_t>& midiTimes); // midiTimes[i] = gbTime2midiTime(songData[i].time, ...) for the whole stream in one pass. songData must be in time order.
+// the caller owns the returned Smf and frees it with smfDelete. A BPM other than 120 adds a tempo event to the first track, and the converter works on the ticks of that tempo, so the song still plays at the same speed.
+Smf* songData2smf(std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, int inPPQN, run_metrics* metrics = nullptr, double BPM = DEFAULT_MIDI_BPM);
+bool smf2midiFile(Smf* midiFile, const std::string& outfilename, run_metrics* metrics = nullptr); // writes to stdout if outfilename is "-", and a midi 2.0 clip file if it ends in .midi2
+bool smf2midiBytes(Smf* midiFile, std::string& midiBytes, run_metrics* metrics = nullptr); // the whole midi file in memory, for callers that don't write it to a file
+// runs the conversion without making a midi file. metrics gets what songData2smf's midi file would contain: the events of each type per track, the wave tables, how fast the wave channel changes (to spot sample playback) and the projected size of the file.
+void songData2stats(const std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, int inPPQN, run_metrics& metrics);
+// the same result as songData2smf, made by threadCount threads (one per hardware thread if 0). Each converts one time shard of songData, starting from the state a replay of the writes before it left. Short songs are converted on the calling thread.
+Smf* songData2smfParallel(std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, int inPPQN, run_metrics* metrics = nullptr, unsigned int threadCount = 0, double BPM = DEFAULT_MIDI_BPM);
+// converts only the writes from startGbTime to endGbTime, with startGbTime at tick 0. The writes before the window only update the converter's state, which is then sent at tick 0: the CCs of every register that has been written, the panning, the selected wave table and the notes that are playing.
+Smf* songData2smfWindow(std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, int inPPQN, uint64_t startGbTime, uint64_t endGbTime, run_metrics* metrics = nullptr);
+void smfKeepTracks(Smf* midiFile, uint32_t trackMask); // deletes the tracks whose bit in trackMask isn't set. The other tracks close up.
+void smfDropPitchBends(Smf* midiFile); // deletes every pitch bend event, so each note plays at its midi note's pitch
+bool songData2midi(std::vector<gb_reg_write>& songData, unsigned int gbTimeUnitsPerSecond, std::string outfilename, int inPPQN, run_metrics* metrics = nullptr, unsigned int threadCount = 1, uint32_t trackMask = 0xFFFFFFFF, double BPM = DEFAULT_MIDI_BPM); // threadCount as in songData2smfParallel. 1 uses songData2smf. trackMask as in smfKeepTracks.
+struct conversion_state; // defined in to_midi.cpp
+// Converts a register stream while it is still arriving, e.g. from a running gbsplay, and hands each midi event to sink as soon as it is final.
+// A write is converted once a write on a later midi tick arrives, so that the same-tick lookahead still sees every write it needs. The events are the same as songData2smf's, in time order, except for the wavetable sysex: each new wavetable is sent on its own, with its index, before the first CC21/CC53 that selects it. See the header of to_midi.cpp for the format.
+class live_conversion {
+public:
+	typedef std::function<void(uint64_t midiTime, const uint8_t* data, size_t dataSize)> event_sink;
+	live_conversion(unsigned int gbTimeUnitsPerSecond, int inPPQN, event_sink sink);
+	~live_conversion();
+	void addRegWrite(const gb_reg_write& regWrite); // writes must arrive in time order
+	void finish(); // converts the writes still held back and ends the notes that are still playing
+	size_t regWritesProcessed() const { return regWritesConverted; }
+private:
+	void convertHeldRegWrites();
+	void sendEvents();
+	std::vector<gb_reg_write> heldRegWrites; // the writes on the latest midi tick. They are the songData of state.
+	std::vector<uint64_t> heldRegWriteMidiTimes;
+	Smf* midiFile;
+	std::unique_ptr<conversion_state> state;
+	event_sink sink;
+	size_t wavetablesSent = 0;
+	size_t regWritesConverted = 0;
+};
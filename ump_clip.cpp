@@ -0,0 +1,229 @@
+/*
+This file contains the writer for MIDI 2.0 Clip Files (.midi2), which hold Universal MIDI Packets (UMP) instead of midi 1.0 events.
+
+Each track of a converted song is one channel. The tracks are translated one at a time and then merged in time order:
+- Note ons and note offs become midi 2.0 note ons and note offs, and CCs become midi 2.0 CCs. Velocities and values are scaled up to 16 and 32 bits.
+- The pitch of a note is sent as Registered Per-Note Controller 3, Pitch 7.25: the note number in the top 7 bits and the fraction of a semitone in the other 25. The converter's pitch bends are 4096 per semitone, so every GB period keeps its exact pitch. It is sent right before every trigger, at the same clockstamp, since per-note controllers stay set for the note number after the note ends, and the note must start at its own pitch.
+- When the GB's pitch moves past what a pitch bend covers, the converter ends the note and starts the next one with legato (CC68) on. In the clip, that is a pitch change of the note that is already playing. The pitch bends and CC68s aren't needed and are left out, so a note on in the clip is always a trigger.
+- The wavetable sysex is sent in Data 64 packets, and a tempo event as a Flex Data Set Tempo.
+
+File layout: "SMF2CLIP", the clip configuration header (the ticks per quarter note), then the clip sequence from Start of Clip to End of Clip. Every message is preceded by a Delta Clockstamp with the ticks since the previous one. Every word is big endian.
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <array>
+#include <algorithm>
+
+#include "ump_clip.hpp"
+#include "alloc_stats.hpp"
+
+#define SMF_EVENT_NOTEOFF       0x80
+#define SMF_EVENT_NOTEON        0x90
+#define SMF_EVENT_CONTROL       0xb0
+#define SMF_EVENT_PITCHBEND     0xe0
+#define SMF_EVENT_SYSEX         0xf0
+#define SMF_EVENT_META          0xff
+#define SMF_META_TEMPO          0x51
+
+static const char CLIP_FILE_MAGIC[8] = {'S', 'M', 'F', '2', 'C', 'L', 'I', 'P'};
+static const uint32_t MAX_DELTA_CLOCKSTAMP = 0xFFFFF; // 20 bits. Longer gaps are several Delta Clockstamps in a row.
+static const uint8_t LEGATO_CC = 68;
+static const uint8_t PER_NOTE_PITCH_7_25 = 3; // the Registered Per-Note Controller index
+
+struct ump_message {
+	uint64_t time; // midi ticks
+	std::array<uint32_t,4> words;
+	uint8_t wordCount;
+};
+
+bool isUmpClipFilename(const std::string& filename){
+	return filename.length() >= 6 && filename.substr(filename.length()-6, 6) == ".midi2";
+}
+
+// midi 2.0's min-center-max scaling: 0, the center and the maximum of sourceBits stay 0, the center and the maximum of destinationBits
+static uint32_t scaleUp(uint32_t value, int sourceBits, int destinationBits){
+	const int scaleBits = destinationBits - sourceBits;
+	uint32_t scaled = value << scaleBits;
+	if (value <= ((uint32_t)1 << (sourceBits - 1))) return scaled;
+	const int repeatBits = sourceBits - 1;
+	uint32_t repeatValue = value & (((uint32_t)1 << repeatBits) - 1);
+	repeatValue = scaleBits > repeatBits ? repeatValue << (scaleBits - repeatBits) : repeatValue >> (repeatBits - scaleBits);
+	while (repeatValue != 0) {
+		scaled |= repeatValue;
+		repeatValue >>= repeatBits;
+	}
+	return scaled;
+}
+static uint32_t pitch725(uint8_t note, int pitchBend){ // pitchBend is the converter's, 4096 per semitone
+	const int64_t pitch = ((int64_t)note << 25) + ((int64_t)pitchBend << 13);
+	return (uint32_t)std::clamp<int64_t>(pitch, 0, UINT32_MAX);
+}
+static ump_message channelVoiceMessage(uint64_t time, uint8_t status, uint8_t index, uint8_t attribute, uint32_t data){ // midi 2.0 channel voice, group 1
+	return {time, {((uint32_t)0x4 << 28) | ((uint32_t)status << 16) | ((uint32_t)index << 8) | attribute, data, 0, 0}, 2};
+}
+static ump_message noteMessage(uint64_t time, uint8_t status, uint8_t note, uint8_t velocity){
+	return channelVoiceMessage(time, status, note, 0 /* no attribute */, scaleUp(velocity, 7, 16) << 16);
+}
+static ump_message perNotePitchMessage(uint64_t time, uint8_t channel, uint8_t note, uint32_t pitch){
+	return channelVoiceMessage(time, 0x00 /* Registered Per-Note Controller */ | channel, note, PER_NOTE_PITCH_7_25, pitch);
+}
+
+static void translateSysex(const SmfEvent* event, std::vector<ump_message>& messages){ // F0, the length, the data and F7
+	size_t pos = 1;
+	while (pos < event->size && (event->data[pos] & 0x80)) pos++;
+	pos++;
+	size_t end = event->size;
+	if (end > pos && event->data[end-1] == 0xF7) end--;
+	const size_t dataSize = end > pos ? end - pos : 0;
+	for (size_t packetStart = 0; packetStart < dataSize || packetStart == 0; packetStart += 6) {
+		const size_t packetSize = std::min<size_t>(6, dataSize - packetStart);
+		const bool first = packetStart == 0;
+		const bool last = packetStart + packetSize >= dataSize;
+		const uint32_t packetStatus = first ? (last ? 0x0 : 0x1) : (last ? 0x3 : 0x2); // complete, start, continue, end
+		std::array<uint8_t,6> bytes{};
+		std::copy(event->data + pos + packetStart, event->data + pos + packetStart + packetSize, bytes.begin());
+		messages.push_back({(uint64_t)event->time, {((uint32_t)0x3 << 28) | (packetStatus << 20) | ((uint32_t)packetSize << 16) | ((uint32_t)bytes[0] << 8) | bytes[1],
+			((uint32_t)bytes[2] << 24) | ((uint32_t)bytes[3] << 16) | ((uint32_t)bytes[4] << 8) | bytes[5], 0, 0}, 2});
+		if (dataSize == 0) break;
+	}
+}
+
+// what is known about a track's channel while its events are translated
+struct channel_translation {
+	uint8_t midiNote = 0xFF; // the note the converter says is playing. 0xFF means none.
+	uint8_t umpNote = 0xFF; // the note number of the clip's note that is playing, which a legato pitch change keeps
+	int pitchBend = 0; // the converter's latest pitch bend, -8192 to 8191
+	bool legato = false;
+};
+static bool noteOnFollows(const SmfEvent* event, const SmfEvent* tickEnd){ // on the same tick
+	for (event = event->nextEvent; event != tickEnd; event = event->nextEvent) {
+		if ((event->data[0] & 0xF0) == SMF_EVENT_NOTEON && event->size >= 3 && event->data[2] != 0) return true;
+	}
+	return false;
+}
+static void translateTrack(const SmfTrack* track, std::vector<ump_message>& messages){
+	channel_translation channel;
+	const SmfEvent* event = track->firstEvent;
+	while (event != nullptr) {
+		// the events of a tick are translated together: whether a note off and a note on are a legato pitch change depends on the CC68 after them
+		const SmfEvent* tickEnd = event;
+		bool legatoAfterTick = channel.legato;
+		for (; tickEnd != nullptr && tickEnd->time == event->time; tickEnd = tickEnd->nextEvent) {
+			if ((tickEnd->data[0] & 0xF0) == SMF_EVENT_CONTROL && tickEnd->data[1] == LEGATO_CC) legatoAfterTick = tickEnd->data[2] >= 64;
+		}
+		for (; event != tickEnd; event = event->nextEvent) {
+			const uint64_t time = event->time;
+			const uint8_t status = event->data[0];
+			const uint8_t channelIndex = status & 0x0F;
+			const bool isNoteOff = (status & 0xF0) == SMF_EVENT_NOTEOFF || ((status & 0xF0) == SMF_EVENT_NOTEON && event->data[2] == 0);
+			if (isNoteOff) {
+				const bool legatoPitchChange = legatoAfterTick && channel.umpNote != 0xFF && noteOnFollows(event, tickEnd);
+				if (legatoPitchChange == false && channel.umpNote != 0xFF) { // else the note keeps playing and takes the next note's pitch
+					messages.push_back(noteMessage(time, SMF_EVENT_NOTEOFF | channelIndex, channel.umpNote, event->data[2]));
+					channel.umpNote = 0xFF;
+				}
+				channel.midiNote = 0xFF;
+			} else if ((status & 0xF0) == SMF_EVENT_NOTEON) {
+				channel.midiNote = event->data[1];
+				if (channel.umpNote != 0xFF && legatoAfterTick == false) { // the converter always ends a note first, but a note on is a trigger unless it's legato
+					messages.push_back(noteMessage(time, SMF_EVENT_NOTEOFF | channelIndex, channel.umpNote, 0x7F));
+					channel.umpNote = 0xFF;
+				}
+				if (channel.umpNote == 0xFF) {
+					// the pitch goes first, even without a bend: a receiver keeps the last pitch sent for a note number, which may be an earlier note's bent one, and the note must start at its own
+					messages.push_back(perNotePitchMessage(time, channelIndex, channel.midiNote, pitch725(channel.midiNote, channel.pitchBend)));
+					messages.push_back(noteMessage(time, status, channel.midiNote, event->data[2]));
+					channel.umpNote = channel.midiNote;
+				} else {
+					messages.push_back(perNotePitchMessage(time, channelIndex, channel.umpNote, pitch725(channel.midiNote, channel.pitchBend)));
+				}
+			} else if ((status & 0xF0) == SMF_EVENT_PITCHBEND) {
+				channel.pitchBend = (((int)event->data[2] << 7) | event->data[1]) - 8192;
+				if (channel.umpNote != 0xFF && noteOnFollows(event, tickEnd) == false) // a note on after it sends the pitch itself
+					messages.push_back(perNotePitchMessage(time, channelIndex, channel.umpNote, pitch725(channel.midiNote, channel.pitchBend)));
+			} else if ((status & 0xF0) == SMF_EVENT_CONTROL) {
+				if (event->data[1] == LEGATO_CC) channel.legato = event->data[2] >= 64;
+				else messages.push_back(channelVoiceMessage(time, status, event->data[1], 0, scaleUp(event->data[2], 7, 32)));
+			} else if (status == SMF_EVENT_SYSEX) {
+				translateSysex(event, messages);
+			} else if (status == SMF_EVENT_META && event->size >= 6 && event->data[1] == SMF_META_TEMPO) {
+				const uint32_t microsecondsPerQuarterNote = ((uint32_t)event->data[3] << 16) | ((uint32_t)event->data[4] << 8) | event->data[5];
+				messages.push_back({time, {0xD0100000 /* Flex Data, complete, to the group, Set Tempo */, microsecondsPerQuarterNote * 100 /* in 10 ns */, 0, 0}, 4});
+			} // the other meta events (end of track, port) have no place in a clip
+		}
+	}
+}
+
+static void appendWord(std::vector<uint8_t>& bytes, uint32_t word){
+	bytes.push_back(word >> 24);
+	bytes.push_back((word >> 16) & 0xFF);
+	bytes.push_back((word >> 8) & 0xFF);
+	bytes.push_back(word & 0xFF);
+}
+static void appendDeltaClockstamp(std::vector<uint8_t>& bytes, uint64_t ticks){
+	while (ticks > MAX_DELTA_CLOCKSTAMP) {
+		appendWord(bytes, 0x00400000 | MAX_DELTA_CLOCKSTAMP);
+		ticks -= MAX_DELTA_CLOCKSTAMP;
+	}
+	appendWord(bytes, 0x00400000 | (uint32_t)ticks);
+}
+bool smf2umpClipFile(Smf* midiFile, const std::string& outfilename, run_metrics* metrics){
+	ALLOC_STATS_STAGE(ALLOC_STAGE_SERIALISE);
+	stage_timer serialiseTimer;
+	std::vector<std::vector<ump_message>> trackMessages(midiFile->numTracks);
+	uint64_t endTime = 0;
+	for (int trackIndex=0; trackIndex < midiFile->numTracks; trackIndex++) {
+		translateTrack(midiFile->track[trackIndex], trackMessages[trackIndex]);
+		endTime = std::max<uint64_t>(endTime, midiFile->track[trackIndex]->lastEvent->time); // the end of track
+	}
+
+	std::vector<uint8_t> bytes(CLIP_FILE_MAGIC, CLIP_FILE_MAGIC + sizeof(CLIP_FILE_MAGIC));
+	appendDeltaClockstamp(bytes, 0);
+	appendWord(bytes, 0x00300000 | (midiFile->timebase & 0xFFFF)); // Delta Clockstamp Ticks Per Quarter Note
+	appendDeltaClockstamp(bytes, 0);
+	for (uint32_t word : {0xF0200000, 0u, 0u, 0u}) appendWord(bytes, word); // Start of Clip
+	// the tracks are merged in time order. Messages on the same tick keep their track's order, and lower tracks go first.
+	std::vector<size_t> nextMessage(trackMessages.size(), 0);
+	uint64_t prevTime = 0;
+	size_t messageCount = 0;
+	while (true) {
+		int earliestTrack = -1;
+		for (size_t trackIndex=0; trackIndex < trackMessages.size(); trackIndex++) {
+			if (nextMessage[trackIndex] == trackMessages[trackIndex].size()) continue;
+			if (earliestTrack == -1 || trackMessages[trackIndex][nextMessage[trackIndex]].time < trackMessages[earliestTrack][nextMessage[earliestTrack]].time) earliestTrack = trackIndex;
+		}
+		if (earliestTrack == -1) break;
+		const ump_message& message = trackMessages[earliestTrack][nextMessage[earliestTrack]++];
+		appendDeltaClockstamp(bytes, message.time - prevTime);
+		for (int i=0; i < message.wordCount; i++) appendWord(bytes, message.words[i]);
+		prevTime = message.time;
+		messageCount++;
+	}
+	appendDeltaClockstamp(bytes, endTime > prevTime ? endTime - prevTime : 0);
+	for (uint32_t word : {0xF0210000, 0u, 0u, 0u}) appendWord(bytes, word); // End of Clip
+	const double serialiseMilliseconds = serialiseTimer.stop();
+
+	bool writeSucceeded;
+	double writeMilliseconds;
+	{
+		ALLOC_STATS_STAGE(ALLOC_STAGE_WRITE);
+		stage_timer writeTimer;
+		FILE* outFile = fopen(outfilename.c_str(), "wb");
+		writeSucceeded = outFile && fwrite(bytes.data(), 1, bytes.size(), outFile) == bytes.size();
+		if (outFile && fclose(outFile) != 0)
+			writeSucceeded = false;
+		writeMilliseconds = writeTimer.stop();
+	}
+	if (writeSucceeded == false)
+		fprintf(stderr, "Error: could not write the midi 2.0 clip file %s.\n", outfilename.c_str());
+	if (metrics) {
+		metrics->serialiseMilliseconds = serialiseMilliseconds;
+		metrics->writeMilliseconds = writeMilliseconds;
+		metrics->midiBytes = bytes.size();
+		metrics->umpMessages = messageCount;
+	}
+	return writeSucceeded;
+}
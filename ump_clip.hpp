@@ -0,0 +1,10 @@
+#pragma once
+
+#include <string>
+
+#include "libsmfc.h"
+#include "run_metrics.hpp"
+
+bool isUmpClipFilename(const std::string& filename); // .midi2
+// writes midiFile, as made by songData2smf or songData2variantSmf, as a MIDI 2.0 Clip File. See ump_clip.cpp for how its events are translated.
+bool smf2umpClipFile(Smf* midiFile, const std::string& outfilename, run_metrics* metrics = nullptr);